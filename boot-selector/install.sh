@@ -155,6 +155,16 @@ FLAG="/run/boot-selector-done"
 
 log() { echo "$(date '+%Y-%m-%d %H:%M:%S') RUN: $*" >> "$LOGFILE"; }
 
+# Milisegundos desde el arranque, el mismo reloj que usa selector.py
+# (/proc/uptime tiene resolucion de 10 ms)
+stamp() { local up; read -r up _ < /proc/uptime; echo "${up/./}0"; }
+T_RUN=$(stamp)
+
+# Tiempos maximos: cada espera termina en cuanto se cumple su condicion
+USB_TIMEOUT=2
+PLYMOUTH_TIMEOUT=0.5
+VT_TIMEOUT=0.3
+
 log "========================================"
 log "run.sh started (PID=$$)"
 
@@ -163,15 +173,27 @@ if [ -f "$FLAG" ]; then
     exit 0
 fi
 
-# Esperar USB
-log "Waiting 2s for USB..."
-sleep 2
+# Esperar USB: a que udev procese los dispositivos ya conectados.
+# Un mando conectado despues lo recoge selector.py en caliente.
+START_MS=$(date +%s%3N)
+if command -v udevadm &>/dev/null; then
+    udevadm settle --timeout="$USB_TIMEOUT" 2>/dev/null \
+        && log "udev settled in $(( $(date +%s%3N) - START_MS )) ms" \
+        || log "udev settle timed out after ${USB_TIMEOUT}s"
+else
+    log "udevadm not found, waiting ${USB_TIMEOUT}s for USB..."
+    sleep "$USB_TIMEOUT"
+fi
 
-# Detener Plymouth si existe
+# Detener Plymouth si existe, esperando a que termine de verdad
 if command -v plymouth &>/dev/null; then
-    log "Stopping Plymouth..."
-    plymouth quit 2>/dev/null && log "Plymouth quit OK" || log "Plymouth quit failed"
-    sleep 0.5
+    if plymouth --ping 2>/dev/null; then
+        log "Stopping Plymouth..."
+        plymouth quit 2>/dev/null && log "Plymouth quit OK" || log "Plymouth quit failed"
+        timeout "$PLYMOUTH_TIMEOUT" plymouth --wait 2>/dev/null || log "Plymouth still running"
+    else
+        log "Plymouth not running (skipping)"
+    fi
 else
     log "Plymouth not found (skipping)"
 fi
@@ -187,17 +209,31 @@ finally:
     os.close(fd)
 " 2>/dev/null && log "tty1 KD_TEXT OK" || log "tty1 KD_TEXT failed"
 
-# Cambiar a tty1
+# Cambiar a tty1; chvt espera el cambio, VT_WAITACTIVE cubre el resto
 log "Switching to tty1..."
 chvt 1 2>/dev/null && log "chvt 1 OK" || log "chvt 1 failed"
-sleep 0.3
+if [ "$(cat /sys/class/tty/tty0/active 2>/dev/null)" != "tty1" ]; then
+    timeout "$VT_TIMEOUT" /usr/bin/python3 -c "
+import fcntl, os
+fd = os.open('/dev/tty0', os.O_RDONLY)
+try:
+    fcntl.ioctl(fd, 0x5607, 1)
+finally:
+    os.close(fd)
+" 2>/dev/null && log "tty1 active" || log "tty1 not active after ${VT_TIMEOUT}s"
+fi
 
 # Limpiar pantalla
 printf '\033[2J\033[H' > /dev/tty1 2>/dev/null
 
-# Ejecutar selector
+# Ejecutar selector importandolo, para que Python use su bytecode de
+# __pycache__ y lo recompile si cambia el fuente o la version de Python;
+# sin site de usuario y con los modulos congelados de Python 3.11+ (antes
+# se ignora)
+SELECTOR_RUN='import sys; sys.path[0] = "/opt/boot-selector"; import selector; selector.run()'
 log "Starting selector.py on tty1..."
-/usr/bin/python3 /opt/boot-selector/selector.py < /dev/tty1 > /dev/tty1 2>> "$LOGFILE"
+BOOT_SELECTOR_T_RUN="$T_RUN" BOOT_SELECTOR_T_TTY="$(stamp)" \
+    /usr/bin/python3 -s -X frozen_modules=on -c "$SELECTOR_RUN" < /dev/tty1 > /dev/tty1 2>> "$LOGFILE"
 RESULT=$?
 log "selector.py exited with code $RESULT"
 
@@ -217,23 +253,100 @@ Boot Selector - Gamepad USB + Teclado.
 Usa evdev para leer el gamepad directamente.
 """
 
+# Only what the first frame needs is imported here; the rest (evdev,
+# logging, json, subprocess...) loads where it is used, after the menu
+# is on screen.
 import os
 import sys
+import math
 import time
+import atexit
 import select
-import logging
-import subprocess
-import re
-import shutil
+
+# --- Boot timing ---
+#
+# Milliseconds since boot (CLOCK_BOOTTIME, the clock behind /proc/uptime)
+# at each phase. run.sh passes its own through the environment; all of
+# them go to the log as one "timing" line that test.sh --bench collects.
+
+def _now_ms():
+    return round(time.clock_gettime(time.CLOCK_BOOTTIME) * 1000, 1)
+
+PHASES = {}
+for _phase in ("run", "tty"):
+    try:
+        PHASES[_phase] = float(os.environ["BOOT_SELECTOR_T_" + _phase.upper()])
+    except (KeyError, ValueError):
+        pass
+PHASES["python"] = _now_ms()
+
+def mark(phase):
+    """Record the first time a phase is reached"""
+    PHASES.setdefault(phase, _now_ms())
+
+_timing_logged = False
+
+def log_timing():
+    """The timing line, once per run"""
+    global _timing_logged
+    if not _timing_logged:
+        import json
+        _timing_logged = True
+        log.info("timing %s", json.dumps(PHASES))
 
 # --- Logging ---
+#
+# Records are held in memory until the menu is up (or the process exits)
+# and only then handed to the logging module, so neither the import nor
+# the log file sit in front of the first frame.
 
-logging.basicConfig(
-    filename="/var/log/boot-selector.log",
-    level=logging.DEBUG,
-    format="%(asctime)s %(levelname)s: %(message)s",
-)
-log = logging.getLogger("boot-selector")
+LOG_FILE = "/var/log/boot-selector.log"
+
+class BufferedLog:
+    def __init__(self):
+        self.records = []
+        self.real = None
+
+    def _log(self, level, msg, args, exc_info=False):
+        if self.real:
+            self.real.log(level, msg, *args, exc_info=exc_info)
+        else:
+            self.records.append((time.time(), level, msg, args, sys.exc_info() if exc_info else None))
+
+    def debug(self, msg, *args):
+        self._log(10, msg, args)
+
+    def info(self, msg, *args):
+        self._log(20, msg, args)
+
+    def warning(self, msg, *args):
+        self._log(30, msg, args)
+
+    def error(self, msg, *args):
+        self._log(40, msg, args)
+
+    def exception(self, msg, *args):
+        self._log(40, msg, args, exc_info=True)
+
+    def flush(self):
+        """Open the log file and write out everything held so far"""
+        if self.real:
+            return
+        import logging
+        logging.basicConfig(
+            filename=LOG_FILE,
+            level=logging.DEBUG,
+            format="%(asctime)s %(levelname)s: %(message)s",
+        )
+        self.real = logging.getLogger("boot-selector")
+        for created, level, msg, args, exc in self.records:
+            record = self.real.makeRecord(self.real.name, level, __file__, 0, msg, args, exc)
+            record.created, record.msecs = created, (created % 1) * 1000
+            self.real.handle(record)
+        self.records = None
+
+log = BufferedLog()
+atexit.register(log.flush)
 log.info("selector.py started (PID=%d)", os.getpid())
 
 # --- Config ---
@@ -246,15 +359,13 @@ COMPANY_SITE = "nuevauno.com"
 COMPANY_EMAIL = "hola@nuevauno.com"
 
 # --- evdev ---
+#
+# Imported by load_evdev() once the first frame is up. Until then the
+# module and the code tables below are empty.
 
-try:
-    import evdev
-    from evdev import ecodes
-    HAS_EVDEV = True
-    log.info("evdev OK")
-except ImportError:
-    HAS_EVDEV = False
-    log.warning("evdev not available")
+evdev = None
+ecodes = None
+HAS_EVDEV = False
 
 # --- Colors ---
 
@@ -265,7 +376,7 @@ class C:
     W = '\033[1;37m'
     N = '\033[0m'
 
-ANSI_RE = re.compile(r"\x1b\[[0-9;]*m")
+COLORS = (C.G, C.Y, C.CN, C.W, C.N)
 
 # --- Gamepad ---
 
@@ -293,55 +404,50 @@ GAMEPAD_NAME_HINTS = (
     "8bitdo", "snes", "genesis", "retro", "stadia", "logitech"
 )
 
-ABS_GAMEPAD_AXES = {
+ABS_GAMEPAD_AXIS_NAMES = (
     # Sticks / triggers / dpad hat
-    getattr(ecodes, "ABS_X", None),
-    getattr(ecodes, "ABS_Y", None),
-    getattr(ecodes, "ABS_RX", None),
-    getattr(ecodes, "ABS_RY", None),
-    getattr(ecodes, "ABS_Z", None),
-    getattr(ecodes, "ABS_RZ", None),
-    getattr(ecodes, "ABS_HAT0X", None),
-    getattr(ecodes, "ABS_HAT0Y", None),
-}
-ABS_GAMEPAD_AXES = {c for c in ABS_GAMEPAD_AXES if c is not None}
-
-GAMEPAD_BUTTONS = {
-    getattr(ecodes, "BTN_GAMEPAD", None),
-    getattr(ecodes, "BTN_JOYSTICK", None),
-    getattr(ecodes, "BTN_SOUTH", None),
-    getattr(ecodes, "BTN_EAST", None),
-    getattr(ecodes, "BTN_NORTH", None),
-    getattr(ecodes, "BTN_WEST", None),
-    getattr(ecodes, "BTN_TL", None),
-    getattr(ecodes, "BTN_TR", None),
-    getattr(ecodes, "BTN_TL2", None),
-    getattr(ecodes, "BTN_TR2", None),
-    getattr(ecodes, "BTN_SELECT", None),
-    getattr(ecodes, "BTN_START", None),
-    getattr(ecodes, "BTN_MODE", None),
-    getattr(ecodes, "BTN_THUMBL", None),
-    getattr(ecodes, "BTN_THUMBR", None),
-    getattr(ecodes, "BTN_TRIGGER", None),
-    getattr(ecodes, "BTN_THUMB", None),
-}
-GAMEPAD_BUTTONS = {c for c in GAMEPAD_BUTTONS if c is not None}
-
-DPAD_UP = getattr(ecodes, "BTN_DPAD_UP", None)
-DPAD_DOWN = getattr(ecodes, "BTN_DPAD_DOWN", None)
-
-SELECT_BUTTONS = {
-    getattr(ecodes, "BTN_SOUTH", None),
-    getattr(ecodes, "BTN_EAST", None),
-    getattr(ecodes, "BTN_START", None),
-    getattr(ecodes, "BTN_SELECT", None),
-    getattr(ecodes, "BTN_MODE", None),
-    getattr(ecodes, "BTN_A", None),
-    getattr(ecodes, "BTN_B", None),
-    getattr(ecodes, "BTN_X", None),
-    getattr(ecodes, "BTN_Y", None),
-}
-SELECT_BUTTONS = {c for c in SELECT_BUTTONS if c is not None}
+    "ABS_X", "ABS_Y", "ABS_RX", "ABS_RY", "ABS_Z", "ABS_RZ", "ABS_HAT0X", "ABS_HAT0Y",
+)
+
+GAMEPAD_BUTTON_NAMES = (
+    "BTN_GAMEPAD", "BTN_JOYSTICK", "BTN_SOUTH", "BTN_EAST", "BTN_NORTH", "BTN_WEST",
+    "BTN_TL", "BTN_TR", "BTN_TL2", "BTN_TR2", "BTN_SELECT", "BTN_START", "BTN_MODE",
+    "BTN_THUMBL", "BTN_THUMBR", "BTN_TRIGGER", "BTN_THUMB",
+)
+
+SELECT_BUTTON_NAMES = (
+    "BTN_SOUTH", "BTN_EAST", "BTN_START", "BTN_SELECT", "BTN_MODE",
+    "BTN_A", "BTN_B", "BTN_X", "BTN_Y",
+)
+
+ABS_GAMEPAD_AXES = set()
+GAMEPAD_BUTTONS = set()
+SELECT_BUTTONS = set()
+DPAD_UP = None
+DPAD_DOWN = None
+
+def load_evdev():
+    """Import evdev and resolve the code tables; False if it is missing"""
+    global evdev, ecodes, HAS_EVDEV, ABS_GAMEPAD_AXES, GAMEPAD_BUTTONS, SELECT_BUTTONS
+    global DPAD_UP, DPAD_DOWN
+    try:
+        import evdev
+        from evdev import ecodes
+    except ImportError:
+        log.warning("evdev not available")
+        return False
+
+    def codes(names):
+        return {getattr(ecodes, n) for n in names if hasattr(ecodes, n)}
+
+    ABS_GAMEPAD_AXES = codes(ABS_GAMEPAD_AXIS_NAMES)
+    GAMEPAD_BUTTONS = codes(GAMEPAD_BUTTON_NAMES)
+    SELECT_BUTTONS = codes(SELECT_BUTTON_NAMES)
+    DPAD_UP = getattr(ecodes, "BTN_DPAD_UP", None)
+    DPAD_DOWN = getattr(ecodes, "BTN_DPAD_DOWN", None)
+    HAS_EVDEV = True
+    log.info("evdev OK")
+    return True
 
 BTN_EXCLUDE = {
     "BTN_LEFT", "BTN_RIGHT", "BTN_MIDDLE", "BTN_SIDE", "BTN_EXTRA",
@@ -361,6 +467,149 @@ def _iter_key_names(code):
         return [name]
     return []
 
+def _axis_info(caps):
+    axis_info = {}
+    for code, info in caps.get(ecodes.EV_ABS, []):
+        if code in ABS_GAMEPAD_AXES:
+            axis_info[code] = {'min': info.min, 'max': info.max}
+    return axis_info
+
+def _fingerprint(caps):
+    # Event types and codes only: absinfo values move while the pad is used
+    import hashlib
+    items = []
+    for etype in sorted(caps):
+        codes = [c[0] if isinstance(c, tuple) else c for c in caps[etype]]
+        items.append((etype, tuple(sorted(codes))))
+    return hashlib.sha1(repr(items).encode()).hexdigest()[:16]
+
+def _score_device(path, quiet=False):
+    """(tie, dev, axis_info) for a plausible gamepad at path, or None"""
+    dev = evdev.InputDevice(path)
+    caps = dev.capabilities(verbose=False)
+    score = 0
+    props = _uevent_props(path)
+    is_gamepad = props.get("ID_INPUT_GAMEPAD") == "1"
+    is_joystick = props.get("ID_INPUT_JOYSTICK") == "1"
+    is_keyboard = props.get("ID_INPUT_KEYBOARD") == "1"
+    is_mouse = props.get("ID_INPUT_MOUSE") == "1"
+    if is_gamepad:
+        score += 20
+    if is_joystick:
+        score += 15
+    if props.get("ID_BUS") in ("usb", "bluetooth"):
+        score += 1
+    name = (dev.name or "").lower()
+    if any(h in name for h in GAMEPAD_NAME_HINTS):
+        score += 5
+    if is_keyboard or is_mouse:
+        score -= 5
+
+    abs_codes = []
+    if ecodes.EV_ABS in caps:
+        abs_codes = [c for c, _ in caps[ecodes.EV_ABS]]
+        if any(c in ABS_GAMEPAD_AXES for c in abs_codes):
+            score += 3
+
+    key_codes = []
+    key_names = []
+    if ecodes.EV_KEY in caps:
+        key_codes = [c for c in caps[ecodes.EV_KEY]]
+        if any(c in GAMEPAD_BUTTONS for c in key_codes):
+            score += 5
+        if DPAD_UP in key_codes or DPAD_DOWN in key_codes:
+            score += 2
+        for c in key_codes:
+            key_names.extend(_iter_key_names(c))
+        if any(n.startswith("BTN_") and n not in BTN_EXCLUDE for n in key_names):
+            score += 3
+
+    # Skip obvious keyboard/mouse unless it is explicitly marked as gamepad/joystick
+    if (is_keyboard or is_mouse) and not (is_gamepad or is_joystick):
+        if not quiet:
+            log.info("Skip (keyboard/mouse): %s (%s) props=%s", dev.name, dev.path, props)
+        dev.close()
+        return None
+
+    # Avoid mouse-only devices
+    if ecodes.EV_REL in caps and not (is_gamepad or is_joystick):
+        score -= 5
+
+    if score <= 0:
+        dev.close()
+        return None
+    log.info("Candidate: %s (%s) score=%d abs=%s props=%s", dev.name, dev.path, score, abs_codes, props)
+    # Tie-breakers
+    abs_count = len([c for c in abs_codes if c in ABS_GAMEPAD_AXES])
+    btn_count = len([n for n in key_names if n.startswith("BTN_") and n not in BTN_EXCLUDE])
+    tie = (score, int(is_gamepad), int(is_joystick), abs_count, btn_count)
+    return tie, dev, _axis_info(caps)
+
+# --- Gamepad cache ---
+#
+# The pad that won the last scan: its persistent links, VID:PID and a
+# capability fingerprint. When the same device is still there, boot opens
+# it directly instead of opening and scoring every input node.
+
+GAMEPAD_CACHE_FILE = "/opt/boot-selector/gamepad-cache.json"
+
+def _stable_links(path):
+    real = os.path.realpath(path)
+    links = []
+    for d in ("/dev/input/by-id", "/dev/input/by-path"):
+        try:
+            for name in sorted(os.listdir(d)):
+                link = os.path.join(d, name)
+                if os.path.realpath(link) == real:
+                    links.append(link)
+        except OSError:
+            pass
+    return links
+
+def _identity(dev):
+    return {
+        "vid": f"{dev.info.vendor:04x}",
+        "pid": f"{dev.info.product:04x}",
+        "fingerprint": _fingerprint(dev.capabilities(verbose=False)),
+    }
+
+def _save_cache(dev):
+    import json
+    entry = _identity(dev)
+    entry["links"] = _stable_links(dev.path)
+    entry["name"] = dev.name
+    if not entry["links"]:
+        log.info("No stable link for %s, not caching it", dev.path)
+        return
+    try:
+        with open(GAMEPAD_CACHE_FILE + ".tmp", "w") as f:
+            json.dump(entry, f)
+        os.replace(GAMEPAD_CACHE_FILE + ".tmp", GAMEPAD_CACHE_FILE)
+    except OSError as e:
+        log.warning("Could not write gamepad cache: %s", e)
+
+def _cached_gamepad():
+    import json
+    try:
+        with open(GAMEPAD_CACHE_FILE) as f:
+            entry = json.load(f)
+    except (OSError, ValueError):
+        return None
+    want = {k: entry.get(k) for k in ("vid", "pid", "fingerprint")}
+    for link in entry.get("links", []):
+        if not os.path.exists(link):
+            continue
+        try:
+            dev = evdev.InputDevice(os.path.realpath(link))
+        except OSError:
+            continue
+        if _identity(dev) == want:
+            log.info("Using cached gamepad: %s (%s via %s)", dev.name, dev.path, link)
+            return dev, _axis_info(dev.capabilities(verbose=False))
+        log.info("Cached gamepad link %s is now a different device", link)
+        dev.close()
+    return None
+
 def find_gamepad():
     if not HAS_EVDEV:
         return None
@@ -373,101 +622,103 @@ def find_gamepad():
                 pref = os.path.realpath(pref)
                 if os.path.exists(pref):
                     dev = evdev.InputDevice(pref)
-                    caps = dev.capabilities(verbose=False)
-                    axis_info = {}
-                    if ecodes.EV_ABS in caps:
-                        for code, info in caps[ecodes.EV_ABS]:
-                            if code in ABS_GAMEPAD_AXES:
-                                axis_info[code] = {'min': info.min, 'max': info.max}
+                    axis_info = _axis_info(dev.capabilities(verbose=False))
                     log.info("Using preferred gamepad: %s (%s)", dev.name, dev.path)
                     return dev, axis_info
     except Exception as e:
         log.warning("Preferred device failed: %s", e)
 
+    # 2) The pad from last time, if it is still the same device
+    cached = _cached_gamepad()
+    if cached:
+        return cached
+
+    # 3) Score every input device
     best = None
-    best_score = None
     for path in evdev.list_devices():
         try:
-            dev = evdev.InputDevice(path)
-            caps = dev.capabilities(verbose=False)
-            score = 0
-            props = _uevent_props(path)
-            is_gamepad = props.get("ID_INPUT_GAMEPAD") == "1"
-            is_joystick = props.get("ID_INPUT_JOYSTICK") == "1"
-            is_keyboard = props.get("ID_INPUT_KEYBOARD") == "1"
-            is_mouse = props.get("ID_INPUT_MOUSE") == "1"
-            if is_gamepad:
-                score += 20
-            if is_joystick:
-                score += 15
-            if props.get("ID_BUS") in ("usb", "bluetooth"):
-                score += 1
-            name = (dev.name or "").lower()
-            if any(h in name for h in GAMEPAD_NAME_HINTS):
-                score += 5
-            if is_keyboard or is_mouse:
-                score -= 5
-
-            abs_codes = []
-            if ecodes.EV_ABS in caps:
-                abs_codes = [c for c, _ in caps[ecodes.EV_ABS]]
-                if any(c in ABS_GAMEPAD_AXES for c in abs_codes):
-                    score += 3
-
-            key_codes = []
-            key_names = []
-            if ecodes.EV_KEY in caps:
-                key_codes = [c for c in caps[ecodes.EV_KEY]]
-                if any(c in GAMEPAD_BUTTONS for c in key_codes):
-                    score += 5
-                if DPAD_UP in key_codes or DPAD_DOWN in key_codes:
-                    score += 2
-                for c in key_codes:
-                    key_names.extend(_iter_key_names(c))
-                if any(n.startswith("BTN_") and n not in BTN_EXCLUDE for n in key_names):
-                    score += 3
-
-            axis_info = {}
-            if abs_codes:
-                for code, info in caps[ecodes.EV_ABS]:
-                    if code in ABS_GAMEPAD_AXES:
-                        axis_info[code] = {'min': info.min, 'max': info.max}
-
-            # Skip obvious keyboard/mouse unless it is explicitly marked as gamepad/joystick
-            if (is_keyboard or is_mouse) and not (is_gamepad or is_joystick):
-                log.info("Skip (keyboard/mouse): %s (%s) props=%s", dev.name, dev.path, props)
-                continue
-
-            # Avoid mouse-only devices
-            if ecodes.EV_REL in caps and not (is_gamepad or is_joystick):
-                score -= 5
-
-            if score > 0:
-                log.info("Candidate: %s (%s) score=%d abs=%s props=%s", dev.name, dev.path, score, abs_codes, props)
-                # Tie-breakers
-                abs_count = len([c for c in abs_codes if c in ABS_GAMEPAD_AXES])
-                btn_count = len([n for n in key_names if n.startswith("BTN_") and n not in BTN_EXCLUDE])
-                tie = (score, int(is_gamepad), int(is_joystick), abs_count, btn_count)
-                if best is None or best_score is None or tie > best_score:
-                    best = (dev, axis_info)
-                    best_score = tie
+            found = _score_device(path)
         except (PermissionError, OSError) as e:
             log.debug("Skip %s: %s", path, e)
+            continue
+        if found and (best is None or found[0] > best[0]):
+            if best:
+                best[1].close()
+            best = found
+        elif found:
+            found[1].close()
     if best:
-        dev, axis_info = best
+        best_score, dev, axis_info = best
         log.info("Gamepad selected: %s (%s) score=%s axes=%s", dev.name, dev.path, best_score, axis_info)
+        _save_cache(dev)
         return dev, axis_info
     log.warning("No gamepad found")
     return None
 
-def read_gamepad(dev, axis_info, timeout=0.05):
-    if not dev:
+# --- Hotplug ---
+
+NETLINK_KOBJECT_UEVENT = 15
+HOTPLUG_RETRY_MS = 5            # Poll tick while a new node is not readable yet
+HOTPLUG_SETTLE_MS = 100         # ...and how long it gets before we give up
+
+def open_hotplug_monitor():
+    """Kernel uevent socket, for pads plugged in after the menu is up"""
+    import socket
+    try:
+        sock = socket.socket(socket.AF_NETLINK, socket.SOCK_DGRAM | socket.SOCK_NONBLOCK,
+                             NETLINK_KOBJECT_UEVENT)
+        sock.bind((0, 1))
+        return sock
+    except (OSError, AttributeError) as e:
+        log.warning("Hotplug monitor unavailable: %s", e)
         return None
+
+def read_hotplug(sock):
+    """Event nodes added since the last call"""
+    added = []
+    while True:
+        try:
+            msg = sock.recv(8192)
+        except BlockingIOError:
+            return added
+        fields = dict(f.split("=", 1) for f in msg.decode(errors="replace").split("\0") if "=" in f)
+        name = fields.get("DEVNAME", "")
+        if (fields.get("ACTION") == "add" and fields.get("SUBSYSTEM") == "input"
+                and name.startswith("input/event")):
+            added.append("/dev/" + name)
+
+def hotplug_gamepad(pending):
+    """A gamepad among freshly added nodes, or None.
+
+    pending maps each node to the monotonic time to give up on it. The
+    node and its permissions may trail the uevent slightly, so one that
+    is not readable yet stays for a later poll tick instead of holding
+    up the loop; every other node is probed once and dropped.
+    """
+    now = time.monotonic()
+    for path, give_up in list(pending.items()):
+        if not os.access(path, os.R_OK):
+            if now >= give_up:
+                log.debug("Hotplug %s: never became readable", path)
+                del pending[path]
+            continue
+        del pending[path]
+        try:
+            found = _score_device(path, quiet=True)
+        except OSError as e:
+            log.debug("Hotplug %s: %s", path, e)
+            continue
+        if found:
+            _, dev, axis_info = found
+            log.info("Gamepad plugged in: %s (%s)", dev.name, dev.path)
+            _save_cache(dev)
+            return dev, axis_info
+    return None
+
+def read_gamepad(dev, axis_info):
+    """Action from the events waiting on dev; call when its fd is readable"""
+    last = None
     try:
-        r, _, _ = select.select([dev.fd], [], [], timeout)
-        if not r:
-            return None
-        last = None
         for event in dev.read():
             if event.type == ecodes.EV_ABS:
                 if event.code in (getattr(ecodes, "ABS_Y", -1), getattr(ecodes, "ABS_RY", -2)):
@@ -495,10 +746,9 @@ def read_gamepad(dev, axis_info, timeout=0.05):
                     names = _iter_key_names(event.code)
                     if any(n.startswith("BTN_") and n not in BTN_EXCLUDE and n not in ("BTN_DPAD_UP", "BTN_DPAD_DOWN") for n in names):
                         last = 'select'
-        return last
-    except (OSError, IOError) as e:
-        log.error("Gamepad error: %s", e)
-    return None
+    except BlockingIOError:
+        pass
+    return last
 
 # --- Keyboard ---
 
@@ -516,31 +766,55 @@ def restore_keyboard(old):
     except Exception:
         pass
 
-def read_keyboard(timeout=0.05):
-    try:
-        r, _, _ = select.select([sys.stdin], [], [], timeout)
-        if not r:
-            return None
-        key = sys.stdin.read(1)
-        if key == '\x1b':
-            r2, _, _ = select.select([sys.stdin], [], [], 0.05)
-            if r2:
-                seq = sys.stdin.read(2)
-                if seq == '[A': return 'up'
-                if seq == '[B': return 'down'
-        elif key in ('\r', '\n'):
-            return 'select'
-    except Exception:
-        pass
-    return None
+def read_keyboard(fd):
+    """Action from the bytes waiting on fd; call when it is readable"""
+    data = os.read(fd, 64)
+    if not data:
+        raise EOFError
+    # A lone ESC may be the start of an arrow key still on its way
+    if data.endswith(b'\x1b') or data.endswith(b'\x1b['):
+        r, _, _ = select.select([fd], [], [], 0.05)
+        if r:
+            data += os.read(fd, 64)
+    last = None
+    i = 0
+    while i < len(data):
+        if data[i:i + 3] == b'\x1b[A':
+            last = 'up'
+            i += 3
+        elif data[i:i + 3] == b'\x1b[B':
+            last = 'down'
+            i += 3
+        else:
+            if data[i:i + 1] in (b'\r', b'\n'):
+                return 'select'
+            i += 1
+    return last
 
 # --- Menu ---
 
-def get_windows_entry():
+GRUB_CFG = "/boot/grub/grub.cfg"
+
+# The Windows entry resolved when grub.cfg was last regenerated (kernel
+# postinst/postrm hooks run --refresh-windows-cache after update-grub),
+# keyed by grub.cfg's mtime, size and inode so a config rewritten any
+# other way is noticed with one stat and parsed again.
+WINDOWS_CACHE_FILE = "/opt/boot-selector/windows-entry.json"
+
+def _grub_cfg_stamp():
+    st = os.stat(GRUB_CFG)
+    return [st.st_mtime_ns, st.st_size, st.st_ino]
+
+def parse_windows_entry():
+    """The entry's id (what grub-reboot takes), else its title"""
+    import re
     try:
-        with open("/boot/grub/grub.cfg") as f:
+        with open(GRUB_CFG) as f:
             for line in f:
                 if "menuentry" in line and "indows" in line:
+                    m = re.search(r"\$menuentry_id_option '([^']+)'", line)
+                    if m:
+                        return m.group(1)
                     s = line.find("'")
                     if s != -1:
                         e = line.find("'", s + 1)
@@ -550,56 +824,166 @@ def get_windows_entry():
         pass
     return None
 
-def draw_menu(selected, remaining, gp_name):
-    sys.stdout.write('\033[2J\033[H')
-    sys.stdout.flush()
-    width, height = shutil.get_terminal_size((80, 24))
-    bar_len = max(24, min(60, width - 6))
-    bar = "=" * bar_len
-    sep = "-" * bar_len
-
-    def strip_ansi(s):
-        return ANSI_RE.sub("", s)
-
-    def center_line(s):
-        plain = strip_ansi(s)
-        if not plain:
-            return ""
-        if len(plain) >= width:
-            return s
-        pad = (width - len(plain)) // 2
-        return " " * pad + s
+def refresh_windows_cache():
+    try:
+        stamp = _grub_cfg_stamp()
+    except OSError:
+        return None
+    import json
+    entry = parse_windows_entry()
+    try:
+        with open(WINDOWS_CACHE_FILE + ".tmp", "w") as f:
+            json.dump({"grub_cfg": stamp, "entry": entry}, f)
+        os.replace(WINDOWS_CACHE_FILE + ".tmp", WINDOWS_CACHE_FILE)
+        log.info("Windows entry cached: %s", entry)
+    except OSError as e:
+        log.warning("Could not write Windows entry cache: %s", e)
+    return entry
+
+def get_windows_entry():
+    import json
+    try:
+        stamp = _grub_cfg_stamp()
+    except OSError:
+        return None
+    try:
+        with open(WINDOWS_CACHE_FILE) as f:
+            cache = json.load(f)
+        if cache.get("grub_cfg") == stamp:
+            return cache.get("entry")
+    except (OSError, ValueError):
+        pass
+    log.info("Windows entry cache stale, parsing %s", GRUB_CFG)
+    return refresh_windows_cache()
 
+def _strip_ansi(s):
+    for code in COLORS:
+        s = s.replace(code, "")
+    return s
+
+def _terminal_size():
+    # Like shutil.get_terminal_size, without importing shutil
+    try:
+        width, height = os.get_terminal_size(sys.stdout.fileno())
+    except OSError:
+        width = height = 0
+    return width or 80, height or 24
+
+def _menu_rows(selected):
     u = f"{C.G}>> UBUNTU LINUX <<{C.N}" if selected == 0 else "   UBUNTU LINUX   "
     w = f"{C.G}>> WINDOWS <<{C.N}" if selected == 1 else "   WINDOWS   "
-    gp = f"Gamepad: {C.G}{gp_name}{C.N}" if gp_name else f"Gamepad: {C.Y}No detectado (teclado){C.N}"
-
-    lines = [
-        center_line(f"{C.CN}{bar}{C.N}"),
-        center_line(f"{C.CN}SELECTOR DE ARRANQUE{C.N}"),
-        center_line(f"{C.CN}ELIGE SISTEMA OPERATIVO{C.N}"),
-        center_line(f"{C.CN}{bar}{C.N}"),
-        "",
-        center_line(u),
-        center_line(w),
-        "",
-        center_line(f"{C.Y}{sep}{C.N}"),
-        "",
-        center_line(f"{C.W}D-Pad / Flechas = Navegar{C.N}"),
-        center_line(f"{C.W}A / Start / Enter = Seleccionar{C.N}"),
-        "",
-        center_line(f"{C.Y}Auto-boot en: {remaining} segundos{C.N}"),
-        "",
-        center_line(gp),
-        "",
-        center_line(f"{C.W}Version {APP_VERSION}{C.N}"),
-        center_line(f"{C.W}{COMPANY_SITE}  |  {COMPANY_EMAIL}{C.N}"),
-    ]
-
-    pad_top = max(0, (height - len(lines)) // 2)
-    if pad_top:
-        sys.stdout.write("\n" * pad_top)
-    print("\n".join(lines))
+    return u, w
+
+COUNTDOWN_LABEL = "Auto-boot en: "
+
+SEARCHING = object()            # gp_name while the scan has not run yet
+
+def _gamepad_line(gp_name, width):
+    if gp_name is SEARCHING:
+        return f"Gamepad: {C.Y}buscando...{C.N}"
+    if not gp_name:
+        return f"Gamepad: {C.Y}No detectado (teclado){C.N}"
+    # Cut long names so the row never wraps into the next one
+    return f"Gamepad: {C.G}{gp_name[:max(1, width - 10)]}{C.N}"
+
+class MenuRenderer:
+    """
+    Lays the screen out once, then redraws only what changes: the two
+    menu rows and the countdown digits (fixed width, so nothing moves)
+    and the gamepad row. Every update is one write. A new terminal size
+    lays the screen out again.
+    """
+
+    def __init__(self):
+        self.size = None
+        self.selected = None
+        self.remaining = None
+        self.gp_name = None
+
+    def _layout(self, width, height):
+        bar_len = max(24, min(60, width - 6))
+        bar = "=" * bar_len
+        sep = "-" * bar_len
+
+        lines = [
+            f"{C.CN}{bar}{C.N}",
+            f"{C.CN}SELECTOR DE ARRANQUE{C.N}",
+            f"{C.CN}ELIGE SISTEMA OPERATIVO{C.N}",
+            f"{C.CN}{bar}{C.N}",
+            "",
+            None,                   # Ubuntu
+            None,                   # Windows
+            "",
+            f"{C.Y}{sep}{C.N}",
+            "",
+            f"{C.W}D-Pad / Flechas = Navegar{C.N}",
+            f"{C.W}A / Start / Enter = Seleccionar{C.N}",
+            "",
+            None,                   # Countdown
+            "",
+            None,                   # Gamepad
+            "",
+            f"{C.W}Version {APP_VERSION}{C.N}",
+            f"{C.W}{COMPANY_SITE}  |  {COMPANY_EMAIL}{C.N}",
+        ]
+        top = max(0, (height - len(lines)) // 2) + 1
+        self.rows = {"ubuntu": top + 5, "windows": top + 6, "countdown": top + 13,
+                     "gamepad": top + 15}
+        self.bottom = top + len(lines)
+        self.width = width
+
+        u, w = _menu_rows(0)
+        countdown = f"{COUNTDOWN_LABEL}00 segundos"
+        self.cols = {"ubuntu": self._col(u), "windows": self._col(w),
+                     "countdown": self._col(countdown) + len(COUNTDOWN_LABEL)}
+        self.static = [(top + i, self._col(line), line) for i, line in enumerate(lines) if line]
+        # Lines wider than the terminal wrap and shift the rows below
+        self.fits = all(len(_strip_ansi(l or countdown)) < width for l in lines)
+
+    def _col(self, s):
+        plain = _strip_ansi(s)
+        return (self.width - len(plain)) // 2 + 1 if len(plain) < self.width else 1
+
+    def _menu(self, selected):
+        u, w = _menu_rows(selected)
+        return (f"\033[{self.rows['ubuntu']};{self.cols['ubuntu']}H{u}"
+                f"\033[{self.rows['windows']};{self.cols['windows']}H{w}")
+
+    def _countdown(self, remaining):
+        return f"\033[{self.rows['countdown']};{self.cols['countdown']}H{C.Y}{remaining:>2}{C.N}"
+
+    def _gamepad(self, gp_name):
+        line = _gamepad_line(gp_name, self.width)
+        return f"\033[{self.rows['gamepad']};1H\033[2K\033[{self.rows['gamepad']};{self._col(line)}H{line}"
+
+    def draw(self, selected, remaining, gp_name):
+        size = _terminal_size()
+        out = []
+
+        if size != self.size or not self.fits:
+            self.size = size
+            self._layout(*size)
+            out.append("\033[2J")
+            for row, col, line in self.static:
+                out.append(f"\033[{row};{col}H{line}")
+            out.append(f"\033[{self.rows['countdown']};{self.cols['countdown'] - len(COUNTDOWN_LABEL)}H"
+                       f"{C.Y}{COUNTDOWN_LABEL}{remaining:>2} segundos{C.N}")
+            out.append(self._menu(selected))
+            out.append(self._gamepad(gp_name))
+        else:
+            if selected != self.selected:
+                out.append(self._menu(selected))
+            if remaining != self.remaining:
+                out.append(self._countdown(remaining))
+            if gp_name != self.gp_name:
+                out.append(self._gamepad(gp_name))
+            if not out:
+                return
+
+        self.selected, self.remaining, self.gp_name = selected, remaining, gp_name
+        out.append(f"\033[{self.bottom};1H")
+        sys.stdout.write("".join(out))
+        sys.stdout.flush()
 
 # --- Main ---
 
@@ -609,53 +993,115 @@ def main():
     gp_name = None
     grabbed = False
 
-    result = find_gamepad()
-    if result:
-        gp_dev, axis_info = result
-        gp_name = gp_dev.name
-        try:
-            gp_dev.grab()
-            grabbed = True
-        except (OSError, IOError):
-            pass
-
     old_term = None
     try:
         old_term = setup_keyboard()
     except Exception as e:
         log.warning("Keyboard setup failed: %s", e)
 
+    menu = MenuRenderer()
     selected = DEFAULT_SEL
     interrupted = False
+    deadline = time.monotonic() + TIMEOUT
     remaining = TIMEOUT
-    last_time = time.time()
     prev = (-1, -1)
 
     try:
+        # The first frame goes up before evdev loads; the gamepad row
+        # fills in once the scan is done
+        menu.draw(selected, TIMEOUT, SEARCHING)
+        mark("menu")
+
+        result = None
+        if load_evdev():
+            mark("evdev")
+            result = find_gamepad()
+        mark("gamepad")
+        if result:
+            gp_dev, axis_info = result
+            gp_name = gp_dev.name
+            try:
+                gp_dev.grab()
+                grabbed = True
+            except (OSError, IOError):
+                pass
+        log.flush()
+
+        # One wait over every input: wakes on a press or when the countdown
+        # shown next changes, never in between
+        poller = select.poll()
+        key_fd = sys.stdin.fileno()
+        poller.register(key_fd, select.POLLIN)
+        if gp_dev:
+            poller.register(gp_dev.fd, select.POLLIN)
+        hotplug = open_hotplug_monitor() if HAS_EVDEV else None
+        if hotplug:
+            poller.register(hotplug.fileno(), select.POLLIN)
+        pending = {}                # Added nodes not probed yet
+
         while remaining > 0:
-            cur = (selected, int(remaining))
+            shown = math.ceil(remaining)
+            cur = (selected, shown)
             if cur != prev:
-                draw_menu(selected, int(remaining), gp_name)
+                menu.draw(selected, shown, gp_name)
                 prev = cur
 
-            action = read_gamepad(gp_dev, axis_info, 0.05)
-            if not action:
-                action = read_keyboard(0.05)
-
+            # Milliseconds until the shown second drops, rounded up
+            wait_ms = int((remaining - (shown - 1)) * 1000) + 1
+            if pending:
+                wait_ms = min(wait_ms, HOTPLUG_RETRY_MS)
+            action = None
+            for fd, events in poller.poll(wait_ms):
+                try:
+                    if hotplug and fd == hotplug.fileno():
+                        give_up = time.monotonic() + HOTPLUG_SETTLE_MS / 1000
+                        for path in read_hotplug(hotplug):
+                            pending.setdefault(path, give_up)
+                    elif gp_dev and fd == gp_dev.fd:
+                        if events & (select.POLLERR | select.POLLHUP | select.POLLNVAL):
+                            raise OSError("device gone")
+                        action = read_gamepad(gp_dev, axis_info) or action
+                    else:
+                        action = read_keyboard(fd) or action
+                except (OSError, EOFError) as e:
+                    log.error("Input %d lost: %s", fd, e)
+                    poller.unregister(fd)
+                    if gp_dev and fd == gp_dev.fd:
+                        gp_dev, gp_name, grabbed = None, None, False
+                        prev = (-1, -1)
+                if action == 'select':
+                    break
+
+            if gp_dev:
+                pending.clear()
+            elif pending:
+                found = hotplug_gamepad(pending)
+                if found:
+                    gp_dev, axis_info = found
+                    gp_name = gp_dev.name
+                    try:
+                        gp_dev.grab()
+                        grabbed = True
+                    except (OSError, IOError):
+                        pass
+                    poller.register(gp_dev.fd, select.POLLIN)
+                    prev = (-1, -1)
+
+            if action:
+                mark("input")
             if action == 'up':
                 selected = 0
-                remaining = TIMEOUT
+                deadline = time.monotonic() + TIMEOUT
             elif action == 'down':
                 selected = 1
-                remaining = TIMEOUT
+                deadline = time.monotonic() + TIMEOUT
             elif action == 'select':
                 log.info("Confirmed: %s", "Ubuntu" if selected == 0 else "Windows")
                 break
 
-            now = time.time()
-            remaining -= (now - last_time)
-            last_time = now
+            remaining = deadline - time.monotonic()
 
+        mark("selected")
         if remaining <= 0:
             log.info("Timeout -> %s", "Ubuntu" if selected == 0 else "Windows")
 
@@ -681,7 +1127,10 @@ def main():
         if win:
             print(f"{C.CN}Reiniciando a Windows...{C.N}")
             log.info("grub-reboot '%s'", win)
+            import subprocess
             subprocess.run(["grub-reboot", win], check=False)
+            mark("grub_reboot")
+            log_timing()
             time.sleep(1)
             if not TEST_MODE:
                 subprocess.run(["reboot"], check=False)
@@ -691,18 +1140,46 @@ def main():
     else:
         print(f"{C.G}Iniciando Ubuntu...{C.N}")
         log.info("Booting Ubuntu")
+    log_timing()
 
     time.sleep(1)
 
-if __name__ == "__main__":
+def run():
+    """Entry point, also for run.sh, which imports the module"""
+    if "--refresh-windows-cache" in sys.argv:
+        refresh_windows_cache()
+        sys.exit(0)
     try:
         main()
     except Exception as e:
         log.exception("Fatal: %s", e)
         sys.exit(1)
+
+if __name__ == "__main__":
+    run()
 PYEOF
 chmod +x /opt/boot-selector/selector.py
 
+# run.sh importa selector.py, asi que su bytecode va a __pycache__ con la
+# comprobacion normal de version; se precompila aqui para el primer
+# arranque. El selector.pyc suelto de instalaciones anteriores sobra.
+rm -f /opt/boot-selector/selector.pyc
+/usr/bin/python3 -m compileall -q -f /opt/boot-selector/selector.py >/dev/null 2>&1 || true
+
+# Resolver la entrada de Windows cada vez que update-grub regenera grub.cfg
+# (zz-update-grub corre antes que zzz-boot-selector)
+for HOOK_DIR in /etc/kernel/postinst.d /etc/kernel/postrm.d; do
+    mkdir -p "$HOOK_DIR"
+    cat > "$HOOK_DIR/zzz-boot-selector" << 'HOOKEOF'
+#!/bin/sh
+# Boot Selector: refresh the cached Windows entry from the new grub.cfg
+/usr/bin/python3 /opt/boot-selector/selector.py --refresh-windows-cache >/dev/null 2>&1 || true
+exit 0
+HOOKEOF
+    chmod +x "$HOOK_DIR/zzz-boot-selector"
+done
+/usr/bin/python3 /opt/boot-selector/selector.py --refresh-windows-cache >/dev/null 2>&1 || true
+
 echo -e "  ${GREEN}✓${NC} Selector creado"
 
 # Paso 4: inyectar en display manager
@@ -712,6 +1189,9 @@ DM_DROPIN_DIR="/etc/systemd/system/${DM_SERVICE}.d"
 mkdir -p "$DM_DROPIN_DIR"
 
 cat > "${DM_DROPIN_DIR}/boot-selector.conf" << 'DROPEOF'
+[Unit]
+After=systemd-udev-trigger.service systemd-vconsole-setup.service
+
 [Service]
 ExecStartPre=-/opt/boot-selector/run.sh
 DROPEOF
@@ -729,7 +1209,51 @@ step "5/5" "Creando scripts utiles..."
 
 cat > /opt/boot-selector/test.sh << 'TESTEOF'
 #!/bin/bash
+# test.sh            el selector en esta terminal
+# test.sh --bench N  N arranques sin TTY (Enter al instante), mediana por fase
 set -e
+
+if [ "$1" = "--bench" ]; then
+    exec sudo python3 - "${2:-10}" << 'BENCHEOF'
+import json, os, statistics, subprocess, sys, time
+
+LOG = "/var/log/boot-selector.log"
+# Started as run.sh starts it, through the module's cached bytecode
+SELECTOR_RUN = 'import sys; sys.path[0] = "/opt/boot-selector"; import selector; selector.run()'
+
+runs = []
+for i in range(int(sys.argv[1])):
+    start = os.path.getsize(LOG) if os.path.exists(LOG) else 0
+    t_tty = time.clock_gettime(time.CLOCK_BOOTTIME) * 1000
+    env = dict(os.environ, BOOT_SELECTOR_T_TTY="%.1f" % t_tty)
+    subprocess.run(["python3", "-s", "-X", "frozen_modules=on", "-c", SELECTOR_RUN, "--test"],
+                   input=b"\r",
+                   stdout=subprocess.DEVNULL, env=env, check=False)
+    with open(LOG, "rb") as f:
+        f.seek(start)
+        lines = [l for l in f.read().decode(errors="replace").splitlines() if ": timing {" in l]
+    if not lines:
+        print(f"run {i + 1}: no timing line in {LOG}")
+        continue
+    runs.append(json.loads(lines[-1].split(": timing ", 1)[1]))
+
+if not runs:
+    sys.exit(1)
+steps, totals = {}, {}
+for phases in runs:
+    seen = sorted(phases, key=phases.get)
+    for prev, phase in zip([None] + seen, seen):
+        steps.setdefault(phase, []).append(phases[phase] - phases[prev] if prev else 0.0)
+        totals.setdefault(phase, []).append(phases[phase] - phases[seen[0]])
+
+print(f"{len(runs)} runs, medians in ms")
+print(f"{'phase':<12} {'step':>8} {'total':>8}")
+for phase in sorted(totals, key=lambda p: statistics.median(totals[p])):
+    print(f"{phase:<12} {statistics.median(steps[phase]):8.1f} "
+          f"{statistics.median(totals[phase]):8.1f}")
+BENCHEOF
+fi
+
 sudo rm -f /run/boot-selector-done
 sudo python3 /opt/boot-selector/selector.py --test
 TESTEOF
@@ -744,6 +1268,7 @@ if [ -n "$DM_SERVICE" ]; then
     rmdir "/etc/systemd/system/${DM_SERVICE}.d" 2>/dev/null || true
 fi
 systemctl daemon-reload
+rm -f /etc/kernel/postinst.d/zzz-boot-selector /etc/kernel/postrm.d/zzz-boot-selector
 rm -rf /opt/boot-selector
 rm -f /run/boot-selector-done
 
@@ -7,6 +7,13 @@ SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
 PROJECT_DIR="$(dirname "$SCRIPT_DIR")"
 GRUB_DIR="$PROJECT_DIR/grub"
 
+# Module build profile: full (default), strict or minimal
+PROFILE="${SNES_PROFILE:-full}"
+case "$PROFILE" in
+    full|strict|minimal) ;;
+    *) echo "Unknown SNES_PROFILE '$PROFILE' (full, strict or minimal)"; exit 1 ;;
+esac
+
 echo "=== Building GRUB Boot Selector Module ==="
 
 # Check if GRUB submodule exists
@@ -51,9 +58,19 @@ fi
 echo "Building GRUB..."
 make -j$(nproc)
 
+# The device table must match tools/devices.txt
+python3 "$PROJECT_DIR/tools/device_db.py" --check
+
 # Copy our module source
 echo "Copying SNES gamepad module..."
 cp "$PROJECT_DIR/src/usb_snes_gamepad.c" "$GRUB_DIR/grub-core/term/"
+# Module headers, including snes_devices.h as last written by snes-mapper.py
+cp "$PROJECT_DIR"/src/*.h "$GRUB_DIR/grub-core/term/"
+if [ "$PROFILE" != "full" ]; then
+    echo "Using $PROFILE profile"
+    sed -i "1i #define SNES_PROFILE SNES_PROFILE_${PROFILE^^}" \
+        "$GRUB_DIR/grub-core/term/usb_snes_gamepad.c"
+fi
 
 # Rebuild with our module
 echo "Rebuilding with SNES module..."
@@ -1,16 +1,32 @@
 #!/bin/bash
 # Capture HID reports from a USB game controller
-# Usage: ./capture-hid.sh 0810:e501
+# Usage: ./capture-hid.sh 0810:e501 [trace-file]
+#
+# With a trace file the reports are recorded with their timing in the
+# binary trace format (docs/hid-reports.md) for replay on the host.
 
 if [ -z "$1" ]; then
-    echo "Usage: $0 <vendor:product>"
+    echo "Usage: $0 <vendor:product> [trace-file]"
     echo "Example: $0 0810:e501"
+    echo "         $0 0810:e501 my-pad.trace"
     echo ""
     echo "Run ./detect-controller.sh first to find your device ID"
     exit 1
 fi
 
 DEVICE_ID="$1"
+TRACE_FILE="$2"
+
+if [ -n "$TRACE_FILE" ]; then
+    SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+    echo "=== Recording $DEVICE_ID to $TRACE_FILE ==="
+    echo "Reproduce the problem on the controller, then press Ctrl+C"
+    sudo python3 "$SCRIPT_DIR/../tools/hid-trace.py" capture "$DEVICE_ID" "$TRACE_FILE" || exit 1
+    sudo chown "$(id -u):$(id -g)" "$TRACE_FILE"
+    echo ""
+    echo "Replay it with: make replay TRACE=$TRACE_FILE"
+    exit 0
+fi
 
 echo "=== Capturing HID reports from $DEVICE_ID ==="
 echo "Press buttons on your controller to see the reports"
@@ -1,9 +1,19 @@
 #!/bin/bash
 # Test the GRUB SNES gamepad module in QEMU
+# Usage: ./test-qemu.sh                 boot test.iso to try by hand
+#        ./test-qemu.sh --bench [...]   scripted latency benchmark, options
+#                                       as for tools/qemu-bench.py
 
 SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
 PROJECT_DIR="$(dirname "$SCRIPT_DIR")"
 
+if [ "$1" = "--bench" ]; then
+    shift
+    echo "=== GRUB SNES gamepad latency benchmark ==="
+    echo "A synthetic pad on dummy_hcd is redirected into QEMU (needs sudo)"
+    exec sudo python3 "$PROJECT_DIR/tools/qemu-bench.py" "$@"
+fi
+
 ISO="$PROJECT_DIR/test.iso"
 
 if [ ! -f "$ISO" ]; then
@@ -0,0 +1,40 @@
+/*
+ * Known pads, generated by tools/device_db.py from tools/devices.txt
+ *
+ * Do not edit: change the database and run "make devices". Sorted by
+ * VID:PID for the binary search in find_device (); the keys are kept
+ * apart from the entries so the search only touches one dense array.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_DEVICE_TABLE_HEADER
+#define GRUB_SNES_DEVICE_TABLE_HEADER 1
+
+#define SNES_KNOWN_DEVICES      9
+
+static const grub_uint32_t known_device_keys[SNES_KNOWN_DEVICES] = {
+    0x00790006,
+    0x00790011,
+    0x046dc218,
+    0x05832060,
+    0x08100001,
+    0x0810e501,
+    0x12bdd015,
+    0x1a340802,
+    0x2dc89018,
+};
+
+static const struct snes_device_id known_devices[SNES_KNOWN_DEVICES] = {
+    { "DragonRise Gamepad (0079:0006)", QUIRK_NO_SET_PROTOCOL, 0, 0, LAYOUT_DESCRIPTOR, NULL },
+    { "DragonRise Generic (0079:0011)", QUIRK_NO_SET_PROTOCOL, 0, 0, LAYOUT_DESCRIPTOR, NULL },
+    { "Logitech F510 (046d:c218)", QUIRK_NO_SET_PROTOCOL, 0, 0, LAYOUT_DESCRIPTOR, NULL },
+    { "iBuffalo SNES (0583:2060)", QUIRK_NO_SET_PROTOCOL, 0, 0, LAYOUT_DESCRIPTOR, NULL },
+    { "Generic USB Gamepad (0810:0001)", QUIRK_NO_SET_PROTOCOL, 0, 8, LAYOUT_SNES, NULL },
+    { "Generic Chinese SNES (0810:e501)", QUIRK_NO_SET_PROTOCOL, 0, 8, LAYOUT_SNES, NULL },
+    { "Generic 2-pack SNES (12bd:d015)", QUIRK_NO_SET_PROTOCOL, 0, 0, LAYOUT_DESCRIPTOR, NULL },
+    { "USB Gamepad (1a34:0802)", QUIRK_NO_SET_PROTOCOL, 0, 8, LAYOUT_SNES, NULL },
+    { "8BitDo SN30 (2dc8:9018)", QUIRK_NO_SET_PROTOCOL, 0, 0, LAYOUT_DESCRIPTOR, NULL },
+};
+
+#endif /* ! GRUB_SNES_DEVICE_TABLE_HEADER */
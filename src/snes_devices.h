@@ -0,0 +1,15 @@
+/*
+ * Decode plans of pads mapped with tools/snes-mapper.py
+ *
+ * Generated file: edit by re-running the mapper, not by hand. Each plan
+ * sits between its BEGIN and END markers, which the mapper uses to
+ * replace that pad and keep the others. The pads' known_devices entries
+ * come from tools/devices.txt.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_DEVICES_HEADER
+#define GRUB_SNES_DEVICES_HEADER 1
+
+#endif /* ! GRUB_SNES_DEVICES_HEADER */
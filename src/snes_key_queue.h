@@ -0,0 +1,223 @@
+/*
+ * Key queue for the SNES gamepad module
+ *
+ * A fixed ring of keys, each stamped with the time its report completed.
+ * What happens when the ring is full is chosen at compile time with
+ * SNES_QUEUE_POLICY:
+ *
+ *   SNES_QUEUE_DROP_OLDEST  Make room by discarding the oldest key.
+ *   SNES_QUEUE_DROP_NEWEST  Discard the key being pushed.
+ *   SNES_QUEUE_COALESCE     Merge runs of the same navigation key into one
+ *                           entry with a repeat count, evict navigation
+ *                           keys before anything else, and expire
+ *                           navigation keys older than SNES_QUEUE_MAX_AGE_MS
+ *                           so held directions stop when the pad does,
+ *                           however slowly the menu redraws.
+ *
+ * Confirm, escape and the other non-navigation keys are never merged,
+ * expired or evicted in coalesce mode. When the ring holds nothing but
+ * them, the key being pushed is refused instead.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_KEY_QUEUE_HEADER
+#define GRUB_SNES_KEY_QUEUE_HEADER 1
+
+#include <grub/types.h>
+#include <grub/term.h>
+
+#include "snes_stats.h"
+
+#define SNES_QUEUE_DROP_OLDEST  0
+#define SNES_QUEUE_DROP_NEWEST  1
+#define SNES_QUEUE_COALESCE     2
+
+#ifndef SNES_QUEUE_POLICY
+#define SNES_QUEUE_POLICY       SNES_QUEUE_COALESCE
+#endif
+
+#define SNES_KEY_QUEUE_CAPACITY 32
+#define SNES_QUEUE_MAX_REPEAT   4       /* Presses one merged entry may hold */
+#define SNES_QUEUE_MAX_AGE_MS   250     /* Navigation keys older than this expire */
+
+struct snes_queued_key
+{
+    int key;
+    grub_uint16_t repeat;               /* Pending presses of key, >= 1 */
+    grub_uint64_t stamp;                /* grub_get_time_ms () of the report */
+};
+
+struct snes_key_queue
+{
+    struct snes_queued_key keys[SNES_KEY_QUEUE_CAPACITY];
+    unsigned begin;
+    unsigned size;
+#if SNES_STATS
+    grub_uint32_t queued;               /* Keys pushed */
+    grub_uint32_t dropped;              /* Keys lost to overflow or expiry */
+    grub_uint32_t max_depth;            /* Most entries held at once */
+#endif
+};
+
+static inline void
+snes_key_queue_init (struct snes_key_queue *q)
+{
+    q->begin = 0;
+    q->size = 0;
+#if SNES_STATS
+    q->queued = 0;
+    q->dropped = 0;
+    q->max_depth = 0;
+#endif
+}
+
+static inline struct snes_queued_key *
+snes_key_queue_at (struct snes_key_queue *q, unsigned i)
+{
+    return &q->keys[(q->begin + i) % SNES_KEY_QUEUE_CAPACITY];
+}
+
+/* Keys whose late or repeated delivery only moves the selection further */
+static inline int
+snes_key_is_navigation (int key)
+{
+    switch (key)
+    {
+    case GRUB_TERM_KEY_UP:
+    case GRUB_TERM_KEY_DOWN:
+    case GRUB_TERM_KEY_LEFT:
+    case GRUB_TERM_KEY_RIGHT:
+    case GRUB_TERM_KEY_PPAGE:
+    case GRUB_TERM_KEY_NPAGE:
+    case GRUB_TERM_KEY_HOME:
+    case GRUB_TERM_KEY_END:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+#if SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+/* Remove entry i, closing the gap from the tail side */
+static inline void
+snes_key_queue_remove (struct snes_key_queue *q, unsigned i)
+{
+    for (; i + 1 < q->size; i++)
+        *snes_key_queue_at (q, i) = *snes_key_queue_at (q, i + 1);
+    q->size--;
+}
+#endif
+
+static inline void
+snes_key_queue_push (struct snes_key_queue *q, int key, grub_uint64_t stamp)
+{
+    struct snes_queued_key *entry;
+
+    SNES_STAT (q->queued++);
+
+#if SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+    if (snes_key_is_navigation (key) && q->size > 0)
+    {
+        entry = snes_key_queue_at (q, q->size - 1);
+        if (entry->key == key)
+        {
+            if (entry->repeat < SNES_QUEUE_MAX_REPEAT)
+                entry->repeat++;
+            else
+                SNES_STAT (q->dropped++);
+            return;
+        }
+    }
+
+    if (q->size == SNES_KEY_QUEUE_CAPACITY)
+    {
+        unsigned i;
+
+        for (i = 0; i < q->size; i++)
+            if (snes_key_is_navigation (snes_key_queue_at (q, i)->key))
+                break;
+
+        if (i < q->size)
+        {
+            SNES_STAT (q->dropped += snes_key_queue_at (q, i)->repeat);
+            snes_key_queue_remove (q, i);
+        }
+        else
+        {
+            /* Nothing but confirm/escape queued: keep them, refuse this one */
+            SNES_STAT (q->dropped++);
+            return;
+        }
+    }
+#elif SNES_QUEUE_POLICY == SNES_QUEUE_DROP_NEWEST
+    if (q->size == SNES_KEY_QUEUE_CAPACITY)
+    {
+        SNES_STAT (q->dropped++);
+        return;
+    }
+#else
+    if (q->size == SNES_KEY_QUEUE_CAPACITY)
+    {
+        SNES_STAT (q->dropped++);
+        q->begin = (q->begin + 1) % SNES_KEY_QUEUE_CAPACITY;
+        q->size--;
+    }
+#endif
+
+    entry = snes_key_queue_at (q, q->size);
+    entry->key = key;
+    entry->repeat = 1;
+    entry->stamp = stamp;
+    q->size++;
+#if SNES_STATS
+    if (q->size > q->max_depth)
+        q->max_depth = q->size;
+#endif
+}
+
+/*
+ * Hand out the next key, or GRUB_TERM_NO_KEY.
+ * now is the current grub_get_time_ms (); *stamp is set to the time the
+ * returned key's report completed.
+ */
+static inline int
+snes_key_queue_pop (struct snes_key_queue *q, grub_uint64_t now,
+                    grub_uint64_t *stamp)
+{
+    struct snes_queued_key *entry;
+    int key;
+
+#if SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+    while (q->size > 0)
+    {
+        entry = snes_key_queue_at (q, 0);
+        if (!snes_key_is_navigation (entry->key)
+            || now - entry->stamp <= SNES_QUEUE_MAX_AGE_MS)
+            break;
+
+        SNES_STAT (q->dropped += entry->repeat);
+        q->begin = (q->begin + 1) % SNES_KEY_QUEUE_CAPACITY;
+        q->size--;
+    }
+#else
+    (void) now;
+#endif
+
+    if (q->size == 0)
+        return GRUB_TERM_NO_KEY;
+
+    entry = snes_key_queue_at (q, 0);
+    key = entry->key;
+    *stamp = entry->stamp;
+
+    if (--entry->repeat == 0)
+    {
+        q->begin = (q->begin + 1) % SNES_KEY_QUEUE_CAPACITY;
+        q->size--;
+    }
+
+    return key;
+}
+
+#endif /* ! GRUB_SNES_KEY_QUEUE_HEADER */
@@ -0,0 +1,108 @@
+/*
+ * Transfer error recovery for the SNES gamepad module
+ *
+ * Every failed re-arm or errored completion counts as a failure. After
+ * one, re-arming waits out a backoff that doubles from
+ * SNES_RECOVERY_BACKOFF_MIN_MS up to SNES_RECOVERY_BACKOFF_MAX_MS, so a
+ * pad that dropped out costs one clock read per poll rather than a
+ * failing transfer per poll. Every SNES_RECOVERY_CLEAR_HALT_AFTER
+ * consecutive failures the caller is asked to clear the endpoint halt,
+ * every SNES_RECOVERY_RESET_AFTER to reset the device, and the first
+ * good report ends the episode.
+ *
+ * The policy lives here; the module carries out the USB side.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_RECOVERY_HEADER
+#define GRUB_SNES_RECOVERY_HEADER 1
+
+#include <grub/types.h>
+#include <grub/time.h>
+
+#include "snes_stats.h"
+
+#define SNES_RECOVERY_BACKOFF_MIN_MS    8
+#define SNES_RECOVERY_BACKOFF_MAX_MS    1024
+#define SNES_RECOVERY_CLEAR_HALT_AFTER  3
+#define SNES_RECOVERY_RESET_AFTER       6
+
+/* What the caller should do about a failure */
+#define SNES_RECOVER_RETRY      0       /* Just wait out the backoff */
+#define SNES_RECOVER_CLEAR_HALT 1       /* Clear the endpoint halt */
+#define SNES_RECOVER_RESET      2       /* Reset the device */
+
+struct snes_recovery
+{
+    grub_uint32_t streak;               /* Consecutive failures, 0 when healthy */
+    grub_uint32_t backoff_ms;
+    grub_uint64_t next_try;             /* grub_get_time_ms () re-arming resumes */
+#if SNES_STATS
+    grub_uint32_t failures;             /* Failures seen in total */
+    grub_uint32_t clear_halts;
+    grub_uint32_t resets;
+    grub_uint32_t recoveries;           /* Episodes that ended in a good report */
+#endif
+};
+
+static inline void
+snes_recovery_init (struct snes_recovery *r)
+{
+    r->streak = 0;
+    r->backoff_ms = 0;
+    r->next_try = 0;
+#if SNES_STATS
+    r->failures = 0;
+    r->clear_halts = 0;
+    r->resets = 0;
+    r->recoveries = 0;
+#endif
+}
+
+/* May transfers be posted now? Free of clock reads while healthy. */
+static inline int
+snes_recovery_ready (const struct snes_recovery *r)
+{
+    return r->streak == 0 || grub_get_time_ms () >= r->next_try;
+}
+
+/* Record a failure and pick the next step */
+static inline int
+snes_recovery_failed (struct snes_recovery *r)
+{
+    SNES_STAT (r->failures++);
+    r->streak++;
+
+    if (r->backoff_ms == 0)
+        r->backoff_ms = SNES_RECOVERY_BACKOFF_MIN_MS;
+    else if (r->backoff_ms < SNES_RECOVERY_BACKOFF_MAX_MS)
+        r->backoff_ms *= 2;
+    r->next_try = grub_get_time_ms () + r->backoff_ms;
+
+    if (r->streak % SNES_RECOVERY_RESET_AFTER == 0)
+    {
+        SNES_STAT (r->resets++);
+        return SNES_RECOVER_RESET;
+    }
+    if (r->streak % SNES_RECOVERY_CLEAR_HALT_AFTER == 0)
+    {
+        SNES_STAT (r->clear_halts++);
+        return SNES_RECOVER_CLEAR_HALT;
+    }
+    return SNES_RECOVER_RETRY;
+}
+
+/* A good report arrived */
+static inline void
+snes_recovery_succeeded (struct snes_recovery *r)
+{
+    if (r->streak == 0)
+        return;
+
+    SNES_STAT (r->recoveries++);
+    r->streak = 0;
+    r->backoff_ms = 0;
+}
+
+#endif /* ! GRUB_SNES_RECOVERY_HEADER */
@@ -0,0 +1,24 @@
+/*
+ * Statistics switch shared by the SNES gamepad module's headers
+ *
+ * Counters are statistics only; SNES_STATS 0 compiles them out. The
+ * module sets SNES_STATS from its build profile before including the
+ * other headers, which use SNES_STAT around every counter update.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_STATS_HEADER
+#define GRUB_SNES_STATS_HEADER 1
+
+#ifndef SNES_STATS
+#define SNES_STATS 1
+#endif
+
+#if SNES_STATS
+#define SNES_STAT(expr) (expr)
+#else
+#define SNES_STAT(expr) do { } while (0)
+#endif
+
+#endif /* ! GRUB_SNES_STATS_HEADER */
@@ -10,6 +10,9 @@
  * 3. Parses standard 8-byte HID gamepad reports
  * 4. Registers as a terminal input device
  *
+ * It also replaces the former usb_snes module, whose behaviour is kept
+ * as the STRICT build profile (see below).
+ *
  * HID Report Format (Generic SNES):
  *   Byte 0: X-axis (0x00=Left, 0x7F=Center, 0xFF=Right)
  *   Byte 1: Y-axis (0x00=Up, 0x7F=Center, 0xFF=Down)
@@ -25,226 +28,1745 @@
 #include <grub/usb.h>
 #include <grub/misc.h>
 #include <grub/time.h>
+#include <grub/env.h>
+#include <grub/command.h>
+#include <grub/i18n.h>
+
+/*
+ * Build profiles
+ *
+ * Pick one with -DSNES_PROFILE=SNES_PROFILE_xxx. Each setting it implies
+ * can still be overridden on its own (-DACCEPT_ANY_HID=0 and so on).
+ *
+ *   SNES_PROFILE_FULL     any non-keyboard HID device, menu key map,
+ *                         coalescing queue, debug output and snes_stats
+ *   SNES_PROFILE_STRICT   allow-listed pads only, classic key map,
+ *                         drop-newest queue and the usb_snes terminal
+ *                         names, as the old usb_snes module, so existing
+ *                         "terminal_input usb_snes" lines keep working
+ *                         (the insmod line becomes usb_snes_gamepad)
+ *   SNES_PROFILE_MINIMAL  allow-listed pads only, drop-oldest queue, and
+ *                         all grub_dprintf calls, counters and the
+ *                         snes_stats command compiled out, for
+ *                         size-constrained core.img/EFI images
+ */
+#define SNES_PROFILE_FULL       0
+#define SNES_PROFILE_STRICT     1
+#define SNES_PROFILE_MINIMAL    2
+
+#ifndef SNES_PROFILE
+#define SNES_PROFILE            SNES_PROFILE_FULL
+#endif
+
+/* Key maps, see the key_* variables */
+#define SNES_KEYMAP_MENU        0   /* B/Y back, Select edit, X console */
+#define SNES_KEYMAP_CLASSIC     1   /* A/B select, Select back, X edit, Y console */
+
+#if SNES_PROFILE == SNES_PROFILE_STRICT
+#define PROFILE_ACCEPT_ANY_HID  0
+#define PROFILE_KEYMAP          SNES_KEYMAP_CLASSIC
+#define PROFILE_QUEUE_POLICY    SNES_QUEUE_DROP_NEWEST
+#define PROFILE_DEBUG           1
+#define PROFILE_STATS           1
+#define PROFILE_TERM_NAME       "usb_snes"
+#elif SNES_PROFILE == SNES_PROFILE_MINIMAL
+#define PROFILE_ACCEPT_ANY_HID  0
+#define PROFILE_KEYMAP          SNES_KEYMAP_MENU
+#define PROFILE_QUEUE_POLICY    SNES_QUEUE_DROP_OLDEST
+#define PROFILE_DEBUG           0
+#define PROFILE_STATS           0
+#define PROFILE_TERM_NAME       "snes_gamepad"
+#else
+#define PROFILE_ACCEPT_ANY_HID  1
+#define PROFILE_KEYMAP          SNES_KEYMAP_MENU
+#define PROFILE_QUEUE_POLICY    SNES_QUEUE_COALESCE
+#define PROFILE_DEBUG           1
+#define PROFILE_STATS           1
+#define PROFILE_TERM_NAME       "snes_gamepad"
+#endif
+
+/* Accept any HID device that is not a keyboard, not just known_devices */
+#ifndef ACCEPT_ANY_HID
+#define ACCEPT_ANY_HID          PROFILE_ACCEPT_ANY_HID
+#endif
+#ifndef SNES_KEYMAP
+#define SNES_KEYMAP             PROFILE_KEYMAP
+#endif
+#ifndef SNES_QUEUE_POLICY
+#define SNES_QUEUE_POLICY       PROFILE_QUEUE_POLICY
+#endif
+/* grub_dprintf output, under "set debug=usb_snes" */
+#ifndef SNES_DEBUG
+#define SNES_DEBUG              PROFILE_DEBUG
+#endif
+/* Per-slot counters, latency histogram and the snes_stats command */
+#ifndef SNES_STATS
+#define SNES_STATS              PROFILE_STATS
+#endif
+/* Terminal name for terminal_input; slots add their number to it */
+#ifndef SNES_TERM_NAME
+#define SNES_TERM_NAME          PROFILE_TERM_NAME
+#endif
+
+#if SNES_DEBUG
+#define snes_dprintf(...)       grub_dprintf ("usb_snes", __VA_ARGS__)
+#else
+#define snes_dprintf(...)       do { } while (0)
+#endif
+
+#include "snes_stats.h"
+#include "snes_key_queue.h"
+#include "snes_recovery.h"
 
 GRUB_MOD_LICENSE ("GPLv3+");
 
 /*
- * USB HID Class Request Values
- * From USB HID Specification 1.11, Section 7.2
+ * USB HID Class Request Values
+ * From USB HID Specification 1.11, Section 7.2
+ */
+#define USB_HID_GET_REPORT      0x01
+#define USB_HID_GET_IDLE        0x02
+#define USB_HID_GET_PROTOCOL    0x03
+#define USB_HID_SET_REPORT      0x09
+#define USB_HID_SET_IDLE        0x0A
+#define USB_HID_SET_PROTOCOL    0x0B
+#define USB_HID_REPORT_INPUT    0x01    /* GET_REPORT type, high byte of wValue */
+
+/*
+ * USB HID Subclass and Protocol values
+ * Boot protocol is simpler and more compatible
+ */
+#define USB_HID_BOOT_SUBCLASS   0x01
+#define USB_HID_GAMEPAD_PROTOCOL 0x00  /* Gamepads use protocol 0 */
+
+/*
+ * Standard GET_DESCRIPTOR request for the HID class descriptors
+ * From USB HID Specification 1.11, Section 7.1
+ */
+#define USB_REQ_GET_DESCRIPTOR  0x06
+#define USB_DESC_HID            0x21
+#define USB_DESC_HID_REPORT     0x22
+#define HID_REPORT_DESC_MAX     512
+
+/*
+ * Module configuration
+ */
+#define GAMEPADS_CAPACITY       8
+#define PADS_PER_DEVICE         4   /* Players one endpoint may carry */
+#define USB_REPORT_SIZE         8   /* Fixed SNES layout, and fallback size */
+#define REPORT_SIZE_MAX         1024 /* Largest interrupt wMaxPacketSize */
+#define REPORT_RING_SIZE        3   /* Background transfers kept in flight */
+#define LATENCY_BUCKETS         5   /* 0-1, 2-4, 5-16, 17-64, >64 ms */
+
+/*
+ * Transfers posted on the endpoint at once, up to REPORT_RING_SIZE.
+ * GRUB sets each transfer's starting data toggle from dev->toggle[]
+ * when it is posted, and the toggle only moves when one completes, so
+ * every transfer queued behind the first would start with a stale
+ * toggle and its packets be dropped as duplicates. OHCI and EHCI
+ * refuse the second post anyway; only UHCI takes it. Kept at 1 until
+ * a UHCI run shows the toggles carrying across queued transfers.
+ */
+#ifndef REPORT_RING_DEPTH
+#define REPORT_RING_DEPTH       1
+#endif
+#if REPORT_RING_DEPTH < 1 || REPORT_RING_DEPTH > REPORT_RING_SIZE
+#error "REPORT_RING_DEPTH must be between 1 and REPORT_RING_SIZE"
+#endif
+
+/*
+ * D-pad axis processing
+ *
+ * Each axis is quantised around its own rest position, read with
+ * GET_REPORT at attach, before anyone touches the pad. Pads that stall
+ * the request, or report a direction held, learn it from their first
+ * AXIS_CALIBRATION_REPORTS reports instead. Either way only values
+ * within AXIS_REST_MAX of AXIS_CENTER count, and an axis with none
+ * rests at AXIS_CENTER. A direction
+ * is pressed beyond AXIS_PRESS_THRESHOLD of rest and only released
+ * within AXIS_RELEASE_THRESHOLD, so a pad jittering near one threshold
+ * cannot flicker a direction on and off.
+ */
+#define AXIS_CENTER             0x7F
+#define AXIS_PRESS_THRESHOLD    0x40
+#define AXIS_RELEASE_THRESHOLD  0x20
+#define AXIS_REST_MAX           0x20
+#define AXIS_CALIBRATION_REPORTS 4
+#define AXES                    2   /* Indexed by dest / 2: Y, then X */
+
+/*
+ * SNES Button bit masks (in report byte 4)
+ */
+#define BTN_X           (1 << 0)
+#define BTN_A           (1 << 1)
+#define BTN_B           (1 << 2)
+#define BTN_Y           (1 << 3)
+#define BTN_L           (1 << 4)
+#define BTN_R           (1 << 5)
+#define BTN_SELECT      (1 << 6)
+#define BTN_START       (1 << 7)
+
+/*
+ * Decoded pad state, one bit per logical control.
+ * Directions are quantised from the axis bytes, bits 4-11 mirror the
+ * button byte (BTN_* above) and bits 12-15 the low nibble of byte 5,
+ * which several pads use for extra buttons.
+ */
+#define STATE_UP                (1 << 0)
+#define STATE_DOWN              (1 << 1)
+#define STATE_LEFT              (1 << 2)
+#define STATE_RIGHT             (1 << 3)
+#define STATE_BUTTONS_SHIFT     4
+#define STATE_EXTRA_SHIFT       12
+#define STATE_CONTROLS          16
+
+/* Axis quantisation results, shifted onto STATE_UP/DOWN or LEFT/RIGHT */
+#define AXIS_LOW                (1 << 0)
+#define AXIS_HIGH               (1 << 1)
+#define AXIS_BITS               2
+#define AXIS_DEST_Y             0
+#define AXIS_DEST_X             2
+
+/*
+ * Auto-repeat for held directions and L/R.
+ * The first repeat comes REPEAT_DELAY_MS after the press, then every
+ * REPEAT_RATE_MS, each interval shortened by 1/REPEAT_ACCEL_DIV down to
+ * REPEAT_MIN_MS, so long lists speed up the longer the control is held.
+ */
+#ifndef REPEAT_DELAY_MS
+#define REPEAT_DELAY_MS         400
+#endif
+#ifndef REPEAT_RATE_MS
+#define REPEAT_RATE_MS          120
+#endif
+#ifndef REPEAT_MIN_MS
+#define REPEAT_MIN_MS           30
+#endif
+#ifndef REPEAT_ACCEL_DIV
+#define REPEAT_ACCEL_DIV        6       /* 0 disables acceleration */
+#endif
+#define REPEAT_NONE             -1
+#define STATE_REPEAT_MASK       (STATE_UP | STATE_DOWN | STATE_LEFT | STATE_RIGHT \
+                                 | (BTN_L << STATE_BUTTONS_SHIFT) \
+                                 | (BTN_R << STATE_BUTTONS_SHIFT))
+
+/*
+ * Poll governor
+ *
+ * GRUB calls getkey in a tight loop while the menu waits, and every
+ * grub_usb_check_transfer polls the host controller, so the controller
+ * is checked no more often than the endpoint's bInterval; calls in
+ * between only hand out keys already queued. Once nothing has happened
+ * for SNES_IDLE_AFTER_MS the checks stretch to every SNES_IDLE_POLL_MS,
+ * and the first report back restores the full rate.
+ *
+ * A pad that only reports changes holds a release until the next
+ * transfer is posted, so stretching loses nothing. One that streams
+ * reports fills the ring in ring_depth intervals and is not sampled
+ * again until the next check, so for it idle checks come no further
+ * apart than that, or a quick tap could fall in the gap.
+ * SNES_IDLE_AFTER_MS 0 keeps the full rate throughout.
+ */
+#ifndef SNES_IDLE_AFTER_MS
+#define SNES_IDLE_AFTER_MS      5000
+#endif
+#ifndef SNES_IDLE_POLL_MS
+#define SNES_IDLE_POLL_MS       32
+#endif
+
+/*
+ * Decode plan
+ *
+ * Compiled once at attach time, from the HID report descriptor when the
+ * device has a usable one. Each op pulls one little-endian bit field out
+ * of the report and ORs STATE_* bits into the decoded state:
+ *   PLAN_AXIS     absolute axis, scaled to 8 bits and quantised through
+ *                 the pad's axis_lut, landing on the bits selected by dest
+ *   PLAN_HAT      hat switch, (value - base) looked up in hat_lut
+ *   PLAN_BUTTONS  run of 1-bit buttons, XORed with flip so active-low
+ *                 buttons read as pressed, copied to state bit dest up
+ */
+#define PLAN_AXIS               0
+#define PLAN_HAT                1
+#define PLAN_BUTTONS            2
+#define PLAN_MAX_OPS            8
+
+struct plan_op
+{
+    grub_uint8_t kind;
+    grub_uint8_t width;                 /* Field size in bits (1-16) */
+    grub_uint8_t dest;
+    grub_uint8_t base;                  /* Hat logical minimum */
+    grub_uint16_t bit;                  /* Field position in the report */
+    grub_uint16_t flip;                 /* Axes: sign bit, buttons: active-low bits */
+};
+
+struct decode_plan
+{
+    grub_uint8_t report_id;             /* 0 if reports carry no ID */
+    grub_uint8_t n_ops;
+    grub_uint16_t report_len;           /* Bytes per report, ID included */
+    struct plan_op ops[PLAN_MAX_OPS];
+};
+
+/* Fixed layout documented at the top of this file */
+static const struct decode_plan default_plan = {
+    .report_id = 0,
+    .report_len = USB_REPORT_SIZE,
+    .n_ops = 3,
+    .ops = {
+        { .kind = PLAN_AXIS, .width = 8, .dest = AXIS_DEST_Y, .bit = 8 },
+        { .kind = PLAN_AXIS, .width = 8, .dest = AXIS_DEST_X, .bit = 0 },
+        { .kind = PLAN_BUTTONS, .width = 12, .dest = STATE_BUTTONS_SHIFT, .bit = 32 }
+    }
+};
+
+/* Hat positions 0-7 clockwise from north, anything else is released */
+static const grub_uint8_t hat_lut[16] = {
+    STATE_UP, STATE_UP | STATE_RIGHT, STATE_RIGHT, STATE_DOWN | STATE_RIGHT,
+    STATE_DOWN, STATE_DOWN | STATE_LEFT, STATE_LEFT, STATE_UP | STATE_LEFT,
+    0, 0, 0, 0, 0, 0, 0, 0
+};
+
+/*
+ * Set AGGREGATE_TERMINAL to 1 to register one SNES_TERM_NAME terminal
+ * that polls every attached pad, instead of one terminal per slot
+ */
+#ifndef AGGREGATE_TERMINAL
+#define AGGREGATE_TERMINAL  0
+#endif
+
+/*
+ * Per-device quirks, so attach only sends the requests a pad needs.
+ * None of the known pads is a boot-class device, and for those
+ * SET_PROTOCOL is undefined: it stalls or times out.
+ */
+#define QUIRK_NO_SET_PROTOCOL   (1 << 0)
+#define QUIRK_NO_SET_IDLE       (1 << 1)
+#define QUIRK_NO_GET_REPORT     (1 << 2)    /* Calibrate from the first reports */
+
+/* How reports are decoded */
+#define LAYOUT_DESCRIPTOR       0   /* Compile a plan from the report descriptor */
+#define LAYOUT_SNES             1   /* Fixed layout, default_plan */
+#define LAYOUT_PLAN             2   /* Fixed layout, the entry's own plan */
+
+struct snes_device_id {
+    const char *name;
+    grub_uint8_t quirks;
+    grub_uint8_t idle_rate;     /* SET_IDLE duration in 4 ms units, 0 = on change */
+    grub_uint8_t report_len;    /* Bytes per report, 0 = as described */
+    grub_uint8_t layout;
+    const struct decode_plan *plan;     /* LAYOUT_PLAN only */
+};
+
+/* Decode plans of pads mapped with tools/snes-mapper.py */
+#include "snes_devices.h"
+
+/*
+ * known_devices and its sorted known_device_keys, generated from
+ * tools/devices.txt
+ */
+#include "snes_device_table.h"
+
+#if ACCEPT_ANY_HID
+/* Unknown pads get the full initialisation sequence */
+static const struct snes_device_id generic_device =
+    { "Generic HID Gamepad", 0, 0, 0, LAYOUT_DESCRIPTOR, NULL };
+#endif
+
+/*
+ * Key mappings - GRUB navigation keys, indexed by control (STATE_* bit).
+ * These are the build-time defaults; the snes_map environment variable
+ * overrides them when a pad attaches, e.g.
+ *
+ *   set snes_map=a:enter,b:esc,select:e,start:none,btn9:c
+ *
+ * Controls are named as in control_names below. A key is one of the
+ * names in key_names or a single character typed as itself.
+ */
+static const int default_keys[STATE_CONTROLS] = {
+    GRUB_TERM_KEY_UP, GRUB_TERM_KEY_DOWN, GRUB_TERM_KEY_LEFT, GRUB_TERM_KEY_RIGHT,
+#if SNES_KEYMAP == SNES_KEYMAP_CLASSIC
+    'e',                        /* X: edit entry */
+    '\r',                       /* A: Enter - select */
+    '\r',                       /* B: Enter - select */
+    'c',                        /* Y: command line */
+#else
+    'c',                        /* X: command line */
+    '\r',                       /* A: Enter - select */
+    GRUB_TERM_ESC,              /* B: Escape - back */
+    GRUB_TERM_ESC,              /* Y: Escape - back */
+#endif
+    GRUB_TERM_KEY_PPAGE,        /* L: page up */
+    GRUB_TERM_KEY_NPAGE,        /* R: page down */
+#if SNES_KEYMAP == SNES_KEYMAP_CLASSIC
+    GRUB_TERM_ESC,              /* Select: Escape - back */
+#else
+    'e',                        /* Select: edit entry */
+#endif
+    '\r',                       /* Start: Enter - select */
+    GRUB_TERM_NO_KEY, GRUB_TERM_NO_KEY, GRUB_TERM_NO_KEY, GRUB_TERM_NO_KEY
+};
+
+static const char *const control_names[STATE_CONTROLS] = {
+    "up", "down", "left", "right", "x", "a", "b", "y",
+    "l", "r", "select", "start", "btn9", "btn10", "btn11", "btn12"
+};
+
+static const struct
+{
+    const char *name;
+    int key;
+} key_names[] = {
+    { "enter",     '\r' },
+    { "esc",       GRUB_TERM_ESC },
+    { "tab",       GRUB_TERM_TAB },
+    { "space",     ' ' },
+    { "backspace", GRUB_TERM_BACKSPACE },
+    { "up",        GRUB_TERM_KEY_UP },
+    { "down",      GRUB_TERM_KEY_DOWN },
+    { "left",      GRUB_TERM_KEY_LEFT },
+    { "right",     GRUB_TERM_KEY_RIGHT },
+    { "pgup",      GRUB_TERM_KEY_PPAGE },
+    { "pgdown",    GRUB_TERM_KEY_NPAGE },
+    { "home",      GRUB_TERM_KEY_HOME },
+    { "end",       GRUB_TERM_KEY_END },
+    { "none",      GRUB_TERM_NO_KEY }
+};
+
+#if SNES_STATS
+/*
+ * Per-slot counters, cheap enough to keep on in production builds.
+ * Printed by the snes_stats command.
+ */
+struct snes_stats
+{
+    grub_uint32_t reports;              /* Valid reports received */
+    grub_uint32_t bad_transfers;        /* Short or errored completions */
+    grub_uint32_t restart_failures;     /* Transfers that could not be re-armed */
+    grub_uint32_t unchanged;            /* Reports identical to the previous */
+    grub_uint32_t polls;                /* Passes that checked the transfers */
+    grub_uint32_t latency[LATENCY_BUCKETS]; /* Report completion -> key handed out */
+};
+#endif
+
+/*
+ * One player. Multi-player adapters send every player's reports down
+ * the same endpoint, told apart by report ID (or laid side by side in
+ * one report), so each player gets its own plan and state but shares
+ * the device's transfers and key queue.
+ *
+ * Only the first span bytes of a report, the ones the plan reads, are
+ * kept and compared; when they fit in 8 bytes the unchanged-report
+ * check is a single masked 64-bit compare.
+ */
+struct snes_pad
+{
+    struct decode_plan plan;
+    grub_uint64_t *prev_report;
+    grub_uint64_t span_mask;
+    grub_uint16_t span;
+    grub_uint16_t report_len;           /* Shortest completion accepted */
+    grub_uint16_t state;                /* STATE_* bits of the last report */
+    grub_uint8_t axis_state;            /* Last AXIS_* of each axis, AXIS_BITS apiece */
+    grub_uint8_t calibrating;           /* Reports left to learn the rest positions from */
+    grub_uint8_t rest_count[AXES];
+    grub_uint16_t rest_sum[AXES];
+    /*
+     * Axis byte -> the next AXIS_* for each previous one, AXIS_BITS per
+     * previous value: hysteresis as a single lookup
+     */
+    grub_uint8_t axis_lut[AXES][256];
+    int repeat_ctrl;                    /* Control being repeated, or REPEAT_NONE */
+    grub_uint32_t repeat_interval;
+    grub_uint64_t repeat_next;          /* grub_get_time_ms () of the next repeat */
+};
+
+/*
+ * Per-device state structure
+ */
+struct grub_usb_snes_data
+{
+    /* Latest report, the widest span of any pad copied out of the ring */
+    grub_uint64_t *report;
+    grub_uint64_t span_mask;
+    grub_uint16_t span;
+    grub_uint16_t report_len;           /* Shortest completion any pad accepts */
+    grub_uint16_t report_size;          /* Endpoint wMaxPacketSize */
+#if SNES_STATS
+    struct snes_stats stats;
+#endif
+    struct snes_recovery recovery;      /* Backoff state and its counters */
+
+    /* Poll governor, in ms; an interval of 0 checks on every call */
+    grub_uint32_t poll_interval;        /* From the endpoint's bInterval */
+    grub_uint32_t poll_idle_interval;
+    grub_uint64_t poll_next;            /* grub_get_time_ms () of the next check */
+    int streaming;                      /* Pad re-sends unchanged reports */
+    grub_uint64_t last_active;          /* Last changed report or repeat */
+
+    grub_usb_device_t usbdev;
+    int configno;
+    int interfno;
+    struct grub_usb_desc_endp *endp;
+    /*
+     * Ring of background transfers. Slots are posted in order starting
+     * at ring_head, so completions are consumed oldest first and there
+     * is always a buffer waiting while a report is being decoded.
+     */
+    grub_usb_transfer_t transfers[REPORT_RING_SIZE];
+    grub_uint64_t *ring[REPORT_RING_SIZE];
+    unsigned ring_head;
+    unsigned ring_posted;
+    unsigned ring_depth;                /* Slots the controller accepts */
+    struct snes_pad pads[PADS_PER_DEVICE];
+    unsigned n_pads;
+    struct snes_key_queue key_queue;    /* Queued/dropped counts live here */
+
+    /*
+     * report, each pad's prev_report and the ring buffers,
+     * report_words() each, allocated together with the structure
+     */
+    grub_uint64_t buffers[];
+};
+
+/*
+ * 64-bit words per report buffer: the packet plus one spare word, so
+ * field reads and the 64-bit compare never run past the end
+ */
+static inline grub_size_t
+report_words (grub_size_t report_size)
+{
+    return (report_size + 7) / 8 + 1;
+}
+
+/*
+ * Press lookup: for one byte of the press mask, the controls to queue
+ * packed 4 bits each (first one in the low bits) and how many there are.
+ * Index 0 covers state bits 0-7, index 1 state bits 8-15.
+ */
+struct press_list
+{
+    grub_uint32_t controls;
+    grub_uint32_t count;
+};
+
+static struct press_list press_lut[2][256];
+static int control_keys[STATE_CONTROLS];
+
+/*
+ * Order in which simultaneous presses are queued: directions, then
+ * A, B, X, Y, Start, Select, L, R, then the byte 5 extras.
+ */
+static const grub_uint8_t press_order[STATE_CONTROLS] = {
+    0, 1, 2, 3, 5, 6, 4, 7, 11, 10, 8, 9, 12, 13, 14, 15
+};
+
+/*
+ * Terminal input devices array
+ */
+static struct grub_term_input gamepads[GAMEPADS_CAPACITY];
+
+#if AGGREGATE_TERMINAL
+/*
+ * Aggregate mode: attached pads packed at the front of active_pads, so
+ * a poll only walks the slots in use. active_next is where the next key
+ * lookup starts, which keeps one busy pad from starving the others.
+ */
+static struct grub_usb_snes_data *active_pads[GAMEPADS_CAPACITY];
+static unsigned active_count;
+static unsigned active_next;
+
+static int grub_usb_snes_aggregate_getkey (struct grub_term_input *term);
+static int grub_usb_snes_getkeystatus (struct grub_term_input *term);
+
+static struct grub_term_input aggregate_term = {
+    .name = SNES_TERM_NAME,
+    .getkey = grub_usb_snes_aggregate_getkey,
+    .getkeystatus = grub_usb_snes_getkeystatus
+};
+#endif
+
+/*
+ * Key queue operations
+ */
+static void
+key_queue_push_keys (struct grub_usb_snes_data *data, const int *keys, int count,
+                     grub_uint64_t stamp)
+{
+    int i;
+
+    for (i = 0; i < count; i++)
+        snes_key_queue_push (&data->key_queue, keys[i], stamp);
+}
+
+static int
+key_queue_pop (struct grub_usb_snes_data *data)
+{
+    grub_uint64_t now = 0, stamp;
+    int key;
+
+    if (data->key_queue.size == 0)
+        return GRUB_TERM_NO_KEY;
+
+#if SNES_STATS || SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+    now = grub_get_time_ms ();
+#endif
+    key = snes_key_queue_pop (&data->key_queue, now, &stamp);
+
+#if SNES_STATS
+    if (key != GRUB_TERM_NO_KEY)
+    {
+        grub_uint64_t elapsed = now - stamp;
+        unsigned bucket;
+
+        if (elapsed <= 1)
+            bucket = 0;
+        else if (elapsed <= 4)
+            bucket = 1;
+        else if (elapsed <= 16)
+            bucket = 2;
+        else if (elapsed <= 64)
+            bucket = 3;
+        else
+            bucket = 4;
+        data->stats.latency[bucket]++;
+    }
+#endif
+
+    return key;
+}
+
+/*
+ * Transfer ring operations
+ */
+static int
+ring_post (struct grub_usb_snes_data *data)
+{
+    unsigned slot = (data->ring_head + data->ring_posted) % REPORT_RING_SIZE;
+
+    data->transfers[slot] = grub_usb_bulk_read_background (
+        data->usbdev,
+        data->endp,
+        data->report_size,
+        (char *) data->ring[slot]);
+
+    if (!data->transfers[slot])
+        return 0;
+
+    data->ring_posted++;
+    return 1;
+}
+
+static void
+ring_cancel (struct grub_usb_snes_data *data)
+{
+    while (data->ring_posted > 0)
+    {
+        grub_usb_cancel_transfer (data->transfers[data->ring_head]);
+        data->transfers[data->ring_head] = NULL;
+        data->ring_head = (data->ring_head + 1) % REPORT_RING_SIZE;
+        data->ring_posted--;
+    }
+}
+
+/*
+ * A transfer failed: back off, and after repeated failures clear the
+ * endpoint halt or reset the device. Outstanding transfers are
+ * cancelled first, they would only complete with the same error, so
+ * one error costs one failure however many slots were posted.
+ */
+static void
+ring_recover (struct grub_usb_snes_data *data)
+{
+    ring_cancel (data);
+
+    switch (snes_recovery_failed (&data->recovery))
+    {
+    case SNES_RECOVER_CLEAR_HALT:
+        snes_dprintf ("Clearing halt on endpoint 0x%02x\n",
+                      data->endp->endp_addr);
+        grub_usb_clear_halt (data->usbdev, data->endp->endp_addr);
+        break;
+
+    case SNES_RECOVER_RESET:
+        /* Re-selecting the configuration resets the endpoints and toggles */
+        snes_dprintf ("Resetting device after %u failures\n",
+                      data->recovery.streak);
+        grub_usb_set_configuration (data->usbdev, data->configno + 1);
+        grub_usb_clear_halt (data->usbdev, data->endp->endp_addr);
+        break;
+    }
+
+    grub_errno = GRUB_ERR_NONE;
+}
+
+/*
+ * Post transfers into every free slot, unless backing off.
+ *
+ * GRUB's OHCI and EHCI drivers refuse a transfer on an endpoint that
+ * still has one queued, so a post refused while others are in flight
+ * is not a failure: the ring shrinks to what the controller took and
+ * stays that size. Only a ring left empty goes to recovery.
+ */
+static void
+ring_fill (struct grub_usb_snes_data *data)
+{
+    if (!snes_recovery_ready (&data->recovery))
+        return;
+
+    while (data->ring_posted < data->ring_depth)
+    {
+        if (ring_post (data))
+            continue;
+
+        grub_errno = GRUB_ERR_NONE;
+        if (data->ring_posted > 0)
+        {
+            snes_dprintf ("Controller takes %u transfer(s) per endpoint\n",
+                          data->ring_posted);
+            data->ring_depth = data->ring_posted;
+            break;
+        }
+
+        SNES_STAT (data->stats.restart_failures++);
+        snes_dprintf ("Failed to restart USB transfer\n");
+        ring_recover (data);
+        break;
+    }
+}
+
+/*
+ * The endpoint's polling period in ms. bInterval is in frames at low
+ * and full speed, and an exponent of 125 us microframes at high speed.
+ */
+static grub_uint32_t
+endp_poll_interval (grub_usb_device_t usbdev, const struct grub_usb_desc_endp *endp)
+{
+    if (usbdev->speed == GRUB_USB_SPEED_HIGH)
+    {
+        unsigned exp = endp->interval ? endp->interval - 1 : 0;
+
+        return exp > 3 ? 1U << ((exp > 15 ? 15 : exp) - 3) : 1;
+    }
+    return endp->interval ? endp->interval : 1;
+}
+
+/*
+ * Check if this is a known SNES controller
+ */
+static const struct snes_device_id *
+find_device (grub_uint16_t vid, grub_uint16_t pid)
+{
+    grub_uint32_t key = ((grub_uint32_t) vid << 16) | pid;
+    unsigned lo = 0, hi = SNES_KNOWN_DEVICES;
+
+    /* Every HID interface lands here, keyboards included */
+    while (lo < hi)
+    {
+        unsigned mid = (lo + hi) / 2;
+
+        if (known_device_keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo < SNES_KNOWN_DEVICES && known_device_keys[lo] == key)
+        return &known_devices[lo];
+    return NULL;
+}
+
+/*
+ * HID report descriptor parsing
+ * From USB HID Specification 1.11, Section 6.2.2
+ */
+#define HID_ITEM_MAIN           0
+#define HID_ITEM_GLOBAL         1
+#define HID_ITEM_LOCAL          2
+
+#define HID_MAIN_INPUT          0x8
+#define HID_MAIN_COLLECTION     0xA
+#define HID_MAIN_END_COLLECTION 0xC
+#define HID_GLOBAL_USAGE_PAGE   0x0
+#define HID_GLOBAL_LOGICAL_MIN  0x1
+#define HID_GLOBAL_LOGICAL_MAX  0x2
+#define HID_GLOBAL_REPORT_SIZE  0x7
+#define HID_GLOBAL_REPORT_ID    0x8
+#define HID_GLOBAL_REPORT_COUNT 0x9
+#define HID_LOCAL_USAGE         0x0
+#define HID_LOCAL_USAGE_MIN     0x1
+#define HID_LOCAL_USAGE_MAX     0x2
+
+#define HID_INPUT_CONSTANT      (1 << 0)
+#define HID_INPUT_RELATIVE      (1 << 2)
+#define HID_COLLECTION_APP      0x01
+
+#define HID_PAGE_DESKTOP        0x01
+#define HID_PAGE_BUTTON         0x09
+#define HID_USAGE_JOYSTICK      0x04
+#define HID_USAGE_GAMEPAD       0x05
+#define HID_USAGE_MULTI_AXIS    0x08
+#define HID_USAGE_X             0x30
+#define HID_USAGE_Y             0x31
+#define HID_USAGE_HAT           0x39
+
+#define HID_MAX_USAGES          16
+
+struct hid_parser
+{
+    /* Global items */
+    grub_uint32_t usage_page;
+    grub_int32_t logical_min;
+    grub_uint32_t report_size;
+    grub_uint32_t report_count;
+    grub_uint8_t report_id;
+    /* Local items, reset after each main item */
+    grub_uint32_t usages[HID_MAX_USAGES];
+    unsigned n_usages;
+    grub_uint32_t usage_min;
+    grub_uint32_t usage_max;
+    int have_range;
+    /*
+     * Collection nesting, and the depth of the gamepad collection: -1
+     * outside one, -2 once every plan is taken
+     */
+    int depth;
+    int pad_depth;
+    int have_x, have_y, have_hat;
+    int locked_id;                      /* Report ID this plan uses, -1 if none yet */
+    grub_uint16_t id_bits[256];         /* Input bits seen so far per report ID */
+};
+
+static grub_uint32_t
+hid_field_usage (const struct hid_parser *hp, unsigned field)
+{
+    grub_uint32_t usage;
+
+    if (hp->have_range)
+    {
+        usage = hp->usage_min + field;
+        if (usage > hp->usage_max)
+            usage = hp->usage_max;
+    }
+    else if (hp->n_usages)
+        usage = hp->usages[field < hp->n_usages ? field : hp->n_usages - 1];
+    else
+        return 0;
+
+    /* Usages given in 4 bytes carry their own page */
+    if (!(usage >> 16))
+        usage |= hp->usage_page << 16;
+    return usage;
+}
+
+static void
+plan_add_op (struct decode_plan *plan, struct plan_op op)
+{
+    if (plan->n_ops < PLAN_MAX_OPS)
+        plan->ops[plan->n_ops++] = op;
+}
+
+/* Turn one Input main item into plan ops, returns the number added */
+static unsigned
+hid_add_input (struct hid_parser *hp, struct decode_plan *plan, unsigned pos)
+{
+    unsigned before = plan->n_ops;
+    unsigned size = hp->report_size;
+    unsigned f;
+
+    /* Reports with IDs start with the ID byte */
+    if (hp->report_id)
+        pos += 8;
+
+    if (size == 0 || size > 16)
+        return 0;
+
+    for (f = 0; f < hp->report_count; f++)
+    {
+        grub_uint32_t usage = hid_field_usage (hp, f);
+        unsigned bit = pos + f * size;
+        struct plan_op op = { .width = size, .bit = bit };
+
+        if (bit + size > 8 * REPORT_SIZE_MAX)
+            break;
+
+        if ((usage >> 16) == HID_PAGE_BUTTON && size == 1)
+        {
+            unsigned first = usage & 0xffff;
+            unsigned count = hp->report_count - f;
+
+            /* One op for the whole run of buttons */
+            if (first < 1 || STATE_BUTTONS_SHIFT + first - 1 >= STATE_CONTROLS)
+                break;
+            op.kind = PLAN_BUTTONS;
+            op.dest = STATE_BUTTONS_SHIFT + first - 1;
+            if (count > (unsigned) (STATE_CONTROLS - op.dest))
+                count = STATE_CONTROLS - op.dest;
+            if (bit + count > 8 * REPORT_SIZE_MAX)
+                count = 8 * REPORT_SIZE_MAX - bit;
+            op.width = count;
+            plan_add_op (plan, op);
+            break;
+        }
+
+        if ((usage >> 16) != HID_PAGE_DESKTOP)
+            continue;
+
+        switch (usage & 0xffff)
+        {
+        case HID_USAGE_X:
+            if (hp->have_x++)
+                break;
+            op.dest = AXIS_DEST_X;
+            goto axis;
+
+        case HID_USAGE_Y:
+            if (hp->have_y++)
+                break;
+            op.dest = AXIS_DEST_Y;
+        axis:
+            op.kind = PLAN_AXIS;
+            if (hp->logical_min < 0)
+                op.flip = 1 << (size - 1);
+            plan_add_op (plan, op);
+            break;
+
+        case HID_USAGE_HAT:
+            if (hp->have_hat++)
+                break;
+            op.kind = PLAN_HAT;
+            op.base = hp->logical_min;
+            plan_add_op (plan, op);
+            break;
+        }
+    }
+
+    return plan->n_ops - before;
+}
+
+/*
+ * Compile a report descriptor into decode plans, one per joystick or
+ * gamepad application collection, up to max. Only absolute inputs are
+ * used, and each plan takes them from one report ID. Push/Pop are not
+ * supported. Returns the number of usable plans.
+ */
+static unsigned
+plan_compile (struct decode_plan *plans, unsigned max,
+              const grub_uint8_t *desc, grub_size_t len)
+{
+    struct hid_parser *hp;
+    struct decode_plan *plan = plans;
+    unsigned n_plans = 0, p;
+    grub_size_t i = 0;
+
+    hp = grub_zalloc (sizeof (*hp));
+    if (!hp)
+        return 0;
+
+    hp->pad_depth = -1;
+    hp->locked_id = -1;
+    plan->report_id = 0;
+    plan->n_ops = 0;
+
+    while (i < len)
+    {
+        grub_uint8_t prefix = desc[i++];
+        unsigned size = (prefix & 3) == 3 ? 4 : (prefix & 3);
+        unsigned type = (prefix >> 2) & 3;
+        unsigned tag = prefix >> 4;
+        grub_uint32_t value = 0;
+        grub_int32_t svalue;
+        unsigned b;
+
+        /* Long items never describe gamepad fields */
+        if (prefix == 0xfe)
+        {
+            if (i + 1 >= len)
+                break;
+            i += 2 + desc[i];
+            continue;
+        }
+
+        if (i + size > len)
+            break;
+        for (b = 0; b < size; b++)
+            value |= (grub_uint32_t) desc[i + b] << (8 * b);
+        i += size;
+
+        if (size == 1)
+            svalue = (grub_int8_t) value;
+        else if (size == 2)
+            svalue = (grub_int16_t) value;
+        else
+            svalue = (grub_int32_t) value;
+
+        if (type == HID_ITEM_GLOBAL)
+        {
+            switch (tag)
+            {
+            case HID_GLOBAL_USAGE_PAGE:   hp->usage_page = value; break;
+            case HID_GLOBAL_LOGICAL_MIN:  hp->logical_min = svalue; break;
+            case HID_GLOBAL_REPORT_SIZE:  hp->report_size = value; break;
+            case HID_GLOBAL_REPORT_ID:    hp->report_id = value; break;
+            case HID_GLOBAL_REPORT_COUNT: hp->report_count = value; break;
+            }
+            continue;
+        }
+
+        if (type == HID_ITEM_LOCAL)
+        {
+            switch (tag)
+            {
+            case HID_LOCAL_USAGE:
+                if (hp->n_usages < HID_MAX_USAGES)
+                    hp->usages[hp->n_usages++] = value;
+                break;
+            case HID_LOCAL_USAGE_MIN:
+                hp->usage_min = value;
+                hp->have_range = 1;
+                break;
+            case HID_LOCAL_USAGE_MAX:
+                hp->usage_max = value;
+                hp->have_range = 1;
+                break;
+            }
+            continue;
+        }
+
+        if (type != HID_ITEM_MAIN)
+            continue;
+
+        switch (tag)
+        {
+        case HID_MAIN_COLLECTION:
+            if (value == HID_COLLECTION_APP && hp->pad_depth == -1)
+            {
+                grub_uint32_t usage = hid_field_usage (hp, 0);
+
+                if (usage == ((HID_PAGE_DESKTOP << 16) | HID_USAGE_JOYSTICK)
+                    || usage == ((HID_PAGE_DESKTOP << 16) | HID_USAGE_GAMEPAD)
+                    || usage == ((HID_PAGE_DESKTOP << 16) | HID_USAGE_MULTI_AXIS))
+                    hp->pad_depth = hp->depth;
+            }
+            hp->depth++;
+            break;
+
+        case HID_MAIN_END_COLLECTION:
+            if (hp->depth > 0)
+                hp->depth--;
+            if (hp->depth > hp->pad_depth)
+                break;
+
+            /* Done with this gamepad, the next collection gets a new plan */
+            hp->pad_depth = -1;
+            if (plan->n_ops == 0)
+                break;
+            if (++n_plans == max)
+            {
+                hp->pad_depth = -2;
+                break;
+            }
+            plan = &plans[n_plans];
+            plan->report_id = 0;
+            plan->n_ops = 0;
+            hp->locked_id = -1;
+            hp->have_x = hp->have_y = hp->have_hat = 0;
+            break;
+
+        case HID_MAIN_INPUT:
+            if (hp->pad_depth >= 0
+                && !(value & (HID_INPUT_CONSTANT | HID_INPUT_RELATIVE))
+                && (hp->locked_id < 0 || hp->locked_id == hp->report_id)
+                && hid_add_input (hp, plan, hp->id_bits[hp->report_id]))
+            {
+                hp->locked_id = hp->report_id;
+                plan->report_id = hp->report_id;
+            }
+            hp->id_bits[hp->report_id] += hp->report_size * hp->report_count;
+            break;
+        }
+
+        /* Local items only apply to the main item that follows them */
+        hp->n_usages = 0;
+        hp->have_range = 0;
+    }
+
+    /* A truncated descriptor may leave the last gamepad unterminated */
+    if (n_plans < max && plan->n_ops > 0)
+        n_plans++;
+
+    for (p = 0; p < n_plans; p++)
+    {
+        unsigned id = plans[p].report_id;
+        unsigned report_len = (hp->id_bits[id] + 7) / 8 + (id ? 1 : 0);
+
+        plans[p].report_len = report_len < REPORT_SIZE_MAX ? report_len : REPORT_SIZE_MAX;
+    }
+
+    grub_free (hp);
+    return n_plans;
+}
+
+/*
+ * Fetch the interface's report descriptor and compile it.
+ * The HID class descriptor that follows the interface descriptor gives
+ * the exact length; without it ask for HID_REPORT_DESC_MAX bytes.
+ */
+static unsigned
+plan_from_device (struct decode_plan *plans, unsigned max,
+                  grub_usb_device_t usbdev, int configno, int interfno)
+{
+    struct grub_usb_desc_if *descif = usbdev->config[configno].interf[interfno].descif;
+    const grub_uint8_t *hid = (const grub_uint8_t *) descif + descif->length;
+    grub_size_t len = HID_REPORT_DESC_MAX;
+    grub_uint8_t *desc;
+    grub_usb_err_t err;
+    unsigned n = 0;
+
+    if (hid[0] >= 9 && hid[1] == USB_DESC_HID && hid[6] == USB_DESC_HID_REPORT)
+    {
+        len = hid[7] | (hid[8] << 8);
+        if (len == 0 || len > HID_REPORT_DESC_MAX)
+            len = HID_REPORT_DESC_MAX;
+    }
+
+    desc = grub_zalloc (len);
+    if (!desc)
+        return 0;
+
+    err = grub_usb_control_msg (usbdev,
+                                GRUB_USB_REQTYPE_IN
+                                | GRUB_USB_REQTYPE_STANDARD
+                                | GRUB_USB_REQTYPE_TARGET_INTERF,
+                                USB_REQ_GET_DESCRIPTOR,
+                                (USB_DESC_HID_REPORT << 8) | 0,
+                                interfno,
+                                len,
+                                (char *) desc);
+    if (err == GRUB_USB_ERR_NONE)
+        n = plan_compile (plans, max, desc, len);
+    else
+        snes_dprintf ("GET_DESCRIPTOR(report) failed: %d\n", err);
+
+    grub_free (desc);
+    return n;
+}
+
+/* Does the len-byte token at s spell name exactly? */
+static int
+token_is (const char *s, grub_size_t len, const char *name)
+{
+    return grub_strlen (name) == len && grub_strncmp (s, name, len) == 0;
+}
+
+/* Key for a snes_map value, or -1 if it names none */
+static int
+keymap_key (const char *s, grub_size_t len)
+{
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE (key_names); i++)
+        if (token_is (s, len, key_names[i].name))
+            return key_names[i].key;
+    if (len == 1 && s[0] > ' ' && s[0] < 0x7f)
+        return s[0];
+    return -1;
+}
+
+/*
+ * Fill keys from the defaults and the snes_map environment variable.
+ * A bad entry is logged and skipped; the rest of the map still applies.
+ */
+static void
+keymap_load (int *keys)
+{
+    const char *map = grub_env_get ("snes_map");
+
+    grub_memcpy (keys, default_keys, sizeof (default_keys));
+    if (!map)
+        return;
+
+    while (*map)
+    {
+        const char *end = grub_strchr (map, ',');
+        grub_size_t len = end ? (grub_size_t) (end - map) : grub_strlen (map);
+        grub_size_t name_len;
+        unsigned ctrl = STATE_CONTROLS;
+        int key = -1;
+
+        for (name_len = 0; name_len < len && map[name_len] != ':'; name_len++)
+            ;
+        if (name_len < len)
+            for (ctrl = 0; ctrl < STATE_CONTROLS; ctrl++)
+                if (token_is (map, name_len, control_names[ctrl]))
+                    break;
+        if (ctrl < STATE_CONTROLS)
+            key = keymap_key (map + name_len + 1, len - name_len - 1);
+
+        if (key != -1)
+            keys[ctrl] = key;
+#if SNES_DEBUG
+        else
+        {
+            char *entry = grub_strndup (map, len);
+
+            snes_dprintf ("snes_map: ignoring '%s'\n", entry ? entry : "?");
+            grub_free (entry);
+        }
+#endif
+
+        map += len;
+        if (*map == ',')
+            map++;
+    }
+}
+
+/*
+ * Build the press tables from the key mappings.
+ * This is the only place snes_map is read: reports only index tables.
+ */
+static void
+build_decode_tables (void)
+{
+    unsigned half, mask, i;
+
+    keymap_load (control_keys);
+
+    for (half = 0; half < 2; half++)
+        for (mask = 0; mask < 256; mask++)
+        {
+            struct press_list *list = &press_lut[half][mask];
+
+            list->controls = 0;
+            list->count = 0;
+            for (i = 0; i < STATE_CONTROLS; i++)
+            {
+                unsigned ctrl = press_order[i];
+
+                if ((ctrl >> 3) != half || !(mask & (1 << (ctrl & 7))))
+                    continue;
+                if (control_keys[ctrl] == GRUB_TERM_NO_KEY)
+                    continue;
+                list->controls |= ctrl << (4 * list->count);
+                list->count++;
+            }
+        }
+}
+
+/*
+ * One axis's table for a rest position. From released a direction needs
+ * the press threshold; once pressed it holds until the release threshold.
+ * Both bits set (never produced) reads as released.
+ */
+static void
+axis_lut_build (grub_uint8_t *lut, unsigned rest)
+{
+    int v;
+
+    for (v = 0; v < 256; v++)
+    {
+        int d = v - (int) rest;
+        unsigned released = 0, low, high;
+
+        if (d < -AXIS_PRESS_THRESHOLD)
+            released = AXIS_LOW;
+        else if (d > AXIS_PRESS_THRESHOLD)
+            released = AXIS_HIGH;
+        low = d < -AXIS_RELEASE_THRESHOLD ? AXIS_LOW : released;
+        high = d > AXIS_RELEASE_THRESHOLD ? AXIS_HIGH : released;
+
+        lut[v] = released | (low << (AXIS_BITS * AXIS_LOW))
+                 | (high << (AXIS_BITS * AXIS_HIGH))
+                 | (released << (AXIS_BITS * (AXIS_LOW | AXIS_HIGH)));
+    }
+}
+
+/* Axis field of a report, scaled to 8 bits */
+static inline unsigned
+axis_value (const struct plan_op *op, grub_uint32_t v)
+{
+    return ((v ^ op->flip) << (16 - op->width)) >> 8;
+}
+
+/* Bytes of the report the plan reads, report ID included */
+static unsigned
+plan_span (const struct decode_plan *plan)
+{
+    unsigned span = plan->report_id ? 1 : 0;
+    unsigned i;
+
+    for (i = 0; i < plan->n_ops; i++)
+    {
+        unsigned end = (plan->ops[i].bit + plan->ops[i].width + 7) / 8;
+
+        if (end > span)
+            span = end;
+    }
+    return span;
+}
+
+/* Fields are at most 16 bits, so three bytes always cover one */
+static inline grub_uint32_t
+report_field (const grub_uint8_t *report, unsigned bit, unsigned width)
+{
+    const grub_uint8_t *p = report + (bit >> 3);
+    grub_uint32_t v = p[0] | (p[1] << 8) | ((grub_uint32_t) p[2] << 16);
+
+    return (v >> (bit & 7)) & ((1U << width) - 1);
+}
+
+/*
+ * Add one report's axes to the rest samples. Returns the axes of the
+ * plan that had no value near the centre, one bit per axis.
  */
-#define USB_HID_GET_REPORT      0x01
-#define USB_HID_GET_IDLE        0x02
-#define USB_HID_GET_PROTOCOL    0x03
-#define USB_HID_SET_REPORT      0x09
-#define USB_HID_SET_IDLE        0x0A
-#define USB_HID_SET_PROTOCOL    0x0B
+static unsigned
+pad_rest_sample (struct snes_pad *pad, const grub_uint8_t *report)
+{
+    const struct decode_plan *plan = &pad->plan;
+    unsigned i, axis, missing = 0;
 
-/*
- * USB HID Subclass and Protocol values
- * Boot protocol is simpler and more compatible
- */
-#define USB_HID_BOOT_SUBCLASS   0x01
-#define USB_HID_GAMEPAD_PROTOCOL 0x00  /* Gamepads use protocol 0 */
+    for (i = 0; i < plan->n_ops; i++)
+    {
+        const struct plan_op *op = &plan->ops[i];
+        unsigned v;
 
-/*
- * Module configuration
- */
-#define GAMEPADS_CAPACITY       8
-#define KEY_QUEUE_CAPACITY      32
-#define USB_REPORT_SIZE         8
+        if (op->kind != PLAN_AXIS)
+            continue;
+        v = axis_value (op, report_field (report, op->bit, op->width));
+        axis = op->dest / 2;
+        /* A direction held says nothing about rest */
+        if (v + AXIS_REST_MAX >= AXIS_CENTER && v <= AXIS_CENTER + AXIS_REST_MAX)
+        {
+            pad->rest_sum[axis] += v;
+            pad->rest_count[axis]++;
+        }
+        else
+            missing |= 1 << axis;
+    }
+    return missing;
+}
 
-/*
- * D-pad axis processing
- */
-#define AXIS_CENTER             0x7F
-#define AXIS_THRESHOLD          0x40
+/* Swap in tables built around the rest positions sampled so far */
+static void
+pad_rest_done (struct snes_pad *pad)
+{
+    unsigned axis;
+
+    pad->calibrating = 0;
+    for (axis = 0; axis < AXES; axis++)
+    {
+        unsigned n = pad->rest_count[axis];
+        unsigned rest = n ? (pad->rest_sum[axis] + n / 2) / n : AXIS_CENTER;
+
+        axis_lut_build (pad->axis_lut[axis], rest);
+        snes_dprintf ("Axis %d rests at 0x%02x (%d samples)\n", axis, rest, n);
+    }
+}
 
 /*
- * SNES Button bit masks (in report byte 4)
+ * Learn the rest positions from one of the pad's first reports; the
+ * last one swaps in tables built around them
  */
-#define BTN_X           (1 << 0)
-#define BTN_A           (1 << 1)
-#define BTN_B           (1 << 2)
-#define BTN_Y           (1 << 3)
-#define BTN_L           (1 << 4)
-#define BTN_R           (1 << 5)
-#define BTN_SELECT      (1 << 6)
-#define BTN_START       (1 << 7)
+static void
+pad_calibrate (struct snes_pad *pad, const grub_uint8_t *report)
+{
+    pad_rest_sample (pad, report);
+    if (--pad->calibrating == 0)
+        pad_rest_done (pad);
+}
 
 /*
- * Supported SNES controller VID/PIDs
- * Set ACCEPT_ANY_HID to 1 to accept any HID gamepad device
+ * Read each pad's rest state with GET_REPORT. Pads that only report on
+ * change may send nothing until the first press, so their first reports
+ * are a poor sample. When every axis reads near the centre that settles
+ * it; otherwise the reads count as samples and the first reports
+ * complete the calibration. A short answer leaves zeroes, which never
+ * pass for rest.
+ *
+ * Each report ID is asked for once and its answer shared by every pad
+ * it carries. The first failure ends the reads: a pad that stalls or
+ * times out on one ID will on the next, and each costs a control
+ * transfer timeout before the menu responds.
  */
-#define ACCEPT_ANY_HID  1
+static void
+pad_read_rest (struct grub_usb_snes_data *data, const struct snes_device_id *device)
+{
+    grub_uint8_t *bytes = (grub_uint8_t *) data->report;
+    unsigned i, j, done = 0;
 
-struct snes_device_id {
-    grub_uint16_t vid;
-    grub_uint16_t pid;
-    const char *name;
-};
+    if (device->quirks & QUIRK_NO_GET_REPORT)
+        return;
+    for (i = 0; i < data->n_pads; i++)
+    {
+        grub_uint8_t report_id = data->pads[i].plan.report_id;
+        grub_usb_err_t err;
 
-static const struct snes_device_id known_devices[] = {
-    { 0x0810, 0xe501, "Generic SNES (0810:e501)" },
-    { 0x0079, 0x0011, "DragonRise (0079:0011)" },
-    { 0x0583, 0x2060, "iBuffalo SNES (0583:2060)" },
-    { 0x2dc8, 0x9018, "8BitDo SN30 (2dc8:9018)" },
-    { 0x12bd, 0xd015, "Generic 2-pack (12bd:d015)" },
-    { 0x1a34, 0x0802, "USB Gamepad (1a34:0802)" },
-    { 0x0810, 0x0001, "Generic Gamepad (0810:0001)" },
-    { 0x0079, 0x0006, "DragonRise (0079:0006)" },
-    { 0x0000, 0x0000, NULL }  /* End marker */
-};
+        if (done & (1 << i))
+            continue;
+        grub_memset (bytes, 0, data->report_size);
+        err = grub_usb_control_msg (data->usbdev,
+                                    GRUB_USB_REQTYPE_CLASS_INTERFACE_IN,
+                                    USB_HID_GET_REPORT,
+                                    (USB_HID_REPORT_INPUT << 8) | report_id,
+                                    data->interfno,
+                                    data->report_size,
+                                    (char *) bytes);
+        if (err != GRUB_USB_ERR_NONE)
+        {
+            snes_dprintf ("No GET_REPORT (%d), calibrating from reports\n", err);
+            break;
+        }
+        for (j = i; j < data->n_pads; j++)
+        {
+            struct snes_pad *pad = &data->pads[j];
+
+            if (pad->plan.report_id != report_id)
+                continue;
+            done |= 1 << j;
+            if (report_id && bytes[0] != report_id)
+                snes_dprintf ("Pad %d: GET_REPORT answered for ID %d\n", j, bytes[0]);
+            else if (pad_rest_sample (pad, bytes) == 0)
+                pad_rest_done (pad);
+        }
+    }
+    grub_memset (bytes, 0, data->report_size);
+}
 
 /*
- * Key mappings - GRUB navigation keys
+ * Decode a report into STATE_* bits by running the pad's plan
  */
-static int key_up     = GRUB_TERM_KEY_UP;
-static int key_down   = GRUB_TERM_KEY_DOWN;
-static int key_left   = GRUB_TERM_KEY_LEFT;
-static int key_right  = GRUB_TERM_KEY_RIGHT;
-static int key_a      = '\r';                   /* Enter - select */
-static int key_b      = GRUB_TERM_ESC;          /* Escape - back */
-static int key_start  = '\r';                   /* Enter - select */
-static int key_select = 'e';                    /* Edit entry */
-static int key_x      = 'c';                    /* Command line */
-static int key_y      = GRUB_TERM_ESC;          /* Escape - back */
-static int key_l      = GRUB_TERM_KEY_PPAGE;    /* Page up */
-static int key_r      = GRUB_TERM_KEY_NPAGE;    /* Page down */
+static grub_uint16_t
+decode_state (struct snes_pad *pad, const grub_uint8_t *report)
+{
+    const struct decode_plan *plan = &pad->plan;
+    grub_uint32_t state = 0;
+    unsigned i;
 
-/*
- * Per-device state structure
- */
-struct grub_usb_snes_data
+    for (i = 0; i < plan->n_ops; i++)
+    {
+        const struct plan_op *op = &plan->ops[i];
+        grub_uint32_t v = report_field (report, op->bit, op->width);
+        unsigned shift, q;
+
+        switch (op->kind)
+        {
+        case PLAN_AXIS:
+            shift = op->dest;
+            q = (pad->axis_state >> shift) & (AXIS_LOW | AXIS_HIGH);
+            q = (pad->axis_lut[op->dest / 2][axis_value (op, v)] >> (AXIS_BITS * q))
+                & (AXIS_LOW | AXIS_HIGH);
+            pad->axis_state = (pad->axis_state & ~((AXIS_LOW | AXIS_HIGH) << shift))
+                              | (q << shift);
+            state |= q << op->dest;
+            break;
+        case PLAN_HAT:
+            state |= hat_lut[(v - op->base) & 0xf];
+            break;
+        case PLAN_BUTTONS:
+            state |= (v ^ op->flip) << op->dest;
+            break;
+        }
+    }
+
+    return state;
+}
+
+static int
+press_list_expand (const struct press_list *list, int *keys, int count)
 {
-    grub_usb_device_t usbdev;
-    int configno;
-    int interfno;
-    struct grub_usb_desc_endp *endp;
-    grub_usb_transfer_t transfer;
-    grub_uint8_t report[USB_REPORT_SIZE];
-    grub_uint8_t prev_report[USB_REPORT_SIZE];
-    int key_queue[KEY_QUEUE_CAPACITY];
-    int key_queue_begin;
-    int key_queue_size;
-};
+    grub_uint32_t controls = list->controls;
+    grub_uint32_t i;
 
-/*
- * Terminal input devices array
- */
-static struct grub_term_input gamepads[GAMEPADS_CAPACITY];
+    for (i = 0; i < list->count; i++, controls >>= 4)
+        keys[count++] = control_keys[controls & 0xf];
+    return count;
+}
 
 /*
- * Initial/baseline report for SNES controllers (centered, no buttons)
+ * Process HID report and generate key events on press (not release)
  */
-static const grub_uint8_t baseline_report[USB_REPORT_SIZE] = {
-    0x7F, 0x7F, 0x7F, 0x7F, 0x00, 0x00, 0x00, 0x00
-};
+static void
+process_report (struct grub_usb_snes_data *data, struct snes_pad *pad,
+                grub_uint64_t stamp)
+{
+    grub_uint16_t state, pressed;
+    int keys[STATE_CONTROLS];
+    int count;
+
+    if (pad->calibrating)
+        pad_calibrate (pad, (const grub_uint8_t *) data->report);
+    state = decode_state (pad, (const grub_uint8_t *) data->report);
+    pressed = (pad->state ^ state) & state;
+    pad->state = state;
+    data->last_active = stamp;
+
+    count = press_list_expand (&press_lut[0][pressed & 0xff], keys, 0);
+    count = press_list_expand (&press_lut[1][pressed >> 8], keys, count);
+    if (count)
+        key_queue_push_keys (data, keys, count, stamp);
+
+    /* A new repeatable press takes over auto-repeat, releasing it stops it */
+    pressed &= STATE_REPEAT_MASK;
+    if (pressed)
+    {
+        int ctrl = 0;
+
+        while (!(pressed & (1 << ctrl)))
+            ctrl++;
+        if (control_keys[ctrl] != GRUB_TERM_NO_KEY)
+        {
+            pad->repeat_ctrl = ctrl;
+            pad->repeat_interval = REPEAT_RATE_MS;
+            pad->repeat_next = stamp + REPEAT_DELAY_MS;
+        }
+    }
+    else if (pad->repeat_ctrl != REPEAT_NONE && !(state & (1 << pad->repeat_ctrl)))
+        pad->repeat_ctrl = REPEAT_NONE;
+}
 
 /*
- * Key queue operations
+ * Queue each held control's key once its repeat is due.
+ * Only reads the clock while a repeatable control is held, and only
+ * feeds the queue when it is empty, so repeats never pile up behind a
+ * slow redraw.
  */
 static void
-key_queue_push (struct grub_usb_snes_data *data, int key)
+repeat_tick (struct grub_usb_snes_data *data)
 {
-    if (key == GRUB_TERM_NO_KEY)
-        return;
+    grub_uint64_t now = 0;
+    unsigned i;
 
-    int pos = (data->key_queue_begin + data->key_queue_size) % KEY_QUEUE_CAPACITY;
-    data->key_queue[pos] = key;
+    if (data->key_queue.size > 0)
+        return;
 
-    if (data->key_queue_size < KEY_QUEUE_CAPACITY)
+    for (i = 0; i < data->n_pads; i++)
     {
-        data->key_queue_size++;
+        struct snes_pad *pad = &data->pads[i];
+
+        if (pad->repeat_ctrl == REPEAT_NONE)
+            continue;
+
+        if (!now)
+            now = grub_get_time_ms ();
+        if (now < pad->repeat_next)
+            continue;
+
+        snes_key_queue_push (&data->key_queue, control_keys[pad->repeat_ctrl], now);
+        data->last_active = now;
+
+#if REPEAT_ACCEL_DIV
+        if (pad->repeat_interval > REPEAT_MIN_MS)
+        {
+            pad->repeat_interval -= pad->repeat_interval / REPEAT_ACCEL_DIV;
+            if (pad->repeat_interval < REPEAT_MIN_MS)
+                pad->repeat_interval = REPEAT_MIN_MS;
+        }
+#endif
+        pad->repeat_next = now + pad->repeat_interval;
     }
+}
+
+/*
+ * Copy and compare only the bytes the plans read, masked to one word
+ * for the common short layouts
+ */
+static inline void
+report_copy (const struct grub_usb_snes_data *data, grub_uint64_t *dst,
+             const grub_uint64_t *src)
+{
+    if (data->span <= 8)
+        dst[0] = src[0] & data->span_mask;
     else
-    {
-        /* Queue full, drop oldest */
-        data->key_queue_begin = (data->key_queue_begin + 1) % KEY_QUEUE_CAPACITY;
-    }
+        grub_memcpy (dst, src, data->span);
 }
 
-static int
-key_queue_pop (struct grub_usb_snes_data *data)
+static inline int
+pad_unchanged (const struct snes_pad *pad, const grub_uint64_t *report)
 {
-    if (data->key_queue_size <= 0)
-        return GRUB_TERM_NO_KEY;
+    if (pad->span <= 8)
+        return (report[0] & pad->span_mask) == pad->prev_report[0];
+    return grub_memcmp (report, pad->prev_report, pad->span) == 0;
+}
 
-    int key = data->key_queue[data->key_queue_begin];
-    data->key_queue_begin = (data->key_queue_begin + 1) % KEY_QUEUE_CAPACITY;
-    data->key_queue_size--;
-    return key;
+static inline void
+pad_save (struct snes_pad *pad, const grub_uint64_t *report)
+{
+    if (pad->span <= 8)
+        pad->prev_report[0] = report[0] & pad->span_mask;
+    else
+        grub_memcpy (pad->prev_report, report, pad->span);
+}
+
+/* Mask keeping the first span bytes of a little-endian report word */
+static grub_uint64_t
+span_to_mask (unsigned span)
+{
+    if (span >= 8)
+        return ~(grub_uint64_t) 0;
+    return grub_cpu_to_le64 ((1ULL << (8 * span)) - 1);
 }
 
 /*
- * Check if this is a known SNES controller
+ * Add a player decoded by plan, with its previous-report buffer at prev.
+ * A non-zero report_len overrides the length the plan implies.
  */
-static const char *
-get_device_name (grub_uint16_t vid, grub_uint16_t pid)
+static void
+pad_setup (struct grub_usb_snes_data *data, const struct decode_plan *plan,
+           unsigned report_len, grub_uint64_t *prev)
 {
-    int i;
-    for (i = 0; known_devices[i].name != NULL; i++)
+    struct snes_pad *pad = &data->pads[data->n_pads++];
+    unsigned i;
+
+    pad->plan = *plan;
+    if (plan_span (plan) > data->report_size)
     {
-        if (known_devices[i].vid == vid && known_devices[i].pid == pid)
-            return known_devices[i].name;
+        snes_dprintf ("Plan reads past the %d byte report\n",
+                      data->report_size);
+        pad->plan = default_plan;
     }
-    return NULL;
+
+    pad->report_len = report_len ? report_len : pad->plan.report_len;
+    if (pad->report_len > data->report_size)
+        pad->report_len = data->report_size;
+
+    pad->span = plan_span (&pad->plan);
+    pad->span_mask = span_to_mask (pad->span);
+    pad->prev_report = prev;
+    pad->state = 0;
+    pad->repeat_ctrl = REPEAT_NONE;
+
+    /* Centred tables until the first reports tell where the axes rest */
+    pad->axis_state = 0;
+    pad->calibrating = AXIS_CALIBRATION_REPORTS;
+    for (i = 0; i < AXES; i++)
+    {
+        pad->rest_sum[i] = 0;
+        pad->rest_count[i] = 0;
+        axis_lut_build (pad->axis_lut[i], AXIS_CENTER);
+    }
+
+    if (pad->span > data->span)
+        data->span = pad->span;
+    if (pad->report_len < data->report_len)
+        data->report_len = pad->report_len;
+
+    snes_dprintf ("Pad %d: %d ops, report ID %d, span %d\n",
+                  data->n_pads - 1, pad->plan.n_ops, pad->plan.report_id, pad->span);
+}
+
+/* Time between checks in idle mode, see the poll governor above */
+static grub_uint32_t
+idle_poll_interval (const struct grub_usb_snes_data *data)
+{
+    grub_uint32_t ring_time = data->ring_depth * data->poll_interval;
+
+    if (data->streaming && data->poll_idle_interval > ring_time)
+        return ring_time;
+    return data->poll_idle_interval;
 }
 
 /*
- * Process HID report and generate key events
+ * Service completed transfers and queue the keys they produce, at most
+ * once per poll interval
  */
 static void
-process_report (struct grub_usb_snes_data *data)
-{
-    grub_uint8_t *prev = data->prev_report;
-    grub_uint8_t *curr = data->report;
-
-    /* D-pad from X-axis (byte 0) */
-    int prev_left  = (prev[0] < AXIS_CENTER - AXIS_THRESHOLD);
-    int prev_right = (prev[0] > AXIS_CENTER + AXIS_THRESHOLD);
-    int curr_left  = (curr[0] < AXIS_CENTER - AXIS_THRESHOLD);
-    int curr_right = (curr[0] > AXIS_CENTER + AXIS_THRESHOLD);
-
-    /* D-pad from Y-axis (byte 1) */
-    int prev_up   = (prev[1] < AXIS_CENTER - AXIS_THRESHOLD);
-    int prev_down = (prev[1] > AXIS_CENTER + AXIS_THRESHOLD);
-    int curr_up   = (curr[1] < AXIS_CENTER - AXIS_THRESHOLD);
-    int curr_down = (curr[1] > AXIS_CENTER + AXIS_THRESHOLD);
-
-    /* Generate key events on press (not release) */
-    if (!prev_up && curr_up)
-        key_queue_push (data, key_up);
-    if (!prev_down && curr_down)
-        key_queue_push (data, key_down);
-    if (!prev_left && curr_left)
-        key_queue_push (data, key_left);
-    if (!prev_right && curr_right)
-        key_queue_push (data, key_right);
-
-    /* Buttons from byte 4 */
-    grub_uint8_t prev_btns = prev[4];
-    grub_uint8_t curr_btns = curr[4];
-
-#define BTN_PRESSED(p, c, m) (!(p & m) && (c & m))
-
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_A))
-        key_queue_push (data, key_a);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_B))
-        key_queue_push (data, key_b);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_X))
-        key_queue_push (data, key_x);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_Y))
-        key_queue_push (data, key_y);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_START))
-        key_queue_push (data, key_start);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_SELECT))
-        key_queue_push (data, key_select);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_L))
-        key_queue_push (data, key_l);
-    if (BTN_PRESSED (prev_btns, curr_btns, BTN_R))
-        key_queue_push (data, key_r);
-
-#undef BTN_PRESSED
+poll_device (struct grub_usb_snes_data *data)
+{
+    grub_size_t actual;
+    grub_usb_err_t err;
+    grub_uint64_t stamp, now;
+    unsigned n, i;
+
+    now = grub_get_time_ms ();
+    if (now < data->poll_next)
+        return;
+    SNES_STAT (data->stats.polls++);
+
+    /*
+     * Consume completed transfers oldest first, stopping at the first one
+     * still pending. Bounded so a device failing every transfer at once
+     * cannot keep us here.
+     */
+    for (n = 0; n < REPORT_RING_SIZE && data->ring_posted > 0; n++)
+    {
+        unsigned slot = data->ring_head;
+        int valid;
+
+        err = grub_usb_check_transfer (data->transfers[slot], &actual);
+        if (err == GRUB_USB_ERR_WAIT)
+            break;
+
+        /* Latency is measured from here to the key leaving the queue */
+        stamp = grub_get_time_ms ();
+
+        /* Transfer completed (success or error), its slot is free again */
+        data->transfers[slot] = NULL;
+        data->ring_head = (slot + 1) % REPORT_RING_SIZE;
+        data->ring_posted--;
+
+        valid = (err == GRUB_USB_ERR_NONE && actual >= data->report_len);
+        if (valid)
+        {
+            report_copy (data, data->report, data->ring[slot]);
+            SNES_STAT (data->stats.reports++);
+            snes_recovery_succeeded (&data->recovery);
+        }
+        else
+        {
+            SNES_STAT (data->stats.bad_transfers++);
+            /* Short reports are the pad's business, errors are ours */
+            if (err != GRUB_USB_ERR_NONE)
+                ring_recover (data);
+        }
+
+        /* Re-arm before decoding so the pad never waits for a buffer */
+        ring_fill (data);
+
+        if (!valid)
+            continue;
+
+        /* Hand the report to every player it carries */
+        for (i = 0; i < data->n_pads; i++)
+        {
+            struct snes_pad *pad = &data->pads[i];
+            const grub_uint8_t *bytes = (const grub_uint8_t *) data->report;
+
+            if (actual < pad->report_len
+                || (pad->plan.report_id && bytes[0] != pad->plan.report_id))
+                continue;
+
+            /*
+             * Pads that ignore SET_IDLE 0 repeat the same report endlessly.
+             * The first reports always go through: nothing came before
+             * them, and they calibrate the axes.
+             */
+            if (!pad->calibrating && pad_unchanged (pad, data->report))
+            {
+                SNES_STAT (data->stats.unchanged++);
+                data->streaming = 1;
+                continue;
+            }
+
+            /* Valid report received - process it */
+            process_report (data, pad, stamp);
+
+            /* Save current report as previous */
+            pad_save (pad, data->report);
+        }
+    }
+
+    /* Retry slots whose re-arm failed on an earlier poll */
+    if (data->ring_posted < data->ring_depth)
+        ring_fill (data);
+
+    /* Scheduled after decoding, so a report ends idle mode right away */
+#if SNES_IDLE_AFTER_MS
+    if (data->last_active + SNES_IDLE_AFTER_MS <= now)
+        data->poll_next = now + idle_poll_interval (data);
+    else
+#endif
+        data->poll_next = now + data->poll_interval;
 }
 
 /*
@@ -255,39 +1777,83 @@ static int
 grub_usb_snes_getkey (struct grub_term_input *term)
 {
     struct grub_usb_snes_data *data = term->data;
-    grub_size_t actual;
-    grub_usb_err_t err;
 
-    /* Check if USB transfer completed */
-    err = grub_usb_check_transfer (data->transfer, &actual);
+    poll_device (data);
+    repeat_tick (data);
+    return key_queue_pop (data);
+}
+
+#if AGGREGATE_TERMINAL
+/*
+ * Aggregate terminal: getkey
+ * Polls every active pad, then hands out one key, round robin
+ */
+static int
+grub_usb_snes_aggregate_getkey (struct grub_term_input *term __attribute__ ((unused)))
+{
+    unsigned i;
+
+    for (i = 0; i < active_count; i++)
+    {
+        poll_device (active_pads[i]);
+        repeat_tick (active_pads[i]);
+    }
 
-    if (err != GRUB_USB_ERR_WAIT)
+    for (i = 0; i < active_count; i++)
     {
-        /* Transfer completed (success or error) */
-        if (err == GRUB_USB_ERR_NONE && actual == USB_REPORT_SIZE)
+        unsigned idx = (active_next + i) % active_count;
+
+        if (active_pads[idx]->key_queue.size > 0)
         {
-            /* Valid report received - process it */
-            process_report (data);
+            active_next = (idx + 1) % active_count;
+            return key_queue_pop (active_pads[idx]);
         }
+    }
 
-        /* Save current report as previous */
-        grub_memcpy (data->prev_report, data->report, USB_REPORT_SIZE);
+    return GRUB_TERM_NO_KEY;
+}
+#endif
 
-        /* Start new background read */
-        data->transfer = grub_usb_bulk_read_background (
-            data->usbdev,
-            data->endp,
-            sizeof (data->report),
-            (char *) data->report);
+/*
+ * Make a slot's pad visible to GRUB, either through its own terminal
+ * or through the aggregate one
+ */
+static void
+slot_activate (unsigned curnum)
+{
+#if AGGREGATE_TERMINAL
+    active_pads[active_count++] = gamepads[curnum].data;
+    if (active_count == 1)
+        grub_term_register_input_active (SNES_TERM_NAME, &aggregate_term);
+#else
+    grub_term_register_input_active (SNES_TERM_NAME, &gamepads[curnum]);
+#endif
+}
 
-        if (!data->transfer)
-        {
-            grub_dprintf ("usb_snes", "Failed to restart USB transfer\n");
-            grub_print_error ();
-        }
+static void
+slot_deactivate (unsigned curnum)
+{
+#if AGGREGATE_TERMINAL
+    unsigned i;
+
+    for (i = 0; i < active_count; i++)
+    {
+        if (active_pads[i] != gamepads[curnum].data)
+            continue;
+
+        /* Keep the array packed by moving the last pad into the hole */
+        active_pads[i] = active_pads[--active_count];
+        active_pads[active_count] = NULL;
+        break;
     }
 
-    return key_queue_pop (data);
+    if (active_next >= active_count)
+        active_next = 0;
+    if (active_count == 0)
+        grub_term_unregister_input (&aggregate_term);
+#else
+    grub_term_unregister_input (&gamepads[curnum]);
+#endif
 }
 
 /*
@@ -310,7 +1876,7 @@ grub_usb_snes_detach (grub_usb_device_t usbdev,
 {
     unsigned i;
 
-    grub_dprintf ("usb_snes", "Device detaching...\n");
+    snes_dprintf ("Device detaching...\n");
 
     for (i = 0; i < ARRAY_SIZE (gamepads); i++)
     {
@@ -322,20 +1888,24 @@ grub_usb_snes_detach (grub_usb_device_t usbdev,
         if (data->usbdev != usbdev)
             continue;
 
-        /* Cancel pending transfer */
-        if (data->transfer)
-            grub_usb_cancel_transfer (data->transfer);
+        /* Cancel pending transfers */
+        ring_cancel (data);
 
         /* Unregister terminal */
-        grub_term_unregister_input (&gamepads[i]);
+        slot_deactivate (i);
+
+#if SNES_STATS
+        snes_dprintf ("Device %d detached (%u idle reports)\n",
+                      i, data->stats.unchanged);
+#else
+        snes_dprintf ("Device %d detached\n", i);
+#endif
 
         /* Free resources */
         grub_free ((char *) gamepads[i].name);
         gamepads[i].name = NULL;
         grub_free (data);
         gamepads[i].data = NULL;
-
-        grub_dprintf ("usb_snes", "Device %d detached\n", i);
     }
 }
 
@@ -349,17 +1919,20 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
     unsigned curnum;
     struct grub_usb_snes_data *data;
     struct grub_usb_desc_endp *endp = NULL;
-    const char *device_name;
+    const struct snes_device_id *device;
+    unsigned report_size, n_plans = 0, i;
+    struct decode_plan plans[PADS_PER_DEVICE];
+    grub_size_t words;
     int j;
 
-    grub_dprintf ("usb_snes", "Attach: VID=%04x PID=%04x config=%d interf=%d\n",
+    snes_dprintf ("Attach: VID=%04x PID=%04x config=%d interf=%d\n",
                   usbdev->descdev.vendorid, usbdev->descdev.prodid,
                   configno, interfno);
 
     /*
      * Check if this is a device we want to handle
      */
-    device_name = get_device_name (usbdev->descdev.vendorid, usbdev->descdev.prodid);
+    device = find_device (usbdev->descdev.vendorid, usbdev->descdev.prodid);
 
 #if ACCEPT_ANY_HID
     /*
@@ -369,16 +1942,16 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
      */
     if (usbdev->config[configno].interf[interfno].descif->protocol == 0x01)
     {
-        grub_dprintf ("usb_snes", "Skipping keyboard device (protocol=1)\n");
+        snes_dprintf ("Skipping keyboard device (protocol=1)\n");
         return 0;
     }
 
-    if (!device_name)
-        device_name = "Generic HID Gamepad";
+    if (!device)
+        device = &generic_device;
 #else
-    if (!device_name)
+    if (!device)
     {
-        grub_dprintf ("usb_snes", "Unknown device, skipping\n");
+        snes_dprintf ("Unknown device, skipping\n");
         return 0;
     }
 #endif
@@ -390,7 +1963,7 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
 
     if (curnum >= ARRAY_SIZE (gamepads))
     {
-        grub_dprintf ("usb_snes", "No free slots (max %d)\n", GAMEPADS_CAPACITY);
+        snes_dprintf ("No free slots (max %d)\n", GAMEPADS_CAPACITY);
         return 0;
     }
 
@@ -407,15 +1980,25 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
 
     if (j == usbdev->config[configno].interf[interfno].descif->endpointcnt)
     {
-        grub_dprintf ("usb_snes", "No interrupt IN endpoint found\n");
+        snes_dprintf ("No interrupt IN endpoint found\n");
         return 0;
     }
 
-    grub_dprintf ("usb_snes", "Found interrupt endpoint %d, addr=0x%02x\n",
-                  j, endp->endp_addr);
-
-    /* Allocate device data structure */
-    data = grub_malloc (sizeof (*data));
+    snes_dprintf ("Found interrupt endpoint %d, addr=0x%02x, maxpacket=%d, interval=%d\n",
+                  j, endp->endp_addr, endp->maxpacket, endp->interval);
+
+    /* Transfers are sized to the endpoint so long reports never overflow */
+    report_size = endp->maxpacket & 0x7ff;
+    if (report_size == 0)
+        report_size = USB_REPORT_SIZE;
+    if (report_size > REPORT_SIZE_MAX)
+        report_size = REPORT_SIZE_MAX;
+    words = report_words (report_size);
+
+    /* Allocate device data structure and its report buffers in one go */
+    data = grub_zalloc (sizeof (*data)
+                        + (1 + PADS_PER_DEVICE + REPORT_RING_SIZE) * words
+                          * sizeof (grub_uint64_t));
     if (!data)
     {
         grub_print_error ();
@@ -427,10 +2010,22 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
     data->configno = configno;
     data->interfno = interfno;
     data->endp = endp;
-    data->key_queue_begin = 0;
-    data->key_queue_size = 0;
-    grub_memcpy (data->prev_report, baseline_report, USB_REPORT_SIZE);
-    grub_memset (data->report, 0, USB_REPORT_SIZE);
+    data->report_size = report_size;
+    data->report = data->buffers;
+    for (j = 0; j < REPORT_RING_SIZE; j++)
+        data->ring[j] = data->buffers + (1 + PADS_PER_DEVICE + j) * words;
+    data->ring_head = 0;
+    data->ring_posted = 0;
+    data->ring_depth = REPORT_RING_DEPTH;
+    snes_key_queue_init (&data->key_queue);
+    snes_recovery_init (&data->recovery);
+    data->poll_interval = endp_poll_interval (usbdev, endp);
+    data->poll_idle_interval = SNES_IDLE_POLL_MS > data->poll_interval
+                               ? SNES_IDLE_POLL_MS : data->poll_interval;
+    data->poll_next = 0;
+    data->streaming = 0;
+    data->last_active = grub_get_time_ms ();
+    build_decode_tables ();
 
     /*
      * USB Device Initialization Sequence
@@ -438,7 +2033,7 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
      */
 
     /* Step 1: Set USB configuration */
-    grub_dprintf ("usb_snes", "Setting configuration %d\n", configno + 1);
+    snes_dprintf ("Setting configuration %d\n", configno + 1);
     grub_usb_set_configuration (usbdev, configno + 1);
 
     /*
@@ -447,38 +2042,64 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
      * Request: USB_HID_SET_PROTOCOL (0x0B)
      * Value: 0 = Boot Protocol, 1 = Report Protocol
      * Index: Interface number
-     * Some devices may not support this, but it shouldn't hurt to try
+     * Skipped for pads known to reject it
      */
-    grub_dprintf ("usb_snes", "Setting boot protocol on interface %d\n", interfno);
-    grub_usb_control_msg (usbdev,
-                          GRUB_USB_REQTYPE_CLASS_INTERFACE_OUT,
-                          USB_HID_SET_PROTOCOL,
-                          0,        /* Boot protocol */
-                          interfno,
-                          0,
-                          NULL);
+    if (!(device->quirks & QUIRK_NO_SET_PROTOCOL))
+    {
+        snes_dprintf ("Setting boot protocol on interface %d\n", interfno);
+        grub_usb_control_msg (usbdev,
+                              GRUB_USB_REQTYPE_CLASS_INTERFACE_OUT,
+                              USB_HID_SET_PROTOCOL,
+                              0,        /* Boot protocol */
+                              interfno,
+                              0,
+                              NULL);
+    }
 
     /*
-     * Step 3: Set idle rate to 0 (report only on changes)
+     * Step 3: Set idle rate (0 = report only on changes)
      * Request type: 0x21 = Host-to-device, Class, Interface
      * Request: USB_HID_SET_IDLE (0x0A)
      * Value: Duration (0 = indefinite) | Report ID (0)
      * Index: Interface number
      */
-    grub_dprintf ("usb_snes", "Setting idle rate\n");
-    grub_usb_control_msg (usbdev,
-                          GRUB_USB_REQTYPE_CLASS_INTERFACE_OUT,
-                          USB_HID_SET_IDLE,
-                          0 << 8,   /* Duration 0 = report on event only */
-                          interfno,
-                          0,
-                          NULL);
+    if (!(device->quirks & QUIRK_NO_SET_IDLE))
+    {
+        snes_dprintf ("Setting idle rate %d\n", device->idle_rate);
+        grub_usb_control_msg (usbdev,
+                              GRUB_USB_REQTYPE_CLASS_INTERFACE_OUT,
+                              USB_HID_SET_IDLE,
+                              device->idle_rate << 8,
+                              interfno,
+                              0,
+                              NULL);
+    }
+
+    /*
+     * Step 4: Compile a decode plan per player from the report
+     * descriptor, keeping the fixed layout if there is no usable one
+     */
+    if (device->layout == LAYOUT_DESCRIPTOR)
+        n_plans = plan_from_device (plans, PADS_PER_DEVICE, usbdev, configno, interfno);
+    if (n_plans == 0)
+    {
+        plans[0] = device->layout == LAYOUT_PLAN ? *device->plan : default_plan;
+        n_plans = 1;
+    }
+
+    data->report_len = report_size;
+    for (i = 0; i < n_plans; i++)
+        pad_setup (data, &plans[i], device->report_len, data->buffers + (1 + i) * words);
+    data->span_mask = span_to_mask (data->span);
+
+    /* Step 5: Read where the axes rest, before the pad is touched */
+    pad_read_rest (data, device);
 
     /* Clear any USB errors from optional commands */
     grub_errno = GRUB_ERR_NONE;
 
     /* Setup terminal input structure */
-    gamepads[curnum].name = grub_xasprintf ("snes_gamepad%d", curnum);
+    gamepads[curnum].name = grub_xasprintf (SNES_TERM_NAME "%d", curnum);
     if (!gamepads[curnum].name)
     {
         grub_free (data);
@@ -493,32 +2114,90 @@ grub_usb_snes_attach (grub_usb_device_t usbdev, int configno, int interfno)
     /* Set detach hook */
     usbdev->config[configno].interf[interfno].detach_hook = grub_usb_snes_detach;
 
-    /* Start background USB transfer */
-    grub_dprintf ("usb_snes", "Starting background read\n");
-    data->transfer = grub_usb_bulk_read_background (
-        usbdev,
-        data->endp,
-        sizeof (data->report),
-        (char *) data->report);
+    /* Start background USB transfers */
+    snes_dprintf ("Starting background reads\n");
+    ring_fill (data);
 
-    if (!data->transfer)
+    if (!data->ring_posted)
     {
-        grub_dprintf ("usb_snes", "Failed to start USB transfer\n");
+        snes_dprintf ("Failed to start USB transfer\n");
         grub_print_error ();
         grub_free ((char *) gamepads[curnum].name);
         gamepads[curnum].name = NULL;
         grub_free (data);
+        gamepads[curnum].data = NULL;
         return 0;
     }
 
     /* Register as active terminal input */
-    grub_term_register_input_active ("snes_gamepad", &gamepads[curnum]);
+    slot_activate (curnum);
 
-    grub_printf ("SNES Gamepad connected: %s (slot %d)\n", device_name, curnum);
+    grub_printf ("SNES Gamepad connected: %s (slot %d)\n", device->name, curnum);
 
     return 1;
 }
 
+#if SNES_STATS
+/*
+ * snes_stats command: dump the counters of every attached pad
+ */
+static grub_err_t
+grub_cmd_snes_stats (grub_command_t cmd __attribute__ ((unused)),
+                     int argc __attribute__ ((unused)),
+                     char **args __attribute__ ((unused)))
+{
+    unsigned i;
+    int found = 0;
+
+    for (i = 0; i < ARRAY_SIZE (gamepads); i++)
+    {
+        struct grub_usb_snes_data *data = gamepads[i].data;
+        const struct snes_stats *st;
+        const struct snes_key_queue *q;
+        const struct snes_recovery *rec;
+        int idle;
+
+        if (!data)
+            continue;
+
+        st = &data->stats;
+        q = &data->key_queue;
+        rec = &data->recovery;
+        idle = SNES_IDLE_AFTER_MS
+               && data->last_active + SNES_IDLE_AFTER_MS <= grub_get_time_ms ();
+        found = 1;
+        grub_printf ("%s (%04x:%04x, %u player%s):\n", gamepads[i].name,
+                     data->usbdev->descdev.vendorid,
+                     data->usbdev->descdev.prodid,
+                     data->n_pads, data->n_pads == 1 ? "" : "s");
+        grub_printf ("  reports %u, unchanged %u, short/errored %u, restart failures %u\n",
+                     st->reports, st->unchanged, st->bad_transfers,
+                     st->restart_failures);
+        grub_printf ("  polls %u, every %u ms, %u ms when idle%s\n",
+                     st->polls, data->poll_interval, idle_poll_interval (data),
+                     idle ? " (idle)" : "");
+        grub_printf ("  transfers in flight: up to %u of %d\n",
+                     data->ring_depth, REPORT_RING_DEPTH);
+        grub_printf ("  recovery: failures %u, halts cleared %u, resets %u, recovered %u%s\n",
+                     rec->failures, rec->clear_halts, rec->resets, rec->recoveries,
+                     rec->streak ? " (backing off)" : "");
+        grub_printf ("  keys queued %u, dropped %u, max queue depth %u/%d\n",
+                     q->queued, q->dropped, q->max_depth,
+                     SNES_KEY_QUEUE_CAPACITY);
+        grub_printf ("  key latency 0-1ms %u, 2-4ms %u, 5-16ms %u, 17-64ms %u, >64ms %u\n",
+                     st->latency[0], st->latency[1], st->latency[2],
+                     st->latency[3], st->latency[4]);
+    }
+
+    if (!found)
+        grub_printf ("No SNES gamepad attached\n");
+
+    return GRUB_ERR_NONE;
+}
+
+static grub_command_t cmd_stats;
+#endif
+
 /*
  * USB attach hook registration
  */
@@ -532,9 +2211,13 @@ static struct grub_usb_attach_desc attach_hook = {
  */
 GRUB_MOD_INIT (usb_snes_gamepad)
 {
-    grub_dprintf ("usb_snes", "SNES Gamepad module loading...\n");
+    snes_dprintf ("SNES Gamepad module loading...\n");
     grub_usb_register_attach_hook_class (&attach_hook);
-    grub_dprintf ("usb_snes", "SNES Gamepad module loaded\n");
+#if SNES_STATS
+    cmd_stats = grub_register_command ("snes_stats", grub_cmd_snes_stats, 0,
+                                       N_("Show SNES gamepad statistics."));
+#endif
+    snes_dprintf ("SNES Gamepad module loaded\n");
 }
 
 /*
@@ -544,7 +2227,7 @@ GRUB_MOD_FINI (usb_snes_gamepad)
 {
     unsigned i;
 
-    grub_dprintf ("usb_snes", "SNES Gamepad module unloading...\n");
+    snes_dprintf ("SNES Gamepad module unloading...\n");
 
     /* Cleanup all attached gamepads */
     for (i = 0; i < ARRAY_SIZE (gamepads); i++)
@@ -554,16 +2237,18 @@ GRUB_MOD_FINI (usb_snes_gamepad)
         if (!data)
             continue;
 
-        if (data->transfer)
-            grub_usb_cancel_transfer (data->transfer);
+        ring_cancel (data);
 
-        grub_term_unregister_input (&gamepads[i]);
+        slot_deactivate (i);
         grub_free ((char *) gamepads[i].name);
         gamepads[i].name = NULL;
         grub_free (data);
         gamepads[i].data = NULL;
     }
 
+#if SNES_STATS
+    grub_unregister_command (cmd_stats);
+#endif
     grub_usb_unregister_attach_hook_class (&attach_hook);
-    grub_dprintf ("usb_snes", "SNES Gamepad module unloaded\n");
+    snes_dprintf ("SNES Gamepad module unloaded\n");
 }
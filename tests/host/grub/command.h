@@ -0,0 +1,15 @@
+/* Host shim for <grub/command.h> */
+#ifndef SHIM_GRUB_COMMAND_H
+#define SHIM_GRUB_COMMAND_H 1
+
+#include <grub/err.h>
+
+struct grub_command;
+typedef struct grub_command *grub_command_t;
+typedef grub_err_t (*grub_command_func_t) (grub_command_t cmd, int argc, char **argv);
+
+grub_command_t grub_register_command (const char *name, grub_command_func_t func,
+                                      const char *summary, const char *description);
+void grub_unregister_command (grub_command_t cmd);
+
+#endif
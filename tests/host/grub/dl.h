@@ -0,0 +1,12 @@
+/* Host shim for <grub/dl.h>: module hooks become plain functions */
+#ifndef SHIM_GRUB_DL_H
+#define SHIM_GRUB_DL_H 1
+
+#define GRUB_MOD_LICENSE(license) \
+    static const char *grub_mod_license __attribute__ ((unused)) = license
+#define GRUB_MOD_INIT(name) \
+    void grub_mod_init_##name (void); void grub_mod_init_##name (void)
+#define GRUB_MOD_FINI(name) \
+    void grub_mod_fini_##name (void); void grub_mod_fini_##name (void)
+
+#endif
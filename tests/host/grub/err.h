@@ -0,0 +1,17 @@
+/* Host shim for <grub/err.h> */
+#ifndef SHIM_GRUB_ERR_H
+#define SHIM_GRUB_ERR_H 1
+
+typedef enum
+{
+    GRUB_ERR_NONE = 0,
+    GRUB_ERR_OUT_OF_MEMORY,
+    GRUB_ERR_BAD_ARGUMENT,
+    GRUB_ERR_IO
+} grub_err_t;
+
+extern grub_err_t grub_errno;
+
+void grub_print_error (void);
+
+#endif
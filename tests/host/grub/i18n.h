@@ -0,0 +1,8 @@
+/* Host shim for <grub/i18n.h> */
+#ifndef SHIM_GRUB_I18N_H
+#define SHIM_GRUB_I18N_H 1
+
+#define N_(s)   s
+#define _(s)    s
+
+#endif
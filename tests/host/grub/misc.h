@@ -0,0 +1,25 @@
+/* Host shim for <grub/misc.h> */
+#ifndef SHIM_GRUB_MISC_H
+#define SHIM_GRUB_MISC_H 1
+
+#include <grub/types.h>
+#include <grub/err.h>
+#include <grub/mm.h>
+
+void *grub_memcpy (void *dest, const void *src, grub_size_t n);
+void *grub_memset (void *s, int c, grub_size_t n);
+int grub_memcmp (const void *s1, const void *s2, grub_size_t n);
+int grub_strncmp (const char *s1, const char *s2, grub_size_t n);
+grub_size_t grub_strlen (const char *s);
+char *grub_strchr (const char *s, int c);
+char *grub_strndup (const char *s, grub_size_t n);
+
+int grub_printf (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+char *grub_xasprintf (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+#define grub_dprintf(condition, ...) \
+    grub_real_dprintf (__FILE__, __LINE__, condition, __VA_ARGS__)
+void grub_real_dprintf (const char *file, const int line, const char *condition,
+                        const char *fmt, ...) __attribute__ ((format (printf, 4, 5)));
+
+#endif
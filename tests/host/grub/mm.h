@@ -0,0 +1,11 @@
+/* Host shim for <grub/mm.h> */
+#ifndef SHIM_GRUB_MM_H
+#define SHIM_GRUB_MM_H 1
+
+#include <grub/types.h>
+
+void *grub_malloc (grub_size_t size);
+void *grub_zalloc (grub_size_t size);
+void grub_free (void *ptr);
+
+#endif
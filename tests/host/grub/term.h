@@ -0,0 +1,37 @@
+/* Host shim for <grub/term.h>: key codes as in GRUB */
+#ifndef SHIM_GRUB_TERM_H
+#define SHIM_GRUB_TERM_H 1
+
+#include <grub/types.h>
+#include <grub/err.h>
+
+#define GRUB_TERM_NO_KEY        0
+#define GRUB_TERM_EXTENDED      0x00800000
+#define GRUB_TERM_KEY_LEFT      (GRUB_TERM_EXTENDED | 0x4b)
+#define GRUB_TERM_KEY_RIGHT     (GRUB_TERM_EXTENDED | 0x4d)
+#define GRUB_TERM_KEY_UP        (GRUB_TERM_EXTENDED | 0x48)
+#define GRUB_TERM_KEY_DOWN      (GRUB_TERM_EXTENDED | 0x50)
+#define GRUB_TERM_KEY_HOME      (GRUB_TERM_EXTENDED | 0x47)
+#define GRUB_TERM_KEY_END       (GRUB_TERM_EXTENDED | 0x4f)
+#define GRUB_TERM_KEY_PPAGE     (GRUB_TERM_EXTENDED | 0x49)
+#define GRUB_TERM_KEY_NPAGE     (GRUB_TERM_EXTENDED | 0x51)
+#define GRUB_TERM_ESC           '\e'
+#define GRUB_TERM_TAB           '\t'
+#define GRUB_TERM_BACKSPACE     '\b'
+
+struct grub_term_input
+{
+    struct grub_term_input *next;
+    struct grub_term_input **prev;
+    const char *name;
+    grub_err_t (*init) (struct grub_term_input *term);
+    grub_err_t (*fini) (struct grub_term_input *term);
+    int (*getkey) (struct grub_term_input *term);
+    int (*getkeystatus) (struct grub_term_input *term);
+    void *data;
+};
+
+void grub_term_register_input_active (const char *name, struct grub_term_input *term);
+void grub_term_unregister_input (struct grub_term_input *term);
+
+#endif
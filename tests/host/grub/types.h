@@ -0,0 +1,28 @@
+/* Host shim for <grub/types.h>: just what the SNES module uses */
+#ifndef SHIM_GRUB_TYPES_H
+#define SHIM_GRUB_TYPES_H 1
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef uint8_t grub_uint8_t;
+typedef uint16_t grub_uint16_t;
+typedef uint32_t grub_uint32_t;
+typedef uint64_t grub_uint64_t;
+typedef int8_t grub_int8_t;
+typedef int16_t grub_int16_t;
+typedef int32_t grub_int32_t;
+typedef int64_t grub_int64_t;
+typedef size_t grub_size_t;
+typedef long grub_ssize_t;
+
+#define ARRAY_SIZE(a)           (sizeof (a) / sizeof ((a)[0]))
+#define GRUB_PACKED             __attribute__ ((packed))
+
+/* The harness only runs on little-endian hosts, like the module's targets */
+#define grub_le_to_cpu16(x)     ((grub_uint16_t) (x))
+#define grub_le_to_cpu32(x)     ((grub_uint32_t) (x))
+#define grub_le_to_cpu64(x)     ((grub_uint64_t) (x))
+#define grub_cpu_to_le64(x)     ((grub_uint64_t) (x))
+
+#endif
@@ -0,0 +1,164 @@
+/*
+ * Host shim for <grub/usb.h>
+ *
+ * Descriptor layouts and error codes as in GRUB. A transfer is whatever
+ * tests/host/shim.c makes of it: reports queued by the harness complete
+ * the oldest posted transfer first.
+ */
+#ifndef SHIM_GRUB_USB_H
+#define SHIM_GRUB_USB_H 1
+
+#include <grub/types.h>
+#include <grub/err.h>
+
+typedef enum
+{
+    GRUB_USB_ERR_NONE,
+    GRUB_USB_ERR_WAIT,
+    GRUB_USB_ERR_INTERNAL,
+    GRUB_USB_ERR_STALL,
+    GRUB_USB_ERR_DATA,
+    GRUB_USB_ERR_NAK,
+    GRUB_USB_ERR_BABBLE,
+    GRUB_USB_ERR_TIMEOUT,
+    GRUB_USB_ERR_BITSTUFF,
+    GRUB_USB_ERR_UNRECOVERABLE,
+    GRUB_USB_ERR_BADDEVICE
+} grub_usb_err_t;
+
+typedef enum
+{
+    GRUB_USB_CLASS_NOTHERE,
+    GRUB_USB_CLASS_AUDIO,
+    GRUB_USB_CLASS_COMMUNICATION,
+    GRUB_USB_CLASS_HID
+} grub_usb_classes_t;
+
+typedef enum
+{
+    GRUB_USB_EP_CONTROL,
+    GRUB_USB_EP_ISOCHRONOUS,
+    GRUB_USB_EP_BULK,
+    GRUB_USB_EP_INTERRUPT
+} grub_usb_ep_type_t;
+
+typedef enum
+{
+    GRUB_USB_SPEED_NONE,
+    GRUB_USB_SPEED_LOW,
+    GRUB_USB_SPEED_FULL,
+    GRUB_USB_SPEED_HIGH
+} grub_usb_speed_t;
+
+typedef enum
+{
+    GRUB_USB_REQTYPE_TARGET_DEV = (0 << 0),
+    GRUB_USB_REQTYPE_TARGET_INTERF = (1 << 0),
+    GRUB_USB_REQTYPE_TARGET_ENDP = (2 << 0),
+    GRUB_USB_REQTYPE_STANDARD = (0 << 5),
+    GRUB_USB_REQTYPE_CLASS = (1 << 5),
+    GRUB_USB_REQTYPE_OUT = (0 << 7),
+    GRUB_USB_REQTYPE_IN = (1 << 7),
+    GRUB_USB_REQTYPE_CLASS_INTERFACE_OUT = (1 << 0) | (1 << 5),
+    GRUB_USB_REQTYPE_CLASS_INTERFACE_IN = (1 << 0) | (1 << 5) | (1 << 7)
+} grub_usb_reqtype_t;
+
+struct grub_usb_desc_device
+{
+    grub_uint8_t length;
+    grub_uint8_t type;
+    grub_uint16_t usbrel;
+    grub_uint8_t class;
+    grub_uint8_t subclass;
+    grub_uint8_t protocol;
+    grub_uint8_t maxsize0;
+    grub_uint16_t vendorid;
+    grub_uint16_t prodid;
+    grub_uint16_t devrel;
+    grub_uint8_t strvendor;
+    grub_uint8_t strprod;
+    grub_uint8_t strserial;
+    grub_uint8_t configcnt;
+} GRUB_PACKED;
+
+struct grub_usb_desc_if
+{
+    grub_uint8_t length;
+    grub_uint8_t type;
+    grub_uint8_t ifnum;
+    grub_uint8_t altsetting;
+    grub_uint8_t endpointcnt;
+    grub_uint8_t class;
+    grub_uint8_t subclass;
+    grub_uint8_t protocol;
+    grub_uint8_t ifstr;
+} GRUB_PACKED;
+
+struct grub_usb_desc_endp
+{
+    grub_uint8_t length;
+    grub_uint8_t type;
+    grub_uint8_t endp_addr;
+    grub_uint8_t attrib;
+    grub_uint16_t maxpacket;
+    grub_uint8_t interval;
+} GRUB_PACKED;
+
+struct grub_usb_device;
+typedef struct grub_usb_device *grub_usb_device_t;
+
+struct grub_usb_interface
+{
+    struct grub_usb_desc_if *descif;
+    struct grub_usb_desc_endp *descendp;
+    int attached;
+    void (*detach_hook) (struct grub_usb_device *dev, int config, int interface);
+    void *detach_data;
+};
+
+struct grub_usb_configuration
+{
+    void *descconf;
+    struct grub_usb_interface interf[32];
+};
+
+struct grub_usb_device
+{
+    struct grub_usb_desc_device descdev;
+    struct grub_usb_configuration config[8];
+    grub_usb_speed_t speed;
+};
+
+struct grub_usb_transfer;
+typedef struct grub_usb_transfer *grub_usb_transfer_t;
+
+struct grub_usb_attach_desc
+{
+    struct grub_usb_attach_desc *next;
+    struct grub_usb_attach_desc **prev;
+    int class;
+    int (*hook) (grub_usb_device_t usbdev, int configno, int interfno);
+};
+
+void grub_usb_register_attach_hook_class (struct grub_usb_attach_desc *desc);
+void grub_usb_unregister_attach_hook_class (struct grub_usb_attach_desc *desc);
+
+grub_usb_err_t grub_usb_set_configuration (grub_usb_device_t dev, int configuration);
+grub_usb_err_t grub_usb_clear_halt (grub_usb_device_t dev, int endpoint);
+grub_usb_err_t grub_usb_control_msg (grub_usb_device_t dev, grub_uint8_t reqtype,
+                                     grub_uint8_t request, grub_uint16_t value,
+                                     grub_uint16_t index, grub_size_t size, char *data);
+
+grub_usb_transfer_t grub_usb_bulk_read_background (grub_usb_device_t dev,
+                                                   struct grub_usb_desc_endp *endpoint,
+                                                   grub_size_t size, void *data);
+grub_usb_err_t grub_usb_check_transfer (grub_usb_transfer_t trans, grub_size_t *actual);
+void grub_usb_cancel_transfer (grub_usb_transfer_t trans);
+
+static inline grub_usb_ep_type_t
+grub_usb_get_ep_type (struct grub_usb_desc_endp *ep)
+{
+    return (grub_usb_ep_type_t) (ep->attrib & 3);
+}
+
+#endif
@@ -0,0 +1,1611 @@
+/*
+ * Host test and benchmark harness for the SNES gamepad module
+ *
+ * Builds usb_snes_gamepad.c against the GRUB shim in this directory and
+ * drives it through the same attach, poll and getkey paths GRUB uses.
+ * The keys it hands out are checked against a reference decoder written
+ * from the report layouts, not from the module's tables. With --bench
+ * the decoder and the whole poll path are timed as well.
+ *
+ *   harness [-v] [--bench] [--reports N] [--seed N] [--replay] [--keys]
+ *           [--poll-ms N] [stream.hex | trace.trace ...]
+ *
+ * A .hex stream holds one report per line in hex, spaces allowed; '#'
+ * starts a comment and "# pad: descriptor" plays it on the descriptor
+ * pad instead of the fixed SNES layout one.
+ *
+ * A .trace is a binary capture (tools/hid-trace.py, format in
+ * docs/hid-reports.md). It is replayed with its own timing, polling every
+ * --poll-ms, so the key queue and auto-repeat run as they did on the pad.
+ * The keys come out as a log (--keys prints it) that must match the
+ * .keys file next to the trace, when there is one and --poll-ms is left
+ * at its default. --replay plays the files named and nothing else.
+ *
+ * License: GPLv3+
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined (__x86_64__) || defined (__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "shim.h"
+#include "usb_snes_gamepad.c"
+
+#define MAX_KEYS_PER_REPORT     STATE_CONTROLS
+#define RANDOM_REPORTS          20000
+#define BENCH_REPORTS           1000000
+#define BENCH_SET               4096
+#define REPLAY_POLL_MS          1       /* Default --poll-ms, the one .keys logs hold */
+#define REPLAY_START_MS         1000    /* Clock at attach; 0 reads as "never" */
+#define REPLAY_TAIL_MS          1000    /* Polling after the last record */
+#define REPLAY_MAX_LATENCY      256     /* Histogram of whole milliseconds */
+#define REPLAY_ARRIVALS         64      /* Polls remembered for latency */
+
+static int failures;
+static int print_keys_log;
+static unsigned poll_ms = REPLAY_POLL_MS;
+
+#define CHECK(cond, ...)                                \
+    do {                                                \
+        if (!(cond))                                    \
+        {                                               \
+            printf ("FAIL %s:%d: ", __FILE__, __LINE__);\
+            printf (__VA_ARGS__);                       \
+            printf ("\n");                              \
+            failures++;                                 \
+        }                                               \
+    } while (0)
+
+/*
+ * Pads under test and the reference decoder
+ */
+struct ref_pad
+{
+    const char *name;
+    struct shim_pad shim;
+    unsigned report_len;
+    unsigned x_byte, y_byte;
+    int hat_bit;                        /* -1: no hat */
+    unsigned buttons_bit;               /* Button 1, then up */
+    grub_uint8_t neutral[SHIM_REPORT_MAX];
+};
+
+/* Gamepad: X, Y, hat with null state, 12 buttons */
+static const grub_uint8_t hat_pad_desc[] = {
+    0x05, 0x01, 0x09, 0x05, 0xa1, 0x01,
+    0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95, 0x02,
+    0x09, 0x30, 0x09, 0x31, 0x81, 0x02,
+    0x15, 0x00, 0x25, 0x07, 0x75, 0x04, 0x95, 0x01, 0x09, 0x39, 0x81, 0x42,
+    0x75, 0x04, 0x95, 0x01, 0x81, 0x03,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x0c, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x0c, 0x81, 0x02,
+    0x75, 0x04, 0x95, 0x01, 0x81, 0x03,
+    0xc0
+};
+
+/* One player of a multi-pack: X, Y, 8 buttons, behind report ID id */
+#define PACK_PAD_DESC(id)                                               \
+    0x05, 0x01, 0x09, 0x05, 0xa1, 0x01, 0x85, (id),                     \
+    0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95, 0x02,               \
+    0x09, 0x30, 0x09, 0x31, 0x81, 0x02,                                 \
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x08, 0x15, 0x00, 0x25, 0x01,         \
+    0x75, 0x01, 0x95, 0x08, 0x81, 0x02,                                 \
+    0xc0
+
+static const grub_uint8_t two_pack_desc[] = { PACK_PAD_DESC (1), PACK_PAD_DESC (2) };
+static const grub_uint8_t five_pack_desc[] = {
+    PACK_PAD_DESC (1), PACK_PAD_DESC (2), PACK_PAD_DESC (3), PACK_PAD_DESC (4),
+    PACK_PAD_DESC (5)
+};
+
+static const struct ref_pad snes_pad = {
+    .name = "snes",
+    .shim = { .vid = 0x0810, .pid = 0xe501, .maxpacket = 8 },
+    .report_len = 8,
+    .x_byte = 0, .y_byte = 1, .hat_bit = -1, .buttons_bit = 32,
+    .neutral = { 0x7f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 }
+};
+
+static const struct ref_pad descriptor_pad = {
+    .name = "descriptor",
+    .shim = { .vid = 0x2dc8, .pid = 0x9018, .maxpacket = 8,
+              .report_desc = hat_pad_desc, .report_desc_len = sizeof (hat_pad_desc) },
+    .report_len = 5,
+    .x_byte = 0, .y_byte = 1, .hat_bit = 16, .buttons_bit = 24,
+    .neutral = { 0x80, 0x80, 0x0f, 0x00, 0x00 }
+};
+
+/* Default key map, by control: directions, X A B Y, L R, Select Start */
+#if SNES_KEYMAP == SNES_KEYMAP_CLASSIC
+#define REF_KEY_X       'e'
+#define REF_KEY_B       '\r'
+#define REF_KEY_Y       'c'
+#define REF_KEY_SELECT  GRUB_TERM_ESC
+#else
+#define REF_KEY_X       'c'
+#define REF_KEY_B       GRUB_TERM_ESC
+#define REF_KEY_Y       GRUB_TERM_ESC
+#define REF_KEY_SELECT  'e'
+#endif
+
+static const int ref_keys[STATE_CONTROLS] = {
+    GRUB_TERM_KEY_UP, GRUB_TERM_KEY_DOWN, GRUB_TERM_KEY_LEFT, GRUB_TERM_KEY_RIGHT,
+    REF_KEY_X, '\r', REF_KEY_B, REF_KEY_Y,
+    GRUB_TERM_KEY_PPAGE, GRUB_TERM_KEY_NPAGE, REF_KEY_SELECT, '\r',
+    GRUB_TERM_NO_KEY, GRUB_TERM_NO_KEY, GRUB_TERM_NO_KEY, GRUB_TERM_NO_KEY
+};
+
+/* Simultaneous presses come out directions, A B X Y, Start Select, L R */
+static const unsigned ref_order[STATE_CONTROLS] = {
+    0, 1, 2, 3, 5, 6, 4, 7, 11, 10, 8, 9, 12, 13, 14, 15
+};
+
+static unsigned
+ref_bits (const grub_uint8_t *report, unsigned bit, unsigned width)
+{
+    unsigned v = 0, i;
+
+    for (i = 0; i < width; i++)
+        v |= ((report[(bit + i) / 8] >> ((bit + i) % 8)) & 1) << i;
+    return v;
+}
+
+/*
+ * Axes as the module documents them: each rests at the rounded mean of
+ * its values within 0x20 of 0x7f over the first four reports (0x7f if
+ * none), a direction is pressed more than 0x40 from rest and released
+ * again within 0x20
+ */
+struct ref_axes
+{
+    unsigned reports;
+    unsigned sum[2], count[2];
+    int rest[2];                        /* Y, X */
+    unsigned dir[2];                    /* 0, 1 low or 2 high */
+};
+
+static void
+ref_axes_init (struct ref_axes *a)
+{
+    memset (a, 0, sizeof (*a));
+    a->rest[0] = a->rest[1] = 0x7f;
+}
+
+static unsigned
+ref_axis (struct ref_axes *a, unsigned axis, unsigned v)
+{
+    int d = (int) v - a->rest[axis];
+    unsigned dir = a->dir[axis];
+
+    if (!(dir == 1 && d < -0x20) && !(dir == 2 && d > 0x20))
+        dir = d < -0x40 ? 1 : d > 0x40 ? 2 : 0;
+    a->dir[axis] = dir;
+    return dir;
+}
+
+static unsigned
+ref_state (const struct ref_pad *pad, struct ref_axes *a, const grub_uint8_t *report)
+{
+    static const unsigned hat[8] = { 0x1, 0x9, 0x8, 0xa, 0x2, 0x6, 0x4, 0x5 };
+    unsigned v[2] = { report[pad->y_byte], report[pad->x_byte] };
+    unsigned state = 0, i;
+
+    if (a->reports < 4)
+    {
+        for (i = 0; i < 2; i++)
+            if (v[i] >= 0x7f - 0x20 && v[i] <= 0x7f + 0x20)
+            {
+                a->sum[i] += v[i];
+                a->count[i]++;
+            }
+        if (++a->reports == 4)
+            for (i = 0; i < 2; i++)
+                if (a->count[i])
+                    a->rest[i] = (a->sum[i] + a->count[i] / 2) / a->count[i];
+    }
+
+    state |= ref_axis (a, 0, v[0]);
+    state |= ref_axis (a, 1, v[1]) << 2;
+    if (pad->hat_bit >= 0 && ref_bits (report, pad->hat_bit, 4) < 8)
+        state |= hat[ref_bits (report, pad->hat_bit, 4)];
+
+    return state | (ref_bits (report, pad->buttons_bit, 12) << 4);
+}
+
+static unsigned
+ref_press_keys (unsigned prev, unsigned state, int *keys)
+{
+    unsigned pressed = state & ~prev;
+    unsigned i, n = 0;
+
+    for (i = 0; i < STATE_CONTROLS; i++)
+        if ((pressed & (1 << ref_order[i])) && ref_keys[ref_order[i]] != GRUB_TERM_NO_KEY)
+            keys[n++] = ref_keys[ref_order[i]];
+    return n;
+}
+
+/*
+ * Driving the module. The tests step the clock themselves, so the poll
+ * governor is switched off and every getkey checks the transfers;
+ * test_governor and the trace replays cover it.
+ */
+static grub_usb_device_t
+pad_attach_governed (const struct ref_pad *pad)
+{
+    grub_usb_device_t dev = shim_pad_create (&pad->shim);
+
+    shim_terminal = NULL;
+    if (!grub_usb_snes_attach (dev, 0, 0) || !shim_terminal)
+    {
+        printf ("FAIL: %s pad did not attach\n", pad->name);
+        failures++;
+        shim_pad_destroy (dev);
+        return NULL;
+    }
+    return dev;
+}
+
+static grub_usb_device_t
+pad_attach (const struct ref_pad *pad)
+{
+    grub_usb_device_t dev = pad_attach_governed (pad);
+
+    if (dev)
+    {
+        struct grub_usb_snes_data *data = shim_terminal->data;
+
+        data->poll_interval = 0;
+        data->poll_idle_interval = 0;
+    }
+    return dev;
+}
+
+/* Every key the module hands out until it runs dry */
+static unsigned
+drain_keys (int *keys, unsigned max)
+{
+    unsigned n = 0;
+    int key;
+
+    while ((key = shim_terminal->getkey (shim_terminal)) != GRUB_TERM_NO_KEY)
+        if (n < max)
+            keys[n++] = key;
+        else
+            n++;
+    return n;
+}
+
+static void
+print_report (const grub_uint8_t *report, unsigned len)
+{
+    unsigned i;
+
+    for (i = 0; i < len; i++)
+        printf ("%02x", report[i]);
+}
+
+static void
+print_keys (const char *what, const int *keys, unsigned n)
+{
+    unsigned i;
+
+    printf ("  %s:", what);
+    for (i = 0; i < n; i++)
+        printf (" %x", keys[i]);
+    printf ("\n");
+}
+
+/*
+ * Play reports (stride SHIM_REPORT_MAX) through the pad, one at a time,
+ * comparing the keys after each with the reference. The clock stands
+ * still, so auto-repeat and queue expiry stay out of the picture.
+ */
+static int
+play_stream (const struct ref_pad *pad, const grub_uint8_t *reports, unsigned n,
+             const char *what)
+{
+    grub_usb_device_t dev = pad_attach (pad);
+    unsigned prev = 0, i, total = 0;
+    struct ref_axes axes;
+    int ok = 1;
+
+    if (!dev)
+        return 0;
+    ref_axes_init (&axes);
+
+    for (i = 0; i < n && ok; i++)
+    {
+        const grub_uint8_t *report = reports + i * SHIM_REPORT_MAX;
+        int want[MAX_KEYS_PER_REPORT], got[MAX_KEYS_PER_REPORT];
+        unsigned state = ref_state (pad, &axes, report);
+        unsigned n_want = ref_press_keys (prev, state, want);
+        unsigned n_got;
+
+        shim_queue_report (report, pad->report_len);
+        n_got = drain_keys (got, MAX_KEYS_PER_REPORT);
+        prev = state;
+        total += n_got;
+
+        if (n_got != n_want || memcmp (got, want, n_want * sizeof (int)) != 0)
+        {
+            printf ("FAIL %s: report %u ", what, i);
+            print_report (report, pad->report_len);
+            printf ("\n");
+            print_keys ("expected", want, n_want);
+            print_keys ("got", got, n_got > MAX_KEYS_PER_REPORT ? MAX_KEYS_PER_REPORT : n_got);
+            failures++;
+            ok = 0;
+        }
+    }
+
+    shim_pad_destroy (dev);
+    if (ok)
+        printf ("PASS %s: %u reports, %u keys\n", what, n, total);
+    return ok;
+}
+
+static grub_uint64_t rng_state;
+
+static grub_uint64_t
+rng (void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* A pad being played with: a few controls change per report, or none */
+static void
+random_reports (const struct ref_pad *pad, grub_uint8_t *reports, unsigned n)
+{
+    static const grub_uint8_t axis_values[] = { 0x00, 0x7f, 0x80, 0xff };
+    grub_uint8_t cur[SHIM_REPORT_MAX];
+    unsigned i;
+
+    memcpy (cur, pad->neutral, sizeof (cur));
+    for (i = 0; i < n; i++)
+    {
+        grub_uint64_t r = rng ();
+
+        if (i > 0 && (r & 7) != 0)
+        {
+            grub_uint64_t b = rng ();
+            unsigned k, chord = (r & (1 << 8)) ? 1 + (b & 3) : 0;
+
+            /* Up to four buttons at once, so press order gets exercised */
+            for (k = 0; k < chord; k++)
+            {
+                unsigned bit = pad->buttons_bit + ((b >> (2 + 4 * k)) & 0xf) % 12;
+
+                cur[bit / 8] ^= 1 << (bit % 8);
+            }
+            if ((r & (3 << 9)) == 0)
+                cur[pad->x_byte] = (r & (1 << 11)) ? axis_values[(r >> 12) & 3] : r >> 16;
+            if ((r & (3 << 24)) == 0)
+                cur[pad->y_byte] = (r & (1 << 26)) ? axis_values[(r >> 27) & 3] : r >> 32;
+            if (pad->hat_bit >= 0 && (r & (3 << 29)) == 0)
+            {
+                unsigned byte = pad->hat_bit / 8, shift = pad->hat_bit % 8;
+
+                cur[byte] = (cur[byte] & ~(0xf << shift)) | (((r >> 40) & 0xf) << shift);
+            }
+            /* Bytes no plan reads, moving on their own */
+            if (pad->report_len > 6 && (r & (1ULL << 44)))
+                cur[6] = r >> 48;
+        }
+        memcpy (reports + i * SHIM_REPORT_MAX, cur, SHIM_REPORT_MAX);
+    }
+}
+
+/*
+ * Tests
+ */
+static void
+test_fixed_reports (void)
+{
+    static const grub_uint8_t reports[][8] = {
+        { 0x7f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 },     /* Neutral */
+        { 0x7f, 0x00, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 },     /* Up */
+        { 0x7f, 0x00, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 },     /* Up, still */
+        { 0x7f, 0x7f, 0x7f, 0x7f, 0x06, 0x00, 0x00, 0x00 },     /* A + B */
+        { 0x7f, 0x7f, 0x7f, 0x7f, 0x04, 0x00, 0x00, 0x00 },     /* B held */
+        { 0xff, 0x7f, 0x7f, 0x7f, 0xc0, 0x00, 0x00, 0x00 },     /* Right, Select + Start */
+    };
+    static const int want[][3] = {
+        { 0 }, { GRUB_TERM_KEY_UP }, { 0 }, { '\r', REF_KEY_B }, { 0 },
+        { GRUB_TERM_KEY_RIGHT, '\r', REF_KEY_SELECT },
+    };
+    grub_usb_device_t dev = pad_attach (&snes_pad);
+    unsigned i;
+
+    if (!dev)
+        return;
+    CHECK (strncmp (shim_terminal->name, SNES_TERM_NAME, strlen (SNES_TERM_NAME)) == 0,
+           "terminal name %s, not " SNES_TERM_NAME, shim_terminal->name);
+    for (i = 0; i < ARRAY_SIZE (reports); i++)
+    {
+        int got[MAX_KEYS_PER_REPORT] = { 0 };
+        unsigned n;
+
+        shim_queue_report (reports[i], sizeof (reports[i]));
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        CHECK (n <= 3 && memcmp (got, want[i], sizeof (want[i])) == 0,
+               "fixed report %u: %u keys, first %x", i, n, got[0]);
+    }
+    shim_pad_destroy (dev);
+    printf ("PASS fixed SNES reports\n");
+}
+
+static void
+test_descriptor_plan (void)
+{
+    grub_usb_device_t dev = pad_attach (&descriptor_pad);
+    struct grub_usb_snes_data *data;
+
+    if (!dev)
+        return;
+    data = shim_terminal->data;
+    CHECK (data->n_pads == 1 && data->pads[0].plan.n_ops == 4,
+           "descriptor plan: %u pads, %u ops", data->n_pads, data->pads[0].plan.n_ops);
+    CHECK (data->pads[0].report_len == descriptor_pad.report_len,
+           "descriptor plan: report_len %u", data->pads[0].report_len);
+    shim_pad_destroy (dev);
+    printf ("PASS descriptor plan\n");
+}
+
+/*
+ * A 2-pack behind one endpoint: a plan per report ID, and each report
+ * goes to the player its ID names. An ID no plan claims is ignored, and
+ * plans stop at PADS_PER_DEVICE.
+ */
+static void
+test_multi_pad (void)
+{
+    static const struct
+    {
+        grub_uint8_t report[4];
+        int keys[2];
+        unsigned state[2];
+    } steps[] = {
+        { { 1, 0x7f, 0x00, 0x00 }, { GRUB_TERM_KEY_UP }, { STATE_UP, 0 } },
+        { { 2, 0xff, 0x7f, 0x02 }, { GRUB_TERM_KEY_RIGHT, '\r' },
+          { STATE_UP, STATE_RIGHT | 1 << (STATE_BUTTONS_SHIFT + 1) } },
+        { { 1, 0x7f, 0x7f, 0x00 }, { 0 }, { 0, STATE_RIGHT | 1 << (STATE_BUTTONS_SHIFT + 1) } },
+        { { 3, 0x00, 0x00, 0xff }, { 0 }, { 0, STATE_RIGHT | 1 << (STATE_BUTTONS_SHIFT + 1) } },
+        { { 2, 0x7f, 0x7f, 0x00 }, { 0 }, { 0, 0 } },
+        { { 2, 0x00, 0x7f, 0x00 }, { GRUB_TERM_KEY_LEFT }, { 0, STATE_LEFT } },
+    };
+    static const grub_uint8_t fifth[4] = { 5, 0x7f, 0x00, 0x00 };
+    struct ref_pad pad = {
+        .name = "2-pack",
+        .shim = { .vid = 0x12bd, .pid = 0xd015, .maxpacket = 8,
+                  .report_desc = two_pack_desc, .report_desc_len = sizeof (two_pack_desc) },
+    };
+    struct decode_plan plans[PADS_PER_DEVICE];
+    struct grub_usb_snes_data *data;
+    grub_usb_device_t dev = pad_attach (&pad);
+    unsigned i, n;
+
+    if (!dev)
+        return;
+    data = shim_terminal->data;
+    CHECK (data->n_pads == 2 && data->pads[0].plan.report_id == 1
+           && data->pads[1].plan.report_id == 2,
+           "multi-pad: %u pads, report IDs %u %u", data->n_pads,
+           data->pads[0].plan.report_id, data->pads[1].plan.report_id);
+    for (i = 0; i < ARRAY_SIZE (steps); i++)
+    {
+        int got[MAX_KEYS_PER_REPORT] = { 0 };
+
+        shim_queue_report (steps[i].report, sizeof (steps[i].report));
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        CHECK (memcmp (got, steps[i].keys, sizeof (steps[i].keys)) == 0
+               && got[ARRAY_SIZE (steps[i].keys)] == 0,
+               "multi-pad step %u: %u keys, first %x", i, n, got[0]);
+        CHECK (data->pads[0].state == steps[i].state[0]
+               && data->pads[1].state == steps[i].state[1],
+               "multi-pad step %u: states %x %x", i,
+               data->pads[0].state, data->pads[1].state);
+    }
+    shim_pad_destroy (dev);
+
+    /* Players past PADS_PER_DEVICE get no plan, and their reports go nowhere */
+    n = plan_compile (plans, PADS_PER_DEVICE, five_pack_desc, sizeof (five_pack_desc));
+    CHECK (n == PADS_PER_DEVICE && plans[PADS_PER_DEVICE - 1].report_id == PADS_PER_DEVICE,
+           "multi-pad: %u plans from five players", n);
+    pad.shim.report_desc = five_pack_desc;
+    pad.shim.report_desc_len = sizeof (five_pack_desc);
+    dev = pad_attach (&pad);
+    if (!dev)
+        return;
+    data = shim_terminal->data;
+    shim_queue_report (fifth, sizeof (fifth));
+    {
+        int got[MAX_KEYS_PER_REPORT] = { 0 };
+
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        CHECK (data->n_pads == PADS_PER_DEVICE && n == 0,
+               "multi-pad: %u pads, %u keys from the fifth player", data->n_pads, n);
+    }
+    shim_pad_destroy (dev);
+    printf ("PASS multi-pad report IDs\n");
+}
+
+/*
+ * Rest read with GET_REPORT at attach: the first live report is already
+ * judged against it. A pad that stalls the request, or holds a
+ * direction, still calibrates from its first reports.
+ */
+static void
+test_rest_report (void)
+{
+    static const grub_uint8_t rest[8] = { 0x9f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t held[8] = { 0xff, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t left[8] = { 0x5c, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    static const struct snes_device_id plain = { "plain", 0, 0, 0, LAYOUT_SNES, NULL };
+    static const struct snes_device_id quirky =
+        { "quirky", QUIRK_NO_GET_REPORT, 0, 0, LAYOUT_SNES, NULL };
+    struct ref_pad pad = snes_pad;
+    struct grub_usb_snes_data *data;
+    struct decode_plan plan;
+    grub_usb_device_t dev;
+    int got[MAX_KEYS_PER_REPORT] = { 0 };
+    unsigned n, sent;
+
+    pad.shim.rest_report = rest;
+    pad.shim.rest_report_len = sizeof (rest);
+    dev = pad_attach (&pad);
+    if (!dev)
+        return;
+    CHECK (((struct grub_usb_snes_data *) shim_terminal->data)->pads[0].calibrating == 0,
+           "rest report: still calibrating after attach");
+    shim_queue_report (left, sizeof (left));
+    n = drain_keys (got, MAX_KEYS_PER_REPORT);
+    CHECK (n == 1 && got[0] == GRUB_TERM_KEY_LEFT,
+           "rest report: %u keys, first %x, not left of 0x9f", n, got[0]);
+
+    /* Pads sharing a report ID share one request; the quirk skips it */
+    data = shim_terminal->data;
+    plan = data->pads[0].plan;
+    data->n_pads = 0;
+    pad_setup (data, &plan, 0, data->pads[0].prev_report);
+    pad_setup (data, &plan, 0, data->pads[0].prev_report);
+    sent = shim_counters.control_msgs;
+    pad_read_rest (data, &quirky);
+    CHECK (shim_counters.control_msgs == sent && data->pads[0].calibrating != 0,
+           "rest report: read despite QUIRK_NO_GET_REPORT");
+    pad_read_rest (data, &plain);
+    CHECK (shim_counters.control_msgs == sent + 1,
+           "rest report: %u requests for one report ID", shim_counters.control_msgs - sent);
+    CHECK (data->pads[0].calibrating == 0 && data->pads[1].calibrating == 0,
+           "rest report: a pad sharing the ID left calibrating");
+    shim_pad_destroy (dev);
+
+    pad.shim.rest_report = held;
+    dev = pad_attach (&pad);
+    if (!dev)
+        return;
+    CHECK (((struct grub_usb_snes_data *) shim_terminal->data)->pads[0].calibrating != 0,
+           "rest report: a held direction taken for rest");
+    shim_pad_destroy (dev);
+
+    dev = pad_attach (&snes_pad);
+    if (!dev)
+        return;
+    CHECK (((struct grub_usb_snes_data *) shim_terminal->data)->pads[0].calibrating != 0,
+           "rest report: calibrated without GET_REPORT");
+    shim_pad_destroy (dev);
+    printf ("PASS rest report at attach\n");
+}
+
+static void
+test_keymap (void)
+{
+    static const grub_uint8_t press[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x82, 0x00, 0x00, 0x00 };
+    grub_usb_device_t dev;
+    int got[MAX_KEYS_PER_REPORT] = { 0 };
+    unsigned n;
+
+    shim_setenv ("snes_map", "a:esc,start:none,bogus:x");
+    dev = pad_attach (&snes_pad);
+    if (dev)
+    {
+        shim_queue_report (press, sizeof (press));
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        CHECK (n == 1 && got[0] == GRUB_TERM_ESC, "snes_map: %u keys, first %x", n, got[0]);
+        shim_pad_destroy (dev);
+    }
+    shim_setenv ("snes_map", NULL);
+
+    /* The next attach goes back to the defaults */
+    dev = pad_attach (&snes_pad);
+    if (dev)
+    {
+        shim_queue_report (press, sizeof (press));
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        CHECK (n == 2 && got[0] == '\r' && got[1] == '\r',
+               "default map: %u keys, first %x", n, got[0]);
+        shim_pad_destroy (dev);
+    }
+    printf ("PASS snes_map\n");
+}
+
+#if SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+/* A ring full of confirm/escape keeps them all and refuses the newcomer */
+static void
+test_queue_full (void)
+{
+    struct snes_key_queue q;
+    grub_uint64_t stamp;
+    unsigned i;
+
+    snes_key_queue_init (&q);
+    for (i = 0; i < SNES_KEY_QUEUE_CAPACITY; i++)
+        snes_key_queue_push (&q, i % 2 ? GRUB_TERM_ESC : '\r', i);
+    snes_key_queue_push (&q, 'c', i);
+    snes_key_queue_push (&q, GRUB_TERM_KEY_DOWN, i);
+
+    CHECK (q.size == SNES_KEY_QUEUE_CAPACITY, "queue: %u keys after overflow", q.size);
+    for (i = 0; i < SNES_KEY_QUEUE_CAPACITY; i++)
+    {
+        int key = snes_key_queue_pop (&q, i, &stamp);
+
+        CHECK (key == (i % 2 ? GRUB_TERM_ESC : '\r'), "queue: key %u is %x", i, key);
+    }
+    CHECK (snes_key_queue_pop (&q, i, &stamp) == GRUB_TERM_NO_KEY, "queue: key left over");
+    printf ("PASS full queue keeps confirm/escape\n");
+}
+#endif
+
+static void
+test_repeat (void)
+{
+    static const grub_uint8_t up[8] = { 0x7f, 0x00, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t neutral[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    grub_usb_device_t dev;
+    int got[MAX_KEYS_PER_REPORT];
+    unsigned n, repeats = 0, t;
+
+    shim_set_time (1000);
+    dev = pad_attach (&snes_pad);
+    if (!dev)
+        return;
+
+    shim_queue_report (up, sizeof (up));
+    n = drain_keys (got, MAX_KEYS_PER_REPORT);
+    CHECK (n == 1 && got[0] == GRUB_TERM_KEY_UP, "repeat: first press %u keys", n);
+
+    shim_advance_time (REPEAT_DELAY_MS - 1);
+    CHECK (drain_keys (got, MAX_KEYS_PER_REPORT) == 0, "repeat: key before the delay");
+
+    /* Held for two more seconds, polled every 10 ms */
+    for (t = 0; t < 2000; t += 10)
+    {
+        shim_advance_time (10);
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        CHECK (n == 0 || got[0] == GRUB_TERM_KEY_UP, "repeat: key %x", got[0]);
+        repeats += n;
+    }
+    CHECK (repeats >= 2000 / REPEAT_RATE_MS && repeats <= 2000 / REPEAT_MIN_MS + 1,
+           "repeat: %u repeats in 2 s", repeats);
+
+    shim_queue_report (neutral, sizeof (neutral));
+    drain_keys (got, MAX_KEYS_PER_REPORT);
+    shim_advance_time (1000);
+    CHECK (drain_keys (got, MAX_KEYS_PER_REPORT) == 0, "repeat: key after release");
+
+    shim_pad_destroy (dev);
+    shim_set_time (0);
+    printf ("PASS auto-repeat (%u repeats in 2 s)\n", repeats);
+}
+
+static void
+test_recovery (void)
+{
+    static const grub_uint8_t a[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x02, 0x00, 0x00, 0x00 };
+    struct grub_usb_snes_data *data;
+    grub_usb_device_t dev;
+    int got[MAX_KEYS_PER_REPORT] = { 0 };
+    unsigned i, n = 0;
+
+    shim_set_time (1000);
+    dev = pad_attach (&snes_pad);
+    if (!dev)
+        return;
+
+    for (i = 0; i < SNES_RECOVERY_CLEAR_HALT_AFTER; i++)
+        shim_queue_error (GRUB_USB_ERR_STALL);
+    for (i = 0; i < 10 && shim_queue_depth () > 0; i++)
+    {
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+        shim_advance_time (SNES_RECOVERY_BACKOFF_MAX_MS);
+    }
+    CHECK (shim_queue_depth () == 0, "recovery: %u errors left", shim_queue_depth ());
+    CHECK (shim_counters.clear_halts == 1, "recovery: %u halts cleared", shim_counters.clear_halts);
+
+    /* Back in business once the backoff is over */
+    shim_advance_time (SNES_RECOVERY_BACKOFF_MAX_MS);
+    shim_queue_report (a, sizeof (a));
+    for (i = 0; i < 4 && n == 0; i++)
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+    CHECK (n == 1 && got[0] == '\r', "recovery: %u keys after recovering", n);
+    shim_pad_destroy (dev);
+
+    /* With the whole ring posted, one error is still one failure */
+    shim_max_posted = SHIM_MAX_POSTED;
+    dev = pad_attach (&snes_pad);
+    shim_max_posted = 1;
+    if (!dev)
+        return;
+    data = shim_terminal->data;
+    data->ring_depth = REPORT_RING_SIZE;
+    for (i = 0; i < REPORT_RING_SIZE; i++)
+        shim_queue_error (GRUB_USB_ERR_STALL);
+    drain_keys (got, MAX_KEYS_PER_REPORT);
+    CHECK (data->recovery.streak == 1 && data->ring_posted == 0,
+           "recovery: one error across the ring, streak %u, %u posted",
+           data->recovery.streak, data->ring_posted);
+
+    shim_pad_destroy (dev);
+    shim_set_time (0);
+    printf ("PASS transfer error recovery\n");
+}
+
+/*
+ * Only REPORT_RING_DEPTH transfers go out by default, whatever the
+ * controller takes. With the ring opened up, a controller that takes
+ * one transfer per endpoint, as GRUB's OHCI and EHCI, shrinks it
+ * without a recovery episode; one that takes more, as UHCI, gets the
+ * whole ring.
+ */
+static void
+test_ring (void)
+{
+    static const unsigned takes[] = { 1, SHIM_MAX_POSTED };
+    static const grub_uint8_t a[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x02, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t neutral[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    unsigned k, i;
+
+    for (k = 0; k < ARRAY_SIZE (takes); k++)
+    {
+        unsigned want = takes[k] < REPORT_RING_SIZE ? takes[k] : REPORT_RING_SIZE;
+        struct grub_usb_snes_data *data;
+        grub_usb_device_t dev;
+        int got[MAX_KEYS_PER_REPORT];
+        unsigned n = 0;
+
+        shim_max_posted = takes[k];
+        dev = pad_attach (&snes_pad);
+        if (!dev)
+            break;
+        data = shim_terminal->data;
+        CHECK (data->ring_depth == REPORT_RING_DEPTH && data->ring_posted == REPORT_RING_DEPTH,
+               "ring: controller taking %u, %u posted at attach", takes[k], data->ring_posted);
+        data->ring_depth = REPORT_RING_SIZE;
+
+        for (i = 0; i < AXIS_CALIBRATION_REPORTS; i++)
+            shim_queue_report (neutral, sizeof (neutral));
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+        for (i = 0; i < 10; i++)
+        {
+            shim_queue_report (i % 2 ? neutral : a, sizeof (a));
+            n += drain_keys (got, MAX_KEYS_PER_REPORT);
+        }
+
+        CHECK (data->ring_depth == want && data->ring_posted == want,
+               "ring: controller taking %u, %u deep, %u posted", takes[k],
+               data->ring_depth, data->ring_posted);
+        CHECK (data->recovery.streak == 0 && shim_counters.clear_halts == 0,
+               "ring: controller taking %u, failure streak %u", takes[k],
+               data->recovery.streak);
+        CHECK (n == 5, "ring: controller taking %u, %u keys for 5 presses", takes[k], n);
+        shim_pad_destroy (dev);
+    }
+    shim_max_posted = 1;
+    printf ("PASS transfer ring on one-transfer and multi-transfer controllers\n");
+}
+
+#if AGGREGATE_TERMINAL
+/* Attach one more pad behind the aggregate terminal, governor off */
+static grub_usb_device_t
+aggregate_attach (void)
+{
+    grub_usb_device_t dev = shim_pad_create (&snes_pad.shim);
+    struct grub_usb_snes_data *data;
+
+    if (!grub_usb_snes_attach (dev, 0, 0))
+    {
+        printf ("FAIL: pad %u did not attach\n", active_count);
+        failures++;
+        shim_pad_destroy (dev);
+        return NULL;
+    }
+    data = active_pads[active_count - 1];
+    data->poll_interval = 0;
+    data->poll_idle_interval = 0;
+    return dev;
+}
+
+/*
+ * One terminal for every pad: it is registered with the first and
+ * unregistered with the last, and hands out the pads' keys in turn
+ */
+static void
+test_aggregate (void)
+{
+    static const grub_uint8_t ab[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x06, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t up_right[8] = { 0xff, 0x00, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t a[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x02, 0x00, 0x00, 0x00 };
+    static const int want[] = { '\r', GRUB_TERM_KEY_UP, REF_KEY_B, GRUB_TERM_KEY_RIGHT };
+    grub_usb_device_t one, two;
+    int got[MAX_KEYS_PER_REPORT] = { 0 };
+    unsigned n;
+
+    shim_terminal = NULL;
+    one = aggregate_attach ();
+    two = aggregate_attach ();
+    if (!one || !two)
+        return;
+    CHECK (shim_terminals == 1 && shim_terminal == &aggregate_term,
+           "aggregate: %u terminals for two pads", shim_terminals);
+    CHECK (strcmp (shim_terminal->name, SNES_TERM_NAME) == 0,
+           "aggregate: terminal named %s", shim_terminal->name);
+
+    /* Two keys on each pad come out alternating, the first pad first */
+    shim_pad_select (one);
+    shim_queue_report (ab, sizeof (ab));
+    shim_pad_select (two);
+    shim_queue_report (up_right, sizeof (up_right));
+    n = drain_keys (got, MAX_KEYS_PER_REPORT);
+    CHECK (n == ARRAY_SIZE (want) && memcmp (got, want, sizeof (want)) == 0,
+           "aggregate: %u keys, %x %x %x %x", n, got[0], got[1], got[2], got[3]);
+
+    /* The terminal outlives the first pad and goes with the last */
+    shim_pad_destroy (one);
+    CHECK (shim_terminals == 1 && shim_terminal == &aggregate_term && active_count == 1,
+           "aggregate: %u terminals, %u pads after one left", shim_terminals, active_count);
+    shim_pad_select (two);
+    shim_queue_report (a, sizeof (a));
+    n = drain_keys (got, MAX_KEYS_PER_REPORT);
+    CHECK (n == 1 && got[0] == '\r', "aggregate: %u keys from the pad left", n);
+    shim_pad_destroy (two);
+    CHECK (shim_terminals == 0 && shim_terminal == NULL && active_count == 0,
+           "aggregate: %u terminals after the last pad left", shim_terminals);
+    printf ("PASS aggregate terminal\n");
+}
+#endif
+
+/* The controller is checked once per bInterval, less often when idle */
+static void
+test_governor (void)
+{
+    static const grub_uint8_t ab[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x06, 0x00, 0x00, 0x00 };
+    static const grub_uint8_t neutral[8] = { 0x7f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00 };
+    struct grub_usb_snes_data *data;
+    grub_usb_device_t dev;
+    int got[MAX_KEYS_PER_REPORT];
+    unsigned i, n, checks, t;
+
+    shim_set_time (1000);
+    dev = pad_attach_governed (&snes_pad);
+    if (!dev)
+        return;
+    data = shim_terminal->data;
+    CHECK (data->poll_interval == 8, "governor: interval %u ms", data->poll_interval);
+
+    /* A and B from one report: the second key comes between checks */
+    for (i = 0; i < AXIS_CALIBRATION_REPORTS; i++)
+        shim_queue_report (neutral, sizeof (neutral));
+    shim_queue_report (ab, sizeof (ab));
+    for (t = 0, n = 0; t < 64 && n == 0; t++)
+    {
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+        shim_advance_time (1);
+    }
+    CHECK (n == 2, "governor: %u keys from a two-button press", n);
+
+    /* A hot loop without the clock moving checks nothing */
+    shim_queue_report (neutral, sizeof (neutral));
+    checks = shim_counters.checks;
+    for (i = 0; i < 10000; i++)
+        shim_terminal->getkey (shim_terminal);
+    CHECK (shim_counters.checks - checks <= 1, "governor: %u checks in a hot loop",
+           shim_counters.checks - checks);
+
+    /* One check per interval while active */
+    checks = shim_counters.checks;
+    for (t = 0; t < 800; t++)
+    {
+        shim_advance_time (1);
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+    }
+    n = shim_counters.checks - checks;
+    CHECK (n >= 800 / 8 - 1 && n <= 800 / 8 + 1, "governor: %u checks in 800 ms", n);
+
+#if SNES_IDLE_AFTER_MS
+    /* Idle: the checks stretch, and a press brings the full rate back */
+    shim_advance_time (SNES_IDLE_AFTER_MS);
+    drain_keys (got, MAX_KEYS_PER_REPORT);
+    checks = shim_counters.checks;
+    for (t = 0; t < 1000; t++)
+    {
+        shim_advance_time (1);
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+    }
+    n = shim_counters.checks - checks;
+    CHECK (n <= 1000 / SNES_IDLE_POLL_MS + 1, "governor: %u checks in 1 s idle", n);
+
+    shim_queue_report (ab, sizeof (ab));
+    for (t = 0, n = 0; t <= SNES_IDLE_POLL_MS && n == 0; t++)
+    {
+        shim_advance_time (1);
+        n = drain_keys (got, MAX_KEYS_PER_REPORT);
+    }
+    CHECK (n == 2, "governor: %u keys after idle", n);
+    shim_queue_report (neutral, sizeof (neutral));
+    checks = shim_counters.checks;
+    for (t = 0; t < 800; t++)
+    {
+        shim_advance_time (1);
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+    }
+    n = shim_counters.checks - checks;
+    CHECK (n >= 800 / 8 - 1, "governor: %u checks in 800 ms after idle", n);
+
+    /* A pad re-sending its rest report is not left unsampled when idle */
+    shim_queue_report (neutral, sizeof (neutral));
+    drain_keys (got, MAX_KEYS_PER_REPORT);
+    for (t = 0; t < 64; t++)
+    {
+        shim_advance_time (1);
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+    }
+    CHECK (data->streaming, "governor: repeated report not seen as streaming");
+    shim_advance_time (SNES_IDLE_AFTER_MS);
+    drain_keys (got, MAX_KEYS_PER_REPORT);
+    checks = shim_counters.checks;
+    for (t = 0; t < 1000; t++)
+    {
+        shim_advance_time (1);
+        drain_keys (got, MAX_KEYS_PER_REPORT);
+    }
+    n = shim_counters.checks - checks;
+    CHECK (n >= 1000 / (data->ring_depth * 8) - 1,
+           "governor: %u checks in 1 s idle on a streaming pad", n);
+#endif
+
+    shim_pad_destroy (dev);
+    shim_set_time (0);
+    printf ("PASS poll governor\n");
+}
+
+static void
+test_random (const struct ref_pad *pad, unsigned n)
+{
+    grub_uint8_t *reports = calloc (n, SHIM_REPORT_MAX);
+    char what[64];
+
+    random_reports (pad, reports, n);
+    snprintf (what, sizeof (what), "random %s stream", pad->name);
+    play_stream (pad, reports, n, what);
+    free (reports);
+}
+
+/* Read a .hex stream; returns the report count, 0 on error */
+static unsigned
+load_stream (const char *path, grub_uint8_t **reports, const struct ref_pad **pad)
+{
+    FILE *f = fopen (path, "r");
+    char line[4 * SHIM_REPORT_MAX];
+    unsigned n = 0, cap = 0;
+
+    *reports = NULL;
+    *pad = &snes_pad;
+    if (!f)
+    {
+        perror (path);
+        return 0;
+    }
+
+    while (fgets (line, sizeof (line), f))
+    {
+        grub_uint8_t report[SHIM_REPORT_MAX] = { 0 };
+        unsigned len = 0, hi = 0, digits = 0;
+        char *p;
+
+        if (line[0] == '#')
+        {
+            if (strstr (line, "pad: descriptor"))
+                *pad = &descriptor_pad;
+            continue;
+        }
+        for (p = line; *p && *p != '#'; p++)
+        {
+            unsigned v;
+
+            if (*p >= '0' && *p <= '9')
+                v = *p - '0';
+            else if (*p >= 'a' && *p <= 'f')
+                v = *p - 'a' + 10;
+            else if (*p >= 'A' && *p <= 'F')
+                v = *p - 'A' + 10;
+            else
+                continue;
+            if (digits++ & 1)
+            {
+                if (len < SHIM_REPORT_MAX)
+                    report[len++] = (hi << 4) | v;
+            }
+            else
+                hi = v;
+        }
+        if (len == 0)
+            continue;
+
+        if (n == cap)
+        {
+            cap = cap ? 2 * cap : 64;
+            *reports = realloc (*reports, cap * SHIM_REPORT_MAX);
+        }
+        memcpy (*reports + n * SHIM_REPORT_MAX, report, SHIM_REPORT_MAX);
+        n++;
+    }
+
+    fclose (f);
+    return n;
+}
+
+static void
+test_recorded (const char *path)
+{
+    const struct ref_pad *pad;
+    grub_uint8_t *reports;
+    unsigned n = load_stream (path, &reports, &pad);
+    char what[256];
+
+    if (n == 0)
+    {
+        printf ("FAIL %s: no reports\n", path);
+        failures++;
+        return;
+    }
+    snprintf (what, sizeof (what), "recorded %s", path);
+    play_stream (pad, reports, n, what);
+    free (reports);
+}
+
+/*
+ * Trace replay
+ */
+#define TRACE_HEADER_SIZE       16
+#define TRACE_RECORD_SIZE       5
+
+struct trace
+{
+    struct shim_pad pad;
+    grub_uint8_t *data;                 /* The whole file */
+    grub_size_t size;
+    grub_size_t records;                /* Offset of the first record */
+};
+
+static unsigned
+le16 (const grub_uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static grub_uint32_t
+le32 (const grub_uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((grub_uint32_t) p[3] << 24);
+}
+
+static int
+load_trace (const char *path, struct trace *t)
+{
+    FILE *f = fopen (path, "rb");
+    long size;
+
+    memset (t, 0, sizeof (*t));
+    if (!f)
+    {
+        perror (path);
+        return 0;
+    }
+    fseek (f, 0, SEEK_END);
+    size = ftell (f);
+    rewind (f);
+    t->data = malloc (size > 0 ? size : 1);
+    t->size = fread (t->data, 1, size > 0 ? size : 0, f);
+    fclose (f);
+
+    if (t->size < TRACE_HEADER_SIZE || memcmp (t->data, "SNTR", 4) != 0
+        || le16 (t->data + 4) != 1)
+    {
+        printf ("FAIL %s: not a version 1 trace\n", path);
+        return 0;
+    }
+    t->pad.vid = le16 (t->data + 6);
+    t->pad.pid = le16 (t->data + 8);
+    t->pad.maxpacket = le16 (t->data + 10);
+    t->pad.report_desc_len = le16 (t->data + 12);
+    t->pad.interval = t->data[14];
+    t->pad.report_desc = t->pad.report_desc_len ? t->data + TRACE_HEADER_SIZE : NULL;
+    t->records = TRACE_HEADER_SIZE + t->pad.report_desc_len;
+    if (t->records > t->size || t->pad.maxpacket == 0 || t->pad.maxpacket > SHIM_REPORT_MAX)
+    {
+        printf ("FAIL %s: bad trace header\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+struct replay
+{
+    FILE *log;                          /* Key log, one "ms key" per line */
+    grub_uint64_t start;
+    grub_uint64_t pending;              /* Trace time of the first report not yet polled, or 0 */
+    struct
+    {
+        grub_uint64_t poll;             /* Poll that picked reports up... */
+        grub_uint64_t due;              /* ...and when the first was on the wire */
+    } arrivals[REPLAY_ARRIVALS];
+    unsigned n_arrivals;
+    unsigned keys;
+    unsigned latency[REPLAY_MAX_LATENCY + 1];
+};
+
+/*
+ * When the key just handed out was queued, from a copy of the queue
+ * taken before getkey: the first entry that was not about to expire, or
+ * now if the key came from this very poll.
+ */
+static grub_uint64_t
+replay_stamp (const struct snes_key_queue *before, int key, grub_uint64_t now)
+{
+    unsigned i;
+
+    for (i = 0; i < before->size; i++)
+    {
+        const struct snes_queued_key *e
+            = &before->keys[(before->begin + i) % SNES_KEY_QUEUE_CAPACITY];
+
+#if SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+        if (snes_key_is_navigation (e->key) && now - e->stamp > SNES_QUEUE_MAX_AGE_MS)
+            continue;
+#endif
+        return e->key == key ? e->stamp : now;
+    }
+    return now;
+}
+
+/*
+ * Keys are stamped at the poll that saw their report, which may be up to
+ * --poll-ms after the report arrived; latency counts from the arrival.
+ * Repeats are stamped when they fire and count from there.
+ */
+static unsigned
+replay_latency (const struct replay *r, grub_uint64_t stamp, grub_uint64_t now)
+{
+    unsigned i;
+
+    for (i = 0; i < r->n_arrivals && i < REPLAY_ARRIVALS; i++)
+        if (r->arrivals[i].poll == stamp)
+            return now - r->arrivals[i].due;
+    return now - stamp;
+}
+
+static const char *
+key_name (int key, char *buf)
+{
+    unsigned i;
+
+    for (i = 0; i < ARRAY_SIZE (key_names); i++)
+        if (key_names[i].key == key)
+            return key_names[i].name;
+    if (key > ' ' && key < 0x7f)
+        sprintf (buf, "%c", key);
+    else
+        sprintf (buf, "0x%x", key);
+    return buf;
+}
+
+/* One pass of the menu loop: every key the module has right now */
+static void
+replay_poll (struct replay *r)
+{
+    struct grub_usb_snes_data *data = shim_terminal->data;
+    grub_uint64_t now = grub_get_time_ms ();
+
+    if (r->pending)
+    {
+        unsigned slot = r->n_arrivals++ % REPLAY_ARRIVALS;
+
+        r->arrivals[slot].poll = now;
+        r->arrivals[slot].due = r->pending;
+        r->pending = 0;
+    }
+
+    for (;;)
+    {
+        struct snes_key_queue before = data->key_queue;
+        int key = shim_terminal->getkey (shim_terminal);
+        unsigned latency;
+        char buf[16];
+
+        if (key == GRUB_TERM_NO_KEY)
+            break;
+        latency = replay_latency (r, replay_stamp (&before, key, now), now);
+        r->latency[latency < REPLAY_MAX_LATENCY ? latency : REPLAY_MAX_LATENCY]++;
+        r->keys++;
+        fprintf (r->log, "%llu %s\n", (unsigned long long) (now - r->start),
+                 key_name (key, buf));
+    }
+}
+
+static unsigned
+latency_percentile (const struct replay *r, unsigned pct)
+{
+    unsigned i, seen = 0, want = (r->keys * pct + 99) / 100;
+
+    for (i = 0; i <= REPLAY_MAX_LATENCY; i++)
+    {
+        seen += r->latency[i];
+        if (seen >= want && seen > 0)
+            return i;
+    }
+    return 0;
+}
+
+/* 1 if the log matches the file, 0 if not (first difference printed), -1 if no file */
+static int
+same_log (FILE *got, const char *want_path, const char *what)
+{
+    FILE *want = fopen (want_path, "r");
+    char a[128], b[128];
+    unsigned line = 0;
+    int ok = 1;
+
+    if (!want)
+        return -1;
+    rewind (got);
+    for (;;)
+    {
+        char *pa = fgets (a, sizeof (a), got), *pb = fgets (b, sizeof (b), want);
+
+        line++;
+        if (!pa && !pb)
+            break;
+        if (!pa || !pb || strcmp (a, b) != 0)
+        {
+            printf ("FAIL %s: key log line %u: expected %s, got %s\n", what, line,
+                    pb ? strtok (b, "\n") : "end of log", pa ? strtok (a, "\n") : "end of log");
+            ok = 0;
+            break;
+        }
+    }
+    fclose (want);
+    return ok;
+}
+
+static void
+replay_trace (const char *path)
+{
+    const char *dot = strrchr (path, '.');
+    grub_uint64_t now = REPLAY_START_MS, due = REPLAY_START_MS;
+    unsigned reports = 0, errors = 0;
+    grub_usb_device_t dev;
+    struct replay r;
+    struct trace t;
+    grub_size_t pos;
+    char keys_path[512];
+    int same;
+
+    if (!load_trace (path, &t))
+    {
+        failures++;
+        free (t.data);
+        return;
+    }
+
+    shim_set_time (now);
+    dev = shim_pad_create (&t.pad);
+    shim_terminal = NULL;
+    if (!grub_usb_snes_attach (dev, 0, 0) || !shim_terminal)
+    {
+        printf ("FAIL %s: %04x:%04x did not attach\n", path, t.pad.vid, t.pad.pid);
+        failures++;
+        shim_pad_destroy (dev);
+        free (t.data);
+        return;
+    }
+    memset (&r, 0, sizeof (r));
+    r.start = now;
+    r.log = tmpfile ();
+
+    for (pos = t.records; pos + TRACE_RECORD_SIZE <= t.size; )
+    {
+        unsigned len = t.data[pos + 4];
+
+        if (pos + TRACE_RECORD_SIZE + len > t.size || len > SHIM_REPORT_MAX)
+            break;
+        due = REPLAY_START_MS + le32 (t.data + pos) / 1000;
+
+        /* The menu keeps polling until the report is on the wire */
+        while (now < due || shim_queue_depth () == SHIM_QUEUE_SIZE)
+        {
+            replay_poll (&r);
+            now += poll_ms;
+            shim_set_time (now);
+        }
+        if (!r.pending)
+            r.pending = due;
+        if (len)
+            shim_queue_report (t.data + pos + TRACE_RECORD_SIZE, len);
+        else
+        {
+            shim_queue_error (GRUB_USB_ERR_STALL);
+            errors++;
+        }
+        reports++;
+        pos += TRACE_RECORD_SIZE + len;
+    }
+    for (due += REPLAY_TAIL_MS; now < due; now += poll_ms)
+    {
+        shim_set_time (now);
+        replay_poll (&r);
+    }
+
+    if (pos != t.size)
+    {
+        printf ("FAIL %s: truncated record at offset %lu\n", path, (unsigned long) pos);
+        failures++;
+    }
+    else
+    {
+        printf ("PASS %s: %u reports (%u failed), %u keys, ", path, reports, errors, r.keys);
+#if SNES_STATS
+        {
+            const struct grub_usb_snes_data *data = shim_terminal->data;
+
+            printf ("%u dropped, ", data->key_queue.dropped);
+        }
+#endif
+        printf ("latency ms p50 %u p95 %u max %u\n", latency_percentile (&r, 50),
+                latency_percentile (&r, 95), latency_percentile (&r, 100));
+    }
+
+    if (print_keys_log)
+    {
+        char line[128];
+
+        rewind (r.log);
+        while (fgets (line, sizeof (line), r.log))
+            fputs (line, stdout);
+    }
+
+    snprintf (keys_path, sizeof (keys_path), "%.*s.keys",
+              (int) (dot ? dot - path : (int) strlen (path)), path);
+    same = poll_ms == REPLAY_POLL_MS ? same_log (r.log, keys_path, path) : -1;
+    if (same == 0)
+        failures++;
+    else if (same == 1)
+        printf ("PASS %s: key log matches %s\n", path, keys_path);
+
+    fclose (r.log);
+    shim_pad_destroy (dev);
+    shim_set_time (0);
+    free (t.data);
+}
+
+/*
+ * Benchmarks
+ */
+static double
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static grub_uint64_t
+cycles (void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc ();
+#else
+    return 0;
+#endif
+}
+
+static void
+bench_report (const char *what, unsigned n, double ns, grub_uint64_t cyc)
+{
+    printf ("bench %-18s %8u reports %8.2f Mreports/s %7.1f ns/report",
+            what, n, n / ns * 1e3, ns / n);
+#ifdef HAVE_TSC
+    printf (" %7.1f cycles/report", (double) cyc / n);
+#else
+    (void) cyc;
+#endif
+    printf ("\n");
+}
+
+/* Decode loop of poll_device, with the report already in the ring */
+static void
+bench_decode (const struct ref_pad *pad, unsigned n)
+{
+    grub_uint8_t *set = calloc (BENCH_SET, SHIM_REPORT_MAX);
+    grub_usb_device_t dev = pad_attach (pad);
+    struct grub_usb_snes_data *data;
+    grub_uint64_t c0, c1;
+    double t0, t1;
+    unsigned i, p, keys = 0;
+    char what[32];
+
+    if (!dev)
+    {
+        free (set);
+        return;
+    }
+    data = shim_terminal->data;
+    random_reports (pad, set, BENCH_SET);
+
+    t0 = now_ns ();
+    c0 = cycles ();
+    for (i = 0; i < n; i++)
+    {
+        grub_memcpy (data->ring[0], set + (i % BENCH_SET) * SHIM_REPORT_MAX, pad->report_len);
+        report_copy (data, data->report, data->ring[0]);
+        for (p = 0; p < data->n_pads; p++)
+        {
+            struct snes_pad *sp = &data->pads[p];
+
+            if (pad_unchanged (sp, data->report))
+                continue;
+            process_report (data, sp, 0);
+            pad_save (sp, data->report);
+        }
+        while (key_queue_pop (data) != GRUB_TERM_NO_KEY)
+            keys++;
+    }
+    c1 = cycles ();
+    t1 = now_ns ();
+
+    snprintf (what, sizeof (what), "decode %s", pad->name);
+    bench_report (what, n, t1 - t0, c1 - c0);
+    shim_pad_destroy (dev);
+    free (set);
+    (void) keys;
+}
+
+/* The whole getkey path, USB shim included */
+static void
+bench_getkey (const struct ref_pad *pad, unsigned n)
+{
+    grub_uint8_t *set = calloc (BENCH_SET, SHIM_REPORT_MAX);
+    grub_usb_device_t dev = pad_attach (pad);
+    grub_uint64_t c0, c1;
+    double t0, t1;
+    unsigned i = 0;
+    char what[32];
+
+    if (!dev)
+    {
+        free (set);
+        return;
+    }
+    random_reports (pad, set, BENCH_SET);
+
+    t0 = now_ns ();
+    c0 = cycles ();
+    while (i < n)
+    {
+        while (i < n && shim_queue_depth () < SHIM_QUEUE_SIZE)
+        {
+            shim_queue_report (set + (i % BENCH_SET) * SHIM_REPORT_MAX, pad->report_len);
+            i++;
+        }
+        while (shim_terminal->getkey (shim_terminal) != GRUB_TERM_NO_KEY
+               || shim_queue_depth () > 0)
+            ;
+    }
+    c1 = cycles ();
+    t1 = now_ns ();
+
+    snprintf (what, sizeof (what), "getkey %s", pad->name);
+    bench_report (what, n, t1 - t0, c1 - c0);
+    shim_pad_destroy (dev);
+    free (set);
+}
+
+int
+main (int argc, char **argv)
+{
+    unsigned bench_reports = BENCH_REPORTS;
+    grub_uint64_t seed = 1;
+    int bench = 0, replay_only = 0, i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++)
+    {
+        if (strcmp (argv[i], "-v") == 0)
+            shim_verbose = 1;
+        else if (strcmp (argv[i], "--bench") == 0)
+            bench = 1;
+        else if (strcmp (argv[i], "--reports") == 0 && i + 1 < argc)
+            bench_reports = strtoul (argv[++i], NULL, 0);
+        else if (strcmp (argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = strtoull (argv[++i], NULL, 0);
+        else if (strcmp (argv[i], "--replay") == 0)
+            replay_only = 1;
+        else if (strcmp (argv[i], "--keys") == 0)
+            print_keys_log = 1;
+        else if (strcmp (argv[i], "--poll-ms") == 0 && i + 1 < argc && atoi (argv[i + 1]) > 0)
+            poll_ms = atoi (argv[++i]);
+        else
+        {
+            fprintf (stderr, "usage: %s [-v] [--bench] [--reports N] [--seed N] [--replay] "
+                     "[--keys] [--poll-ms N] [stream.hex | trace.trace ...]\n", argv[0]);
+            return 2;
+        }
+    }
+    rng_state = seed ? seed : 1;
+
+#if AGGREGATE_TERMINAL
+    /* Everything else drives one pad through its own terminal */
+    test_aggregate ();
+    bench = 0;
+    (void) replay_only;
+#else
+    if (!replay_only)
+    {
+        test_fixed_reports ();
+        test_descriptor_plan ();
+        test_multi_pad ();
+        test_rest_report ();
+        test_keymap ();
+#if SNES_QUEUE_POLICY == SNES_QUEUE_COALESCE
+        test_queue_full ();
+#endif
+        test_repeat ();
+        test_recovery ();
+        test_ring ();
+        test_governor ();
+        test_random (&snes_pad, RANDOM_REPORTS);
+        test_random (&descriptor_pad, RANDOM_REPORTS);
+    }
+    for (; i < argc; i++)
+    {
+        const char *dot = strrchr (argv[i], '.');
+
+        if (dot && strcmp (dot, ".trace") == 0)
+            replay_trace (argv[i]);
+        else
+            test_recorded (argv[i]);
+    }
+#endif
+
+    if (failures)
+    {
+        printf ("%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    if (bench && bench_reports)
+    {
+        bench_decode (&snes_pad, bench_reports);
+        bench_decode (&descriptor_pad, bench_reports);
+        bench_getkey (&snes_pad, bench_reports);
+        bench_getkey (&descriptor_pad, bench_reports);
+    }
+    return 0;
+}
@@ -0,0 +1,440 @@
+/*
+ * Host shim for the SNES gamepad module
+ *
+ * libc stands in for GRUB's memory and string helpers, and fake pads
+ * for the USB core. Transfers come from a fixed pool so the benchmark
+ * measures the module, not malloc.
+ *
+ * License: GPLv3+
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <grub/types.h>
+#include <grub/err.h>
+#include <grub/misc.h>
+#include <grub/mm.h>
+#include <grub/time.h>
+#include <grub/env.h>
+#include <grub/term.h>
+#include <grub/usb.h>
+#include <grub/command.h>
+
+#include "shim.h"
+
+#define TRANSFER_POOL           (SHIM_MAX_POSTED * SHIM_PADS)
+#define ENV_VARS                8
+
+#define USB_REQ_GET_DESCRIPTOR  0x06
+#define USB_DESC_HID            0x21
+#define USB_DESC_HID_REPORT     0x22
+#define USB_HID_GET_REPORT      0x01
+
+grub_err_t grub_errno;
+struct shim_counters shim_counters;
+struct grub_term_input *shim_terminal;
+unsigned shim_terminals;
+int shim_verbose;
+int shim_fail_post;
+unsigned shim_max_posted = 1;
+
+static grub_uint64_t now_ms;
+
+/*
+ * Memory and strings
+ */
+void *grub_memcpy (void *dest, const void *src, grub_size_t n) { return memcpy (dest, src, n); }
+void *grub_memset (void *s, int c, grub_size_t n) { return memset (s, c, n); }
+int grub_memcmp (const void *s1, const void *s2, grub_size_t n) { return memcmp (s1, s2, n); }
+int grub_strncmp (const char *s1, const char *s2, grub_size_t n) { return strncmp (s1, s2, n); }
+grub_size_t grub_strlen (const char *s) { return strlen (s); }
+char *grub_strchr (const char *s, int c) { return strchr (s, c); }
+char *grub_strndup (const char *s, grub_size_t n) { return strndup (s, n); }
+void *grub_malloc (grub_size_t size) { return malloc (size); }
+void *grub_zalloc (grub_size_t size) { return calloc (1, size); }
+void grub_free (void *ptr) { free (ptr); }
+
+/*
+ * Output, silent unless -v
+ */
+int
+grub_printf (const char *fmt, ...)
+{
+    va_list ap;
+    int n = 0;
+
+    if (shim_verbose)
+    {
+        va_start (ap, fmt);
+        n = vprintf (fmt, ap);
+        va_end (ap);
+    }
+    return n;
+}
+
+void
+grub_real_dprintf (const char *file, const int line, const char *condition,
+                   const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!shim_verbose)
+        return;
+    printf ("%s:%d: %s: ", file, line, condition);
+    va_start (ap, fmt);
+    vprintf (fmt, ap);
+    va_end (ap);
+}
+
+char *
+grub_xasprintf (const char *fmt, ...)
+{
+    va_list ap;
+    char *s;
+
+    va_start (ap, fmt);
+    if (vasprintf (&s, fmt, ap) < 0)
+        s = NULL;
+    va_end (ap);
+    return s;
+}
+
+void
+grub_print_error (void)
+{
+    if (grub_errno != GRUB_ERR_NONE)
+        fprintf (stderr, "grub error %d\n", grub_errno);
+    grub_errno = GRUB_ERR_NONE;
+}
+
+/*
+ * Clock
+ */
+grub_uint64_t grub_get_time_ms (void) { return now_ms; }
+void shim_set_time (grub_uint64_t ms) { now_ms = ms; }
+void shim_advance_time (grub_uint64_t ms) { now_ms += ms; }
+
+/*
+ * Environment
+ */
+static struct
+{
+    const char *name;
+    const char *value;
+} env[ENV_VARS];
+
+const char *
+grub_env_get (const char *name)
+{
+    unsigned i;
+
+    for (i = 0; i < ENV_VARS; i++)
+        if (env[i].name && strcmp (env[i].name, name) == 0)
+            return env[i].value;
+    return NULL;
+}
+
+void
+shim_setenv (const char *name, const char *value)
+{
+    unsigned i, free_slot = ENV_VARS;
+
+    for (i = 0; i < ENV_VARS; i++)
+    {
+        if (env[i].name && strcmp (env[i].name, name) == 0)
+        {
+            env[i].value = value;
+            if (!value)
+                env[i].name = NULL;
+            return;
+        }
+        if (!env[i].name && free_slot == ENV_VARS)
+            free_slot = i;
+    }
+    if (value && free_slot < ENV_VARS)
+    {
+        env[free_slot].name = name;
+        env[free_slot].value = value;
+    }
+}
+
+/*
+ * Terminals and commands: remember the input, ignore the rest
+ */
+void
+grub_term_register_input_active (const char *name __attribute__ ((unused)),
+                                 struct grub_term_input *term)
+{
+    shim_terminal = term;
+    shim_terminals++;
+}
+
+void
+grub_term_unregister_input (struct grub_term_input *term)
+{
+    if (shim_terminal == term)
+        shim_terminal = NULL;
+    shim_terminals--;
+}
+
+grub_command_t
+grub_register_command (const char *name __attribute__ ((unused)),
+                       grub_command_func_t func __attribute__ ((unused)),
+                       const char *summary __attribute__ ((unused)),
+                       const char *description __attribute__ ((unused)))
+{
+    return (grub_command_t) &shim_counters;
+}
+
+void grub_unregister_command (grub_command_t cmd __attribute__ ((unused))) { }
+
+void grub_usb_register_attach_hook_class (struct grub_usb_attach_desc *desc __attribute__ ((unused))) { }
+void grub_usb_unregister_attach_hook_class (struct grub_usb_attach_desc *desc __attribute__ ((unused))) { }
+
+/*
+ * The fake pads, each with its own report queue and posted transfers
+ */
+struct shim_device
+{
+    struct grub_usb_device usb;
+    /* Interface, HID and endpoint descriptors back to back, as on the wire */
+    grub_uint8_t descs[sizeof (struct grub_usb_desc_if) + 9 + sizeof (struct grub_usb_desc_endp)];
+    struct shim_pad pad;
+    struct grub_usb_transfer *posted[SHIM_MAX_POSTED];    /* Oldest first */
+    unsigned n_posted;
+    struct
+    {
+        grub_usb_err_t err;
+        grub_size_t len;
+        grub_uint8_t report[SHIM_REPORT_MAX];
+    } queue[SHIM_QUEUE_SIZE];
+    unsigned queue_head, queue_size;
+};
+
+struct grub_usb_transfer
+{
+    int in_use;
+    struct shim_device *owner;
+    void *data;
+    grub_size_t size;
+};
+
+static struct shim_device *device;      /* Where reports are queued */
+static unsigned live_devices;
+static struct grub_usb_transfer pool[TRANSFER_POOL];
+
+grub_usb_device_t
+shim_pad_create (const struct shim_pad *pad)
+{
+    struct grub_usb_desc_if *descif;
+    struct grub_usb_desc_endp *endp;
+    grub_uint8_t *hid;
+
+    if (live_devices == SHIM_PADS)
+        abort ();
+    device = calloc (1, sizeof (*device));
+    device->pad = *pad;
+    device->usb.descdev.vendorid = pad->vid;
+    device->usb.descdev.prodid = pad->pid;
+    device->usb.speed = GRUB_USB_SPEED_FULL;
+
+    descif = (struct grub_usb_desc_if *) device->descs;
+    descif->length = sizeof (*descif);
+    descif->type = 4;
+    descif->endpointcnt = 1;
+    descif->class = GRUB_USB_CLASS_HID;
+
+    hid = device->descs + sizeof (*descif);
+    hid[0] = 9;
+    hid[1] = USB_DESC_HID;
+    hid[5] = 1;
+    hid[6] = USB_DESC_HID_REPORT;
+    hid[7] = pad->report_desc_len & 0xff;
+    hid[8] = pad->report_desc_len >> 8;
+
+    endp = (struct grub_usb_desc_endp *) (hid + 9);
+    endp->length = sizeof (*endp);
+    endp->type = 5;
+    endp->endp_addr = 0x81;
+    endp->attrib = GRUB_USB_EP_INTERRUPT;
+    endp->maxpacket = pad->maxpacket;
+    endp->interval = pad->interval ? pad->interval : 8;
+
+    device->usb.config[0].interf[0].descif = descif;
+    device->usb.config[0].interf[0].descendp = endp;
+
+    memset (&shim_counters, 0, sizeof (shim_counters));
+    if (live_devices++ == 0)
+        memset (pool, 0, sizeof (pool));
+    return &device->usb;
+}
+
+void
+shim_pad_select (grub_usb_device_t dev)
+{
+    device = (struct shim_device *) dev;
+}
+
+void
+shim_pad_destroy (grub_usb_device_t dev)
+{
+    struct grub_usb_interface *interf = &dev->config[0].interf[0];
+
+    if (interf->detach_hook)
+        interf->detach_hook (dev, 0, 0);
+    if (device == (struct shim_device *) dev)
+        device = NULL;
+    free (dev);
+    live_devices--;
+}
+
+void
+shim_queue_report (const grub_uint8_t *report, grub_size_t len)
+{
+    unsigned tail = (device->queue_head + device->queue_size) % SHIM_QUEUE_SIZE;
+
+    if (device->queue_size == SHIM_QUEUE_SIZE || len > SHIM_REPORT_MAX)
+        abort ();
+    device->queue[tail].err = GRUB_USB_ERR_NONE;
+    device->queue[tail].len = len;
+    memcpy (device->queue[tail].report, report, len);
+    device->queue_size++;
+}
+
+void
+shim_queue_error (grub_usb_err_t err)
+{
+    unsigned tail = (device->queue_head + device->queue_size) % SHIM_QUEUE_SIZE;
+
+    if (device->queue_size == SHIM_QUEUE_SIZE)
+        abort ();
+    device->queue[tail].err = err;
+    device->queue[tail].len = 0;
+    device->queue_size++;
+}
+
+unsigned shim_queue_depth (void) { return device->queue_size; }
+void shim_queue_flush (void) { device->queue_head = device->queue_size = 0; }
+
+grub_usb_err_t
+grub_usb_set_configuration (grub_usb_device_t dev __attribute__ ((unused)),
+                            int configuration __attribute__ ((unused)))
+{
+    shim_counters.set_configs++;
+    return GRUB_USB_ERR_NONE;
+}
+
+grub_usb_err_t
+grub_usb_clear_halt (grub_usb_device_t dev __attribute__ ((unused)),
+                     int endpoint __attribute__ ((unused)))
+{
+    shim_counters.clear_halts++;
+    return GRUB_USB_ERR_NONE;
+}
+
+grub_usb_err_t
+grub_usb_control_msg (grub_usb_device_t dev,
+                      grub_uint8_t reqtype,
+                      grub_uint8_t request, grub_uint16_t value,
+                      grub_uint16_t index __attribute__ ((unused)),
+                      grub_size_t size, char *data)
+{
+    const struct shim_pad *pad = &((struct shim_device *) dev)->pad;
+
+    shim_counters.control_msgs++;
+    if (request == USB_REQ_GET_DESCRIPTOR && (value >> 8) == USB_DESC_HID_REPORT)
+    {
+        if (!pad->report_desc)
+            return GRUB_USB_ERR_STALL;
+        if (size > pad->report_desc_len)
+            size = pad->report_desc_len;
+        memcpy (data, pad->report_desc, size);
+    }
+    /* Class IN request 0x01 is GET_REPORT; standard 0x01 is CLEAR_FEATURE */
+    if (request == USB_HID_GET_REPORT && (reqtype & 0xe0) == 0xa0)
+    {
+        if (!pad->rest_report)
+            return GRUB_USB_ERR_STALL;
+        if (size > pad->rest_report_len)
+            size = pad->rest_report_len;
+        memcpy (data, pad->rest_report, size);
+    }
+    return GRUB_USB_ERR_NONE;
+}
+
+grub_usb_transfer_t
+grub_usb_bulk_read_background (grub_usb_device_t dev,
+                               struct grub_usb_desc_endp *endpoint __attribute__ ((unused)),
+                               grub_size_t size, void *data)
+{
+    struct shim_device *sd = (struct shim_device *) dev;
+    unsigned i;
+
+    if (shim_fail_post || sd->n_posted >= shim_max_posted || sd->n_posted == SHIM_MAX_POSTED)
+        return NULL;
+    for (i = 0; i < TRANSFER_POOL; i++)
+        if (!pool[i].in_use)
+            break;
+    if (i == TRANSFER_POOL)
+        return NULL;
+
+    pool[i].in_use = 1;
+    pool[i].owner = sd;
+    pool[i].data = data;
+    pool[i].size = size;
+    sd->posted[sd->n_posted++] = &pool[i];
+    shim_counters.posted++;
+    return &pool[i];
+}
+
+static void
+transfer_release (grub_usb_transfer_t trans)
+{
+    struct shim_device *sd = trans->owner;
+    unsigned i;
+
+    for (i = 0; i < sd->n_posted; i++)
+        if (sd->posted[i] == trans)
+            break;
+    if (i == sd->n_posted)
+        abort ();
+    memmove (&sd->posted[i], &sd->posted[i + 1],
+             (sd->n_posted - i - 1) * sizeof (sd->posted[0]));
+    sd->n_posted--;
+    trans->in_use = 0;
+}
+
+grub_usb_err_t
+grub_usb_check_transfer (grub_usb_transfer_t trans, grub_size_t *actual)
+{
+    struct shim_device *sd = trans->owner;
+    grub_usb_err_t err;
+
+    shim_counters.checks++;
+
+    /* Completion is in posting order, as on an interrupt pipe */
+    if (sd->queue_size == 0 || sd->n_posted == 0 || sd->posted[0] != trans)
+        return GRUB_USB_ERR_WAIT;
+
+    err = sd->queue[sd->queue_head].err;
+    *actual = sd->queue[sd->queue_head].len < trans->size
+              ? sd->queue[sd->queue_head].len : trans->size;
+    memcpy (trans->data, sd->queue[sd->queue_head].report, *actual);
+    sd->queue_head = (sd->queue_head + 1) % SHIM_QUEUE_SIZE;
+    sd->queue_size--;
+
+    transfer_release (trans);
+    shim_counters.completed++;
+    return err;
+}
+
+void
+grub_usb_cancel_transfer (grub_usb_transfer_t trans)
+{
+    transfer_release (trans);
+    shim_counters.cancelled++;
+}
@@ -0,0 +1,81 @@
+/*
+ * Host shim for the SNES gamepad module: the harness side
+ *
+ * Up to SHIM_PADS fake USB pads. The harness queues reports (or
+ * transfer errors) on the selected pad, the last one created unless
+ * shim_pad_select says otherwise, and each grub_usb_check_transfer on
+ * a pad's oldest posted transfer completes it with that pad's next one;
+ * with nothing queued transfers stay pending. The clock only moves when
+ * the harness moves it.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef SNES_HOST_SHIM_H
+#define SNES_HOST_SHIM_H 1
+
+#include <grub/types.h>
+#include <grub/usb.h>
+#include <grub/term.h>
+
+#define SHIM_REPORT_MAX         64
+#define SHIM_QUEUE_SIZE         256
+#define SHIM_PADS               2       /* Attached at once */
+
+struct shim_pad
+{
+    grub_uint16_t vid;
+    grub_uint16_t pid;
+    grub_uint16_t maxpacket;
+    const grub_uint8_t *report_desc;    /* NULL: GET_DESCRIPTOR fails */
+    grub_size_t report_desc_len;
+    grub_uint8_t interval;              /* bInterval, 0 for the usual 8 ms */
+    const grub_uint8_t *rest_report;    /* NULL: GET_REPORT stalls */
+    grub_size_t rest_report_len;
+};
+
+struct shim_counters
+{
+    unsigned posted;                    /* grub_usb_bulk_read_background calls */
+    unsigned completed;
+    unsigned checks;                    /* grub_usb_check_transfer calls */
+    unsigned cancelled;
+    unsigned clear_halts;
+    unsigned set_configs;
+    unsigned control_msgs;
+};
+
+extern struct shim_counters shim_counters;
+extern struct grub_term_input *shim_terminal;   /* Last registered input */
+extern unsigned shim_terminals;                 /* Inputs registered now */
+extern int shim_verbose;                        /* Print grub_printf/dprintf */
+
+/* Build the fake device; the module's attach hook gets it */
+grub_usb_device_t shim_pad_create (const struct shim_pad *pad);
+void shim_pad_destroy (grub_usb_device_t dev);
+void shim_pad_select (grub_usb_device_t dev);
+
+/* Queue one report or one failed transfer */
+void shim_queue_report (const grub_uint8_t *report, grub_size_t len);
+void shim_queue_error (grub_usb_err_t err);
+unsigned shim_queue_depth (void);
+void shim_queue_flush (void);
+
+/* Refuse to post transfers (allocation failure) while set */
+extern int shim_fail_post;
+
+/*
+ * Transfers the controller keeps queued on the endpoint at once: 1 as
+ * GRUB's OHCI and EHCI, which refuse another while one is pending, or
+ * up to SHIM_MAX_POSTED as UHCI
+ */
+#define SHIM_MAX_POSTED 16
+extern unsigned shim_max_posted;
+
+void shim_set_time (grub_uint64_t ms);
+void shim_advance_time (grub_uint64_t ms);
+
+/* grub_env_get ("snes_map") and friends */
+void shim_setenv (const char *name, const char *value);
+
+#endif
@@ -0,0 +1,212 @@
+#!/usr/bin/env python3
+"""
+Device database for the SNES gamepad module
+
+tools/devices.txt is the one list of known pads. This script writes every
+copy of it, so they cannot drift apart:
+
+  src/snes_device_table.h          sorted table behind find_device ()
+  tools/snes-mapper.py             KNOWN_CONTROLLERS
+  tools/snes-mapper-standalone.py  KNOWN
+  docs/hid-reports.md              supported controllers table
+
+Usage: device_db.py [--check]
+  --check  change nothing, exit 1 if any copy is out of date
+"""
+
+import json
+import re
+import sys
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent
+DATABASE = ROOT / "tools" / "devices.txt"
+C_TABLE = ROOT / "src" / "snes_device_table.h"
+PLAN_HEADER = ROOT / "src" / "snes_devices.h"
+MAPPER = ROOT / "tools" / "snes-mapper.py"
+STANDALONE = ROOT / "tools" / "snes-mapper-standalone.py"
+DOCS = ROOT / "docs" / "hid-reports.md"
+
+LAYOUTS = {
+    'descriptor': 'LAYOUT_DESCRIPTOR',
+    'snes': 'LAYOUT_SNES',
+    'plan': 'LAYOUT_PLAN',
+}
+LAYOUT_DOCS = {
+    'descriptor': 'report descriptor',
+    'snes': 'fixed SNES layout',
+    'plan': 'mapped plan',
+}
+QUIRKS = {
+    'no-set-protocol': 'QUIRK_NO_SET_PROTOCOL',
+    'no-set-idle': 'QUIRK_NO_SET_IDLE',
+    'no-get-report': 'QUIRK_NO_GET_REPORT',
+}
+
+ROW = re.compile(r'([0-9a-f]{4}):([0-9a-f]{4})\s+(\S+)\s+(\d+)\s+(\d+)\s+(\S+)\s+(.+)$')
+
+class DatabaseError(Exception):
+    pass
+
+def load(path=DATABASE):
+    """Rows of the database, sorted by VID:PID"""
+    devices = {}
+    for lineno, line in enumerate(path.read_text().splitlines(), 1):
+        line = line.strip()
+        if not line or line.startswith('#'):
+            continue
+        m = ROW.match(line)
+        if not m:
+            raise DatabaseError(f"{path.name}:{lineno}: cannot parse '{line}'")
+
+        vid, pid = int(m.group(1), 16), int(m.group(2), 16)
+        quirks = [] if m.group(6) == '-' else m.group(6).split(',')
+        dev = {
+            'vid': vid, 'pid': pid, 'layout': m.group(3),
+            'report_len': int(m.group(4)), 'idle': int(m.group(5)),
+            'quirks': quirks, 'name': m.group(7).strip(),
+        }
+        if dev['layout'] not in LAYOUTS:
+            raise DatabaseError(f"{path.name}:{lineno}: unknown layout '{dev['layout']}'")
+        for q in quirks:
+            if q not in QUIRKS:
+                raise DatabaseError(f"{path.name}:{lineno}: unknown quirk '{q}'")
+        if dev['report_len'] > 255 or dev['idle'] > 255:
+            raise DatabaseError(f"{path.name}:{lineno}: report and idle must fit a byte")
+        if (vid, pid) in devices:
+            raise DatabaseError(f"{path.name}:{lineno}: {vid:04x}:{pid:04x} listed twice")
+        devices[(vid, pid)] = dev
+
+    if not devices:
+        raise DatabaseError(f"{path.name}: no devices")
+    return [devices[k] for k in sorted(devices)]
+
+def save(devices, path=DATABASE):
+    """Rewrite the rows, keeping the comment header"""
+    header = []
+    for line in path.read_text().splitlines():
+        if line.strip() and not line.startswith('#'):
+            break
+        header.append(line)
+
+    rows = []
+    for dev in sorted(devices, key=lambda d: (d['vid'], d['pid'])):
+        quirks = ','.join(dev['quirks']) or '-'
+        rows.append(f"{dev['vid']:04x}:{dev['pid']:04x}   {dev['layout']:<11} "
+                    f"{dev['report_len']:<7} {dev['idle']:<5} {quirks:<16} {dev['name']}")
+    path.write_text('\n'.join(header + rows) + '\n')
+
+def update(vid, pid, **fields):
+    """Add or change one pad; an existing name is kept unless given"""
+    devices = load()
+    for dev in devices:
+        if (dev['vid'], dev['pid']) == (vid, pid):
+            fields = {k: v for k, v in fields.items() if k != 'name' or v}
+            dev.update(fields)
+            break
+    else:
+        dev = {'vid': vid, 'pid': pid, 'layout': 'descriptor', 'report_len': 0,
+               'idle': 0, 'quirks': [], 'name': f"USB pad {vid:04x}:{pid:04x}"}
+        dev.update({k: v for k, v in fields.items() if v is not None})
+        devices.append(dev)
+    save(devices)
+
+def c_string(text):
+    return '"' + text.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def plan_name(dev):
+    return f"plan_{dev['vid']:04x}_{dev['pid']:04x}"
+
+def c_table(devices):
+    plans = PLAN_HEADER.read_text() if PLAN_HEADER.exists() else ''
+    for dev in devices:
+        if dev['layout'] == 'plan' and f"decode_plan {plan_name(dev)} " not in plans:
+            raise DatabaseError(f"{dev['vid']:04x}:{dev['pid']:04x}: layout plan but "
+                                f"{PLAN_HEADER.name} has no {plan_name(dev)}")
+
+    text = f"""/*
+ * Known pads, generated by tools/device_db.py from tools/devices.txt
+ *
+ * Do not edit: change the database and run "make devices". Sorted by
+ * VID:PID for the binary search in find_device (); the keys are kept
+ * apart from the entries so the search only touches one dense array.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_DEVICE_TABLE_HEADER
+#define GRUB_SNES_DEVICE_TABLE_HEADER 1
+
+#define SNES_KNOWN_DEVICES      {len(devices)}
+
+static const grub_uint32_t known_device_keys[SNES_KNOWN_DEVICES] = {{
+"""
+    text += ''.join(f"    0x{d['vid']:04x}{d['pid']:04x},\n" for d in devices)
+    text += "};\n\nstatic const struct snes_device_id known_devices[SNES_KNOWN_DEVICES] = {\n"
+    for d in devices:
+        quirks = ' | '.join(QUIRKS[q] for q in d['quirks']) or '0'
+        plan = '&' + plan_name(d) if d['layout'] == 'plan' else 'NULL'
+        name = c_string(f"{d['name']} ({d['vid']:04x}:{d['pid']:04x})")
+        text += (f"    {{ {name}, {quirks}, {d['idle']}, {d['report_len']}, "
+                 f"{LAYOUTS[d['layout']]}, {plan} }},\n")
+    text += "};\n\n#endif /* ! GRUB_SNES_DEVICE_TABLE_HEADER */\n"
+    return text
+
+def python_table(devices, var):
+    rows = ''.join(f"    (0x{d['vid']:04x}, 0x{d['pid']:04x}): {json.dumps(d['name'])},\n"
+                   for d in devices)
+    return f"{var} = {{\n{rows}}}\n"
+
+def docs_table(devices):
+    text = "| VID:PID | Controller | Decoding |\n|---------|------------|----------|\n"
+    for d in devices:
+        text += f"| `{d['vid']:04x}:{d['pid']:04x}` | {d['name']} | {LAYOUT_DOCS[d['layout']]} |\n"
+    return text
+
+def replace_block(text, begin, end, body, path):
+    """Swap the lines between the begin and end markers for body"""
+    pattern = re.compile(rf'({re.escape(begin)}[^\n]*\n).*?(^[^\n]*{re.escape(end)})',
+                         re.S | re.M)
+    if not pattern.search(text):
+        raise DatabaseError(f"{path.name}: generated block markers not found")
+    return pattern.sub(lambda m: m.group(1) + body + m.group(2), text, count=1)
+
+def outputs(devices):
+    """Path and wanted contents of every generated copy"""
+    files = {C_TABLE: c_table(devices)}
+    for path, var in ((MAPPER, 'KNOWN_CONTROLLERS'), (STANDALONE, 'KNOWN')):
+        files[path] = replace_block(path.read_text(), '# BEGIN GENERATED DEVICES',
+                                    '# END GENERATED DEVICES',
+                                    python_table(devices, var), path)
+    files[DOCS] = replace_block(DOCS.read_text(), '<!-- BEGIN GENERATED DEVICES',
+                                '<!-- END GENERATED DEVICES', docs_table(devices), DOCS)
+    return files
+
+def generate(check=False):
+    """Write the copies, or with check list the stale ones"""
+    stale = []
+    for path, text in outputs(load()).items():
+        if not path.exists() or path.read_text() != text:
+            stale.append(path)
+            if not check:
+                path.write_text(text)
+    return stale
+
+def main():
+    check = '--check' in sys.argv[1:]
+    try:
+        stale = generate(check)
+    except DatabaseError as e:
+        print(f"device_db: {e}", file=sys.stderr)
+        return 1
+
+    for path in stale:
+        rel = path.relative_to(ROOT)
+        print(f"device_db: {rel} is out of date" if check else f"device_db: wrote {rel}")
+    if check and stale:
+        print('device_db: run "make devices"', file=sys.stderr)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
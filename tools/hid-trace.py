@@ -0,0 +1,177 @@
+#!/usr/bin/env python3
+"""
+HID trace files for the SNES gamepad module
+
+A trace is a pad's reports with their timing, in the binary format
+described in docs/hid-reports.md. tests/host replays them through the
+module with the original timing, so a trace from a problem pad can go on
+a ticket and every change can be measured against the same input.
+
+Usage: hid-trace.py capture VID:PID FILE [--seconds N]
+       hid-trace.py dump FILE
+       hid-trace.py from-hex FILE.hex FILE [--interval-ms N] [--id VID:PID]
+"""
+
+import struct
+import sys
+import time
+from pathlib import Path
+
+MAGIC = b'SNTR'
+VERSION = 1
+HEADER = struct.Struct('<4sHHHHHBB')    # magic version vid pid report_len desc_len interval 0
+RECORD = struct.Struct('<IB')           # time_us len, then len payload bytes
+
+USB_REQ_GET_DESCRIPTOR = 0x06
+USB_DESC_HID_REPORT = 0x22
+
+class TraceError(Exception):
+    pass
+
+def write_header(f, vid, pid, report_len, interval=0, desc=b''):
+    f.write(HEADER.pack(MAGIC, VERSION, vid, pid, report_len, len(desc), interval, 0))
+    f.write(desc)
+
+def write_record(f, time_us, report):
+    """One report; an empty one stands for a failed transfer"""
+    f.write(RECORD.pack(time_us & 0xffffffff, len(report)))
+    f.write(report)
+
+def read(path):
+    """Header fields and a list of (time_us, payload)"""
+    data = Path(path).read_bytes()
+    if len(data) < HEADER.size:
+        raise TraceError(f"{path}: too short for a trace header")
+    magic, version, vid, pid, report_len, desc_len, interval, _ = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION:
+        raise TraceError(f"{path}: not a version {VERSION} trace")
+
+    pos = HEADER.size + desc_len
+    header = {'vid': vid, 'pid': pid, 'report_len': report_len, 'interval': interval,
+              'desc': data[HEADER.size:pos]}
+    records = []
+    while pos < len(data):
+        if pos + RECORD.size > len(data):
+            raise TraceError(f"{path}: truncated record at offset {pos}")
+        time_us, length = RECORD.unpack_from(data, pos)
+        pos += RECORD.size
+        if pos + length > len(data):
+            raise TraceError(f"{path}: truncated payload at offset {pos}")
+        records.append((time_us, data[pos:pos + length]))
+        pos += length
+    return header, records
+
+def parse_id(text):
+    try:
+        vid, pid = text.split(':')
+        return int(vid, 16), int(pid, 16)
+    except ValueError:
+        raise TraceError(f"'{text}' is not VID:PID")
+
+def capture(device_id, path, seconds=None):
+    """Record a pad until Ctrl+C (or for seconds)"""
+    import usb.core
+    import usb.util
+
+    vid, pid = parse_id(device_id)
+    dev = usb.core.find(idVendor=vid, idProduct=pid)
+    if dev is None:
+        raise TraceError(f"{device_id} not found")
+    try:
+        if dev.is_kernel_driver_active(0):
+            dev.detach_kernel_driver(0)
+    except usb.core.USBError:
+        pass
+    try:
+        dev.set_configuration()
+    except usb.core.USBError:
+        pass
+
+    intf = dev.get_active_configuration()[(0, 0)]
+    ep = usb.util.find_descriptor(
+        intf, custom_match=lambda e:
+        usb.util.endpoint_direction(e.bEndpointAddress) == usb.util.ENDPOINT_IN
+        and usb.util.endpoint_type(e.bmAttributes) == usb.util.ENDPOINT_TYPE_INTR)
+    if ep is None:
+        raise TraceError("no interrupt IN endpoint")
+
+    # What the module will fetch at attach, so descriptor pads replay too
+    try:
+        desc = bytes(dev.ctrl_transfer(0x81, USB_REQ_GET_DESCRIPTOR, USB_DESC_HID_REPORT << 8,
+                                       intf.bInterfaceNumber, 1024))
+    except usb.core.USBError:
+        desc = b''
+
+    count = errors = 0
+    with open(path, 'wb') as f:
+        write_header(f, vid, pid, ep.wMaxPacketSize, ep.bInterval, desc)
+        start = time.monotonic()
+        print(f"Capturing {device_id} to {path}, Ctrl+C to stop")
+        try:
+            while seconds is None or time.monotonic() - start < seconds:
+                try:
+                    report = bytes(dev.read(ep.bEndpointAddress, ep.wMaxPacketSize, 100))
+                except usb.core.USBTimeoutError:
+                    continue
+                except usb.core.USBError:
+                    report = b''
+                    errors += 1
+                write_record(f, int((time.monotonic() - start) * 1e6), report)
+                count += 1
+        except KeyboardInterrupt:
+            pass
+    usb.util.dispose_resources(dev)
+    print(f"\n{count} reports ({errors} failed transfers) in {path}")
+
+def dump(path):
+    header, records = read(path)
+    print(f"# {header['vid']:04x}:{header['pid']:04x} report_len {header['report_len']} "
+          f"interval {header['interval']} descriptor {len(header['desc'])} bytes")
+    for time_us, report in records:
+        print(f"{time_us / 1000:10.3f}  {report.hex(' ') if report else '(error)'}")
+
+def from_hex(src, path, interval_ms=8, device_id=None):
+    """A tests/host .hex stream with evenly spaced reports"""
+    reports = []
+    for line in Path(src).read_text().splitlines():
+        line = line.split('#', 1)[0].strip()
+        if line:
+            reports.append(bytes.fromhex(line))
+    if not reports:
+        raise TraceError(f"{src}: no reports")
+
+    vid, pid = parse_id(device_id) if device_id else (0x0810, 0xe501)
+    with open(path, 'wb') as f:
+        write_header(f, vid, pid, max(len(r) for r in reports), interval_ms)
+        for i, report in enumerate(reports):
+            write_record(f, i * interval_ms * 1000, report)
+
+def option(args, name, default):
+    if name in args:
+        i = args.index(name)
+        value = args[i + 1]
+        del args[i:i + 2]
+        return value
+    return default
+
+def main():
+    args = sys.argv[1:]
+    try:
+        if len(args) >= 3 and args[0] == 'capture':
+            seconds = option(args, '--seconds', None)
+            capture(args[1], args[2], float(seconds) if seconds else None)
+        elif len(args) == 2 and args[0] == 'dump':
+            dump(args[1])
+        elif len(args) >= 3 and args[0] == 'from-hex':
+            interval = int(option(args, '--interval-ms', 8))
+            from_hex(args[1], args[2], interval, option(args, '--id', None))
+        else:
+            print(__doc__.strip().split('\n\n')[-1], file=sys.stderr)
+            return 2
+    except (TraceError, OSError, IndexError) as e:
+        print(f"hid-trace: {e}", file=sys.stderr)
+        return 1
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
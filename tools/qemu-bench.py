@@ -0,0 +1,372 @@
+#!/usr/bin/env python3
+"""
+End-to-end latency benchmark for the SNES gamepad module in QEMU
+
+A synthetic SNES pad (0810:e501) is made on the host with the USB gadget
+framework on dummy_hcd and redirected into QEMU with usb-host, so GRUB
+sees a real interrupt endpoint and the module runs its normal attach and
+poll paths. GRUB talks over a serial socket; the script timestamps:
+
+  boot    QEMU start to the first line grub.cfg prints
+  attach  that line to "SNES Gamepad connected"
+  press   a report written to the pad to the menu redrawing on serial
+
+Presses alternate down and up over a menu with no timeout, each held
+until the menu reacts and released before the next, so auto-repeat stays
+out of the numbers.
+
+Usage: sudo qemu-bench.py [--presses N] [--controller uhci|ohci|ehci] [--iso FILE]
+                          [--output FILE] [--no-kvm]
+
+--controller picks the host controller the pad sits on (uhci by default);
+the module keeps a ring of transfers on UHCI and one transfer on OHCI and
+EHCI, so run each before changing the transfer ring. --output appends one
+JSON line per run for tracking builds over time.
+Needs root, the dummy_hcd and libcomposite kernel modules, QEMU and a
+built GRUB tree (make build).
+"""
+
+import json
+import os
+import socket
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+from pathlib import Path
+
+ROOT = Path(__file__).resolve().parent.parent
+GRUB_DIR = ROOT / "grub"
+GADGET = Path("/sys/kernel/config/usb_gadget/snes_bench")
+
+VID, PID = 0x0810, 0xe501
+REPORT_LEN = 8
+NEUTRAL = bytes([0x7f, 0x7f, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00])
+DOWN = bytes([0x7f, 0xff, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00])
+UP = bytes([0x7f, 0x00, 0x7f, 0x7f, 0x00, 0x00, 0x00, 0x00])
+
+# Four 8-bit axes, 12 buttons, padding: the 8-byte generic SNES report
+REPORT_DESC = bytes([
+    0x05, 0x01, 0x09, 0x05, 0xa1, 0x01,
+    0x15, 0x00, 0x26, 0xff, 0x00, 0x75, 0x08, 0x95, 0x04,
+    0x09, 0x30, 0x09, 0x31, 0x09, 0x32, 0x09, 0x35, 0x81, 0x02,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x0c, 0x15, 0x00, 0x25, 0x01,
+    0x75, 0x01, 0x95, 0x0c, 0x81, 0x02,
+    0x75, 0x01, 0x95, 0x14, 0x81, 0x03,
+    0xc0,
+])
+
+MARK_GRUB = b"snes-bench: grub"
+MARK_ATTACH = b"SNES Gamepad connected"
+MARK_MENU = b"snes-bench: menu"
+
+GRUB_CFG = """\
+serial --unit=0 --speed=115200
+terminal_output serial
+terminal_input serial
+set timeout=-1
+echo "snes-bench: grub"
+insmod @CONTROLLER@
+insmod usb_snes_gamepad
+echo "snes-bench: menu"
+menuentry "Entry 1" { true }
+menuentry "Entry 2" { true }
+menuentry "Entry 3" { true }
+"""
+
+ATTACH_TIMEOUT = 20.0
+PRESS_TIMEOUT = 2.0
+QUIET_MS = 150          # No serial output for this long: the menu is idle
+
+# QEMU device for each controller and whether the pad must be high speed
+CONTROLLERS = {
+    "uhci": ("piix3-usb-uhci", False),
+    "ohci": ("pci-ohci", False),
+    "ehci": ("usb-ehci", True),
+}
+
+class BenchError(Exception):
+    pass
+
+def write(path, value):
+    Path(path).write_text(value)
+
+class Pad:
+    """A USB HID gadget on dummy_hcd: full speed for UHCI and OHCI, high for EHCI"""
+
+    def __init__(self, high_speed=False):
+        subprocess.run(["modprobe", "libcomposite"], check=True)
+        if GADGET.exists():
+            self.remove()
+        # The speed is a module parameter, so reload for a different one
+        subprocess.run(["modprobe", "-r", "dummy_hcd"], check=False,
+                       stderr=subprocess.DEVNULL)
+        subprocess.run(["modprobe", "dummy_hcd", f"is_high_speed={int(high_speed)}"],
+                       check=True)
+
+        GADGET.mkdir()
+        write(GADGET / "idVendor", f"0x{VID:04x}")
+        write(GADGET / "idProduct", f"0x{PID:04x}")
+        write(GADGET / "bcdUSB", "0x0200" if high_speed else "0x0110")
+        strings = GADGET / "strings/0x409"
+        strings.mkdir(parents=True)
+        write(strings / "manufacturer", "snes-bench")
+        write(strings / "product", "Synthetic SNES pad")
+        write(strings / "serialnumber", "0")
+
+        func = GADGET / "functions/hid.usb0"
+        func.mkdir(parents=True)
+        write(func / "protocol", "0")
+        write(func / "subclass", "0")
+        write(func / "report_length", str(REPORT_LEN))
+        (func / "report_desc").write_bytes(REPORT_DESC)
+
+        config = GADGET / "configs/c.1"
+        config.mkdir(parents=True)
+        write(config / "MaxPower", "100")
+        (config / "hid.usb0").symlink_to(func)
+
+        udcs = os.listdir("/sys/class/udc")
+        dummy = [u for u in udcs if u.startswith("dummy_udc")]
+        if not dummy:
+            raise BenchError("no dummy_udc controller (is dummy_hcd loaded?)")
+        write(GADGET / "UDC", dummy[0])
+
+        major, minor = (func / "dev").read_text().split(":")
+        self.node = next(p for p in Path("/dev").glob("hidg*")
+                         if os.stat(p).st_rdev == os.makedev(int(major), int(minor)))
+        self.fd = None
+
+    def open(self):
+        self.fd = os.open(self.node, os.O_WRONLY)
+        self.send(NEUTRAL)
+
+    def send(self, report):
+        """Queue a report; returns the time it was handed to the gadget"""
+        t = time.monotonic()
+        os.write(self.fd, report)
+        return t
+
+    @staticmethod
+    def remove():
+        if (GADGET / "UDC").exists():
+            try:
+                write(GADGET / "UDC", "\n")
+            except OSError:
+                pass
+        for link in (GADGET / "configs/c.1").glob("hid.*"):
+            link.unlink()
+        for d in ("configs/c.1/strings/0x409", "configs/c.1", "functions/hid.usb0",
+                  "strings/0x409", ""):
+            if (GADGET / d).exists():
+                (GADGET / d).rmdir()
+
+    def close(self):
+        if self.fd is not None:
+            os.close(self.fd)
+        self.remove()
+
+class Serial:
+    """GRUB's serial port, every chunk timestamped as it arrives"""
+
+    def __init__(self, path, timeout=10.0):
+        deadline = time.monotonic() + timeout
+        while True:
+            try:
+                self.sock = socket.socket(socket.AF_UNIX)
+                self.sock.connect(str(path))
+                break
+            except OSError:
+                self.sock.close()
+                if time.monotonic() > deadline:
+                    raise BenchError("QEMU serial socket did not appear")
+                time.sleep(0.05)
+        self.chunks = []
+        self.cond = threading.Condition()
+        threading.Thread(target=self._read, daemon=True).start()
+
+    def _read(self):
+        while True:
+            data = self.sock.recv(4096)
+            if not data:
+                break
+            with self.cond:
+                self.chunks.append((time.monotonic(), data))
+                self.cond.notify_all()
+
+    def wait_for(self, marker, timeout):
+        """Time of the chunk completing marker"""
+        deadline = time.monotonic() + timeout
+        with self.cond:
+            while True:
+                text = b""
+                for t, data in self.chunks:
+                    text += data
+                    if marker in text:
+                        return t
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    raise BenchError(f"timed out waiting for '{marker.decode()}'")
+                self.cond.wait(left)
+
+    def wait_output(self, since, timeout):
+        """Time of the first chunk after since, or None"""
+        deadline = time.monotonic() + timeout
+        with self.cond:
+            while True:
+                after = [t for t, _ in self.chunks if t > since]
+                if after:
+                    return after[0]
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    return None
+                self.cond.wait(left)
+
+    def wait_quiet(self, ms, timeout=5.0):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            with self.cond:
+                last = self.chunks[-1][0] if self.chunks else 0
+            if time.monotonic() - last >= ms / 1000:
+                return
+            time.sleep(ms / 4000)
+        raise BenchError("the menu never went quiet")
+
+def make_iso(workdir, controller):
+    """The ISO tree of test.iso with the benchmark grub.cfg"""
+    tree = workdir / "iso"
+    if (ROOT / "iso").is_dir():
+        subprocess.run(["cp", "-a", str(ROOT / "iso"), str(tree)], check=True)
+    (tree / "boot/grub").mkdir(parents=True, exist_ok=True)
+    (tree / "boot/grub/grub.cfg").write_text(GRUB_CFG.replace("@CONTROLLER@", controller))
+
+    iso = workdir / "bench.iso"
+    mkrescue = GRUB_DIR / "grub-mkrescue"
+    if not mkrescue.exists():
+        raise BenchError("grub/grub-mkrescue not found, run make build first")
+    subprocess.run([str(mkrescue), "-o", str(iso), str(tree)], check=True,
+                   stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return iso
+
+def percentile(values, pct):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(len(ordered) * pct / 100))]
+
+def run(presses, iso, kvm, controller="uhci"):
+    device, high_speed = CONTROLLERS[controller]
+    workdir = Path(tempfile.mkdtemp(prefix="snes-bench-"))
+    serial_path = workdir / "serial.sock"
+    qmp_path = workdir / "qmp.sock"
+    iso = Path(iso) if iso else make_iso(workdir, controller)
+
+    pad = Pad(high_speed)
+    qemu = None
+    try:
+        cmd = ["qemu-system-x86_64", "-cdrom", str(iso), "-m", "256M",
+               "-display", "none", "-vga", "std",
+               "-chardev", f"socket,id=ser,path={serial_path},server=on,wait=off",
+               "-serial", "chardev:ser",
+               "-qmp", f"unix:{qmp_path},server=on,wait=off",
+               "-device", f"{device},id=usbc",
+               "-device", f"usb-host,bus=usbc.0,vendorid=0x{VID:04x},productid=0x{PID:04x}"]
+        if kvm:
+            cmd.append("-enable-kvm")
+
+        start = time.monotonic()
+        qemu = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        serial = Serial(serial_path)
+        pad.open()
+
+        t_grub = serial.wait_for(MARK_GRUB, ATTACH_TIMEOUT)
+        t_attach = serial.wait_for(MARK_ATTACH, ATTACH_TIMEOUT)
+        serial.wait_for(MARK_MENU, ATTACH_TIMEOUT)
+        serial.wait_quiet(QUIET_MS)
+
+        latencies = []
+        missed = 0
+        for i in range(presses):
+            t_press = pad.send(DOWN if i % 2 == 0 else UP)
+            t_resp = serial.wait_output(t_press, PRESS_TIMEOUT)
+            pad.send(NEUTRAL)
+            if t_resp is None:
+                missed += 1
+            else:
+                latencies.append((t_resp - t_press) * 1000)
+            serial.wait_quiet(QUIET_MS)
+
+        if not latencies:
+            raise BenchError("the menu never reacted to the pad")
+        return {
+            "controller": controller,
+            "boot_ms": round((t_grub - start) * 1000, 1),
+            "attach_ms": round((t_attach - t_grub) * 1000, 1),
+            "presses": presses,
+            "missed": missed,
+            "press_median_ms": round(statistics.median(latencies), 2),
+            "press_p99_ms": round(percentile(latencies, 99), 2),
+            "press_max_ms": round(max(latencies), 2),
+        }
+    finally:
+        if qemu:
+            try:
+                with socket.socket(socket.AF_UNIX) as qmp:
+                    qmp.connect(str(qmp_path))
+                    qmp.sendall(b'{"execute": "qmp_capabilities"}\n{"execute": "quit"}\n')
+                    qemu.wait(timeout=5)
+            except (OSError, subprocess.TimeoutExpired):
+                qemu.kill()
+        pad.close()
+
+def git_revision():
+    try:
+        return subprocess.run(["git", "-C", str(ROOT), "describe", "--always", "--dirty"],
+                              capture_output=True, text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return "unknown"
+
+def option(args, name, default):
+    if name in args:
+        i = args.index(name)
+        value = args[i + 1]
+        del args[i:i + 2]
+        return value
+    return default
+
+def main():
+    args = sys.argv[1:]
+    try:
+        presses = int(option(args, "--presses", 50))
+        iso = option(args, "--iso", None)
+        output = option(args, "--output", None)
+        controller = option(args, "--controller", "uhci")
+        if controller not in CONTROLLERS:
+            raise ValueError(controller)
+    except (IndexError, ValueError):
+        print(__doc__.strip().split("\n\n")[-2], file=sys.stderr)
+        return 2
+    kvm = "--no-kvm" not in args
+    if os.geteuid() != 0:
+        print("qemu-bench: needs root for the USB gadget and usb-host", file=sys.stderr)
+        return 1
+
+    try:
+        result = run(presses, iso, kvm, controller)
+    except (BenchError, OSError, subprocess.CalledProcessError) as e:
+        print(f"qemu-bench: {e}", file=sys.stderr)
+        return 1
+
+    print(f"{controller}: boot {result['boot_ms']} ms, attach {result['attach_ms']} ms")
+    print(f"press -> menu: median {result['press_median_ms']} ms, "
+          f"p99 {result['press_p99_ms']} ms, max {result['press_max_ms']} ms "
+          f"({result['presses'] - result['missed']}/{result['presses']} presses)")
+    if output:
+        result["revision"] = git_revision()
+        result["time"] = time.strftime("%Y-%m-%dT%H:%M:%S")
+        with open(output, "a") as f:
+            f.write(json.dumps(result) + "\n")
+    return 0 if result["missed"] == 0 else 1
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -37,17 +37,20 @@ def err(t): print(f"{C.R}✗ {t}{C.N}")
 def info(t): print(f"{C.C}ℹ {t}{C.N}")
 def warn(t): print(f"{C.Y}⚠ {t}{C.N}")
 
-# Known controllers
+# Known controllers (from tools/devices.txt)
+# BEGIN GENERATED DEVICES - run "make devices" to update
 KNOWN = {
-    (0x0810, 0xe501): "Generic Chinese SNES",
+    (0x0079, 0x0006): "DragonRise Gamepad",
     (0x0079, 0x0011): "DragonRise Generic",
+    (0x046d, 0xc218): "Logitech F510",
     (0x0583, 0x2060): "iBuffalo SNES",
-    (0x2dc8, 0x9018): "8BitDo SN30",
+    (0x0810, 0x0001): "Generic USB Gamepad",
+    (0x0810, 0xe501): "Generic Chinese SNES",
     (0x12bd, 0xd015): "Generic 2-pack SNES",
     (0x1a34, 0x0802): "USB Gamepad",
-    (0x0810, 0x0001): "Generic USB Gamepad",
-    (0x0079, 0x0006): "DragonRise Gamepad",
+    (0x2dc8, 0x9018): "8BitDo SN30",
 }
+# END GENERATED DEVICES
 
 def find_controllers():
     """Find USB game controllers"""
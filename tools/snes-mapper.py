@@ -9,9 +9,14 @@ import sys
 import time
 import json
 import struct
+import re
 import subprocess
+import threading
+from collections import Counter, deque
 from pathlib import Path
 
+import device_db
+
 # Check if running as root (needed for USB access)
 if os.geteuid() != 0:
     print("This tool needs root access to read USB devices.")
@@ -66,17 +71,20 @@ def print_info(text):
 def print_warning(text):
     print(f"{Colors.YELLOW}⚠ {text}{Colors.RESET}")
 
-# Known SNES controller vendor/product IDs
+# Known SNES controller vendor/product IDs (from tools/devices.txt)
+# BEGIN GENERATED DEVICES - run "make devices" to update
 KNOWN_CONTROLLERS = {
-    (0x0810, 0xe501): "Generic Chinese SNES",
+    (0x0079, 0x0006): "DragonRise Gamepad",
     (0x0079, 0x0011): "DragonRise Generic",
+    (0x046d, 0xc218): "Logitech F510",
     (0x0583, 0x2060): "iBuffalo SNES",
-    (0x2dc8, 0x9018): "8BitDo SN30",
+    (0x0810, 0x0001): "Generic USB Gamepad",
+    (0x0810, 0xe501): "Generic Chinese SNES",
     (0x12bd, 0xd015): "Generic 2-pack SNES",
     (0x1a34, 0x0802): "USB Gamepad",
-    (0x0810, 0x0001): "Generic USB Gamepad",
-    (0x0079, 0x0006): "DragonRise Gamepad",
+    (0x2dc8, 0x9018): "8BitDo SN30",
 }
+# END GENERATED DEVICES
 
 def find_game_controllers():
     """Find all connected USB game controllers"""
@@ -178,88 +186,148 @@ def setup_device(controller):
         print_error("Could not find interrupt endpoint!")
         sys.exit(1)
 
-    return dev, ep
+    # Only boot-class interfaces take SET_PROTOCOL
+    controller['boot_interface'] = intf.bInterfaceSubClass == 1
 
-def read_report(dev, ep, timeout=100):
-    """Read a single HID report"""
-    try:
-        data = dev.read(ep.bEndpointAddress, ep.wMaxPacketSize, timeout)
-        return bytes(data)
-    except usb.core.USBTimeoutError:
-        return None
-    except Exception as e:
-        return None
+    return dev, ep
 
-def get_baseline(dev, ep):
+# Reports kept for the mapping steps: about 30 s of a pad sending every 8 ms
+RING_SIZE = 4096
+READ_TIMEOUT_MS = 100
+BASELINE_SECONDS = 0.5
+
+class ReportReader(threading.Thread):
+    """
+    Keeps one interrupt read outstanding and pushes (time, report) into a
+    bounded ring, so reports that arrive while the mapping steps print or
+    think are still there when they look
+    """
+
+    def __init__(self, dev, ep):
+        super().__init__(daemon=True)
+        self.dev = dev
+        self.ep = ep
+        self.ring = deque(maxlen=RING_SIZE)
+        self.cond = threading.Condition()
+        self.running = True
+        self.dropped = 0
+        self.error = None
+
+    def run(self):
+        while self.running:
+            try:
+                report = bytes(self.dev.read(self.ep.bEndpointAddress, self.ep.wMaxPacketSize,
+                                             READ_TIMEOUT_MS))
+            except usb.core.USBTimeoutError:
+                continue
+            except usb.core.USBError as e:
+                with self.cond:
+                    self.error = e
+                    self.running = False
+                    self.cond.notify()
+                return
+            with self.cond:
+                if len(self.ring) == self.ring.maxlen:
+                    self.dropped += 1
+                self.ring.append((time.monotonic(), report))
+                self.cond.notify()
+
+    def get(self, timeout):
+        """The oldest unread (time, report), or None after timeout seconds"""
+        deadline = time.monotonic() + timeout
+        with self.cond:
+            # Short waits so Ctrl+C reaches the main thread
+            while not self.ring and self.running:
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    return None
+                self.cond.wait(min(left, 0.1))
+            return self.ring.popleft() if self.ring else None
+
+    def stop(self):
+        self.running = False
+        self.join(READ_TIMEOUT_MS / 1000 * 2)
+
+def get_baseline(reader):
     """Get baseline report (no buttons pressed)"""
     print_info("Reading baseline (don't press anything)...")
-    time.sleep(0.5)
 
-    # Read several reports and use the most common
+    # Everything since the reader started plus a short window; the most
+    # common report is the rest state
     reports = []
-    for _ in range(20):
-        report = read_report(dev, ep, timeout=50)
-        if report:
-            reports.append(report)
-        time.sleep(0.05)
+    end = time.monotonic() + BASELINE_SECONDS
+    while time.monotonic() < end:
+        item = reader.get(end - time.monotonic())
+        if item:
+            reports.append(item[1])
+
+    # A pad that only reports on change says nothing at rest: its last
+    # report after a press and release is the rest state
+    if not reports and not reader.error:
+        print_info("No reports at rest: press and release any button")
+        item = reader.get(10.0)
+        while item:
+            reports = [item[1]]
+            item = reader.get(0.3)
 
     if not reports:
-        print_error("Could not read from controller!")
+        print_error(f"Could not read from controller! {reader.error or ''}")
         sys.exit(1)
 
-    # Use the most common report as baseline
-    baseline = max(set(reports), key=reports.count)
-    print_success(f"Baseline: {baseline.hex()}")
+    baseline = Counter(reports).most_common(1)[0][0]
+    print_success(f"Baseline: {baseline.hex()} ({len(reports)} reports)")
     return baseline
 
-def wait_for_button(dev, ep, baseline, button_name, timeout=30):
-    """Wait for user to press a button and detect which one"""
-    print(f"\n{Colors.YELLOW}>>> Press {Colors.BOLD}{button_name}{Colors.RESET}{Colors.YELLOW} <<<{Colors.RESET}")
-    print(f"{Colors.DIM}(waiting {timeout} seconds...){Colors.RESET}")
-
-    start_time = time.time()
-    detected_changes = []
-
-    while time.time() - start_time < timeout:
-        report = read_report(dev, ep, timeout=50)
-
-        if report and report != baseline:
-            # Found a different report - button pressed!
-            changes = []
-            for i, (a, b) in enumerate(zip(baseline, report)):
-                if a != b:
-                    changes.append({
-                        'byte': i,
-                        'baseline': a,
-                        'pressed': b,
-                        'diff': b ^ a
-                    })
-
-            if changes:
-                detected_changes.append({
-                    'report': report,
-                    'changes': changes
-                })
-
-                # Wait for button release
-                print(f"{Colors.DIM}Detected! Waiting for release...{Colors.RESET}")
-                while True:
-                    report = read_report(dev, ep, timeout=50)
-                    if report == baseline:
-                        break
-                    time.sleep(0.01)
-
-                return detected_changes[0]
-
-        time.sleep(0.01)
-
-    return None
+def report_changes(baseline, report):
+    return [{'byte': i, 'baseline': a, 'pressed': b, 'diff': a ^ b}
+            for i, (a, b) in enumerate(zip(baseline, report)) if a != b]
+
+def wait_for_press(reader, baseline, timeout=30):
+    """
+    The next press in the ring: reports from the first one that leaves the
+    baseline until the pad is back at rest. The report furthest from rest
+    stands for the press, so an axis still travelling is not caught half way.
+    """
+    best = None
+    changed = None
+    deadline = time.monotonic() + timeout
+    while True:
+        left = deadline - time.monotonic()
+        item = reader.get(max(left, 0) if best is None else 1.0)
+        if item is None:
+            # Never released (or the pad only reports on change and went quiet)
+            break
+        report = item[1]
+        if report == baseline:
+            if best is not None:
+                break
+            continue
+        bits = sum(bin(c['diff']).count('1') for c in report_changes(baseline, report))
+        score = (bits, sum(abs(a - b) for a, b in zip(baseline, report)))
+        if best is None or score > changed:
+            best, changed = report, score
+        if best is not None and left <= 0:
+            break
+
+    if best is None:
+        return None
+    return {'report': best, 'changes': report_changes(baseline, best)}
 
 def map_controller(dev, ep):
     """Interactive mapping process"""
     print_step(2, 4, "Mapping controller buttons")
 
-    baseline = get_baseline(dev, ep)
+    reader = ReportReader(dev, ep)
+    reader.start()
+    try:
+        return map_controls(reader)
+    finally:
+        reader.stop()
+
+def map_controls(reader):
+    """One pass over every control: presses queue up in the ring, so they
+    can come as fast as the user goes through the list"""
+    baseline = get_baseline(reader)
 
     buttons_to_map = [
         ("D-PAD UP", "dpad_up"),
@@ -282,30 +350,44 @@ def map_controller(dev, ep):
         'buttons': {}
     }
 
-    print(f"\n{Colors.BOLD}Press each button when prompted.{Colors.RESET}")
-    print(f"{Colors.DIM}Press Ctrl+C to skip a button.{Colors.RESET}\n")
+    print(f"\n{Colors.BOLD}Press each control once, in this order, at your own pace:{Colors.RESET}")
+    print(f"  {', '.join(name for name, _ in buttons_to_map)}")
+    print(f"{Colors.DIM}No need to wait for each prompt. Press Ctrl+C to skip a control.{Colors.RESET}\n")
 
+    seen = {}
+    start = time.monotonic()
     for display_name, key_name in buttons_to_map:
+        print(f"{Colors.YELLOW}>>> {Colors.BOLD}{display_name}{Colors.RESET}")
         try:
-            result = wait_for_button(dev, ep, baseline, display_name)
-
-            if result:
+            while True:
+                result = wait_for_press(reader, baseline)
+                if not result:
+                    print_warning(f"Timeout - skipping {display_name}")
+                    break
+                key = tuple((c['byte'], c['diff']) for c in result['changes'])
+                if key in seen:
+                    # A second press of the same control: keep waiting for this one
+                    print_warning(f"That was {seen[key]} again - press {display_name}")
+                    continue
+                seen[key] = display_name
                 mapping['buttons'][key_name] = {
                     'changes': result['changes'],
                     'report': result['report'].hex()
                 }
-
-                # Show what was detected
                 for change in result['changes']:
                     print_success(f"Detected: Byte {change['byte']}: "
                                 f"0x{change['baseline']:02x} -> 0x{change['pressed']:02x}")
-            else:
-                print_warning(f"Timeout - skipping {display_name}")
+                break
 
         except KeyboardInterrupt:
             print_warning(f"Skipped {display_name}")
             continue
 
+    print_info(f"Mapped {len(mapping['buttons'])} controls in {time.monotonic() - start:.1f} s")
+    if reader.dropped:
+        print_warning(f"{reader.dropped} reports dropped: the ring filled up")
+    if reader.error:
+        print_error(f"Controller read failed: {reader.error}")
     return mapping
 
 def generate_config(controller, mapping):
@@ -333,46 +415,208 @@ def generate_config(controller, mapping):
 
     print_success(f"Saved config: {config_path}")
 
-    # Generate C code snippet
-    c_code = generate_c_code(controller, mapping)
-    c_path = config_dir / f"controller_{controller['vendor_id']:04x}_{controller['product_id']:04x}.c"
+    # Add the pad to the header the module is built with
+    header_path = write_device_header(controller, mapping, DEVICE_HEADER)
+    print_success(f"Updated device header: {header_path}")
 
-    with open(c_path, 'w') as f:
-        f.write(c_code)
+    return config_path, header_path
 
-    print_success(f"Saved C code: {c_path}")
+# Generated header included by usb_snes_gamepad.c and copied by build.sh
+DEVICE_HEADER = Path(__file__).parent.parent / "src" / "snes_devices.h"
 
-    return config_path, c_path
+# Decoded state bit of each mapped control (STATE_* in the module)
+CONTROL_BITS = {
+    'dpad_up': 0, 'dpad_down': 1, 'dpad_left': 2, 'dpad_right': 3,
+    'btn_x': 4, 'btn_a': 5, 'btn_b': 6, 'btn_y': 7,
+    'btn_l': 8, 'btn_r': 9, 'btn_select': 10, 'btn_start': 11,
+}
 
-def generate_c_code(controller, mapping):
-    """Generate C code for the GRUB module"""
-    code = f'''/*
- * Auto-generated controller configuration
- * Controller: {controller['name']}
- * VID: 0x{controller['vendor_id']:04x}  PID: 0x{controller['product_id']:04x}
- */
+# Directions read as one axis: (low control, high control, AXIS_DEST_*)
+AXIS_PAIRS = [('dpad_up', 'dpad_down', 0), ('dpad_left', 'dpad_right', 2)]
 
-/* Add to supported_controllers[] array: */
-{{ 0x{controller['vendor_id']:04x}, 0x{controller['product_id']:04x}, "{controller['name']}" }},
+# Hat positions counted clockwise from north, two steps per direction
+HAT_STEPS = {'dpad_up': 0, 'dpad_right': 2, 'dpad_down': 4, 'dpad_left': 6}
 
-/* HID Report Analysis:
- * Report size: {mapping['report_size']} bytes
- * Baseline (neutral): {mapping['baseline']}
- */
+PLAN_MAX_OPS = 8
+AXIS_CENTER = 0x7f
+AXIS_THRESHOLD = 0x40
+
+def single_change(mapping, name):
+    """The one byte a control changes, or None"""
+    btn = mapping['buttons'].get(name)
+    if not btn or len(btn['changes']) != 1:
+        return None
+    return btn['changes'][0]
+
+def axis_op(mapping, low, high, dest):
+    """PLAN_AXIS op for a pair of directions moving one 8-bit axis"""
+    changes = [c for c in (single_change(mapping, low), single_change(mapping, high)) if c]
+    if not changes or len({c['byte'] for c in changes}) != 1:
+        return None
+    for c in changes:
+        if (abs(c['baseline'] - AXIS_CENTER) > AXIS_THRESHOLD
+                or abs(c['pressed'] - AXIS_CENTER) <= AXIS_THRESHOLD):
+            return None
+
+    # Low direction reading high means the axis runs the other way
+    c = single_change(mapping, low)
+    inverted = c['pressed'] > AXIS_CENTER if c else changes[0]['pressed'] < AXIS_CENTER
+    return {'kind': 'PLAN_AXIS', 'width': 8, 'dest': dest,
+            'bit': changes[0]['byte'] * 8, 'base': 0,
+            'flip': 0xff if inverted else 0, 'controls': [low, high]}
+
+def hat_op(mapping):
+    """PLAN_HAT op for directions that step one nibble round the compass"""
+    changes = {d: single_change(mapping, d) for d in HAT_STEPS}
+    changes = {d: c for d, c in changes.items() if c}
+    if 'dpad_up' not in changes or len({c['byte'] for c in changes.values()}) != 1:
+        return None
 
-'''
+    diff = 0
+    for c in changes.values():
+        diff |= c['diff']
+    shift = 4 if diff & 0xf0 else 0
+    if diff & (0x0f << (4 - shift)):
+        return None
+
+    base = (changes['dpad_up']['pressed'] >> shift) & 0xf
+    for d, c in changes.items():
+        if ((c['pressed'] >> shift) & 0xf) != (base + HAT_STEPS[d]) & 0xf:
+            return None
+
+    return {'kind': 'PLAN_HAT', 'width': 4, 'dest': 0,
+            'bit': changes['dpad_up']['byte'] * 8 + shift, 'base': base,
+            'flip': 0, 'controls': list(changes)}
+
+def button_runs(buttons):
+    """Merge single-bit buttons into PLAN_BUTTONS runs"""
+    runs = []
+    for bit, dest, active_low, name in sorted(buttons):
+        run = runs[-1] if runs else None
+        if (run and bit == run['bit'] + run['width'] and dest == run['dest'] + run['width']
+                and run['width'] < 16):
+            run['flip'] |= active_low << run['width']
+            run['width'] += 1
+            run['controls'].append(name)
+        else:
+            runs.append({'kind': 'PLAN_BUTTONS', 'width': 1, 'dest': dest, 'bit': bit,
+                         'base': 0, 'flip': int(active_low), 'controls': [name]})
+    return runs
+
+def build_plan(mapping):
+    """
+    Turn the detected changes into decode plan ops.
+    Returns (ops, unmapped controls); ops is None if they do not fit.
+    """
+    ops = []
+    done = set()
+
+    for low, high, dest in AXIS_PAIRS:
+        op = axis_op(mapping, low, high, dest)
+        if op:
+            ops.append(op)
+            done.update(op['controls'])
+
+    if not done:
+        op = hat_op(mapping)
+        if op:
+            ops.append(op)
+            done.update(op['controls'])
+
+    buttons = []
+    unmapped = []
+    for name, dest in CONTROL_BITS.items():
+        if name in done or name not in mapping['buttons']:
+            continue
+        c = single_change(mapping, name)
+        if c is None or bin(c['diff']).count('1') != 1:
+            unmapped.append(name)
+            continue
+        pos = c['diff'].bit_length() - 1
+        buttons.append((c['byte'] * 8 + pos, dest, bool(c['baseline'] & c['diff']), name))
+    ops += button_runs(buttons)
+
+    if len(ops) > PLAN_MAX_OPS:
+        return None, unmapped
+    return ops, unmapped
 
-    # Analyze the mapping to generate button detection code
-    if mapping['buttons']:
-        code += "/* Button mappings detected:\n"
-        for btn_name, btn_data in mapping['buttons'].items():
-            for change in btn_data['changes']:
-                code += f" * {btn_name}: byte[{change['byte']}] "
-                code += f"0x{change['baseline']:02x} -> 0x{change['pressed']:02x}\n"
-        code += " */\n"
+def generate_c_code(controller, mapping):
+    """Header block holding one pad's decode plan, or None if it needs none"""
+    vid, pid = controller['vendor_id'], controller['product_id']
+
+    ops, unmapped = build_plan(mapping)
+    for control in unmapped:
+        print_warning(f"{control}: not a single bit, axis or hat - left unmapped")
+    if ops is None:
+        print_warning("Too many fields for a fixed plan - using the report descriptor")
+        return None
 
+    code = f"/* BEGIN {vid:04x}:{pid:04x} */\n"
+    code += f"/* {controller['name']}, baseline {mapping['baseline']} */\n"
+    code += f"static const struct decode_plan plan_{vid:04x}_{pid:04x} = {{\n"
+    code += f"    .report_id = 0,\n"
+    code += f"    .report_len = {mapping['report_size']},\n"
+    code += f"    .n_ops = {len(ops)},\n"
+    code += f"    .ops = {{\n"
+    lines = []
+    for op in ops:
+        lines.append(f"        /* {', '.join(op['controls'])}: "
+                     f"byte {op['bit'] // 8} bit {op['bit'] % 8} */\n"
+                     f"        {{ .kind = {op['kind']}, .width = {op['width']}, "
+                     f".dest = {op['dest']}, .base = {op['base']}, "
+                     f".bit = {op['bit']}, .flip = 0x{op['flip']:x} }}")
+    code += ",\n".join(lines) + "\n"
+    code += f"    }}\n"
+    code += f"}};\n"
+    code += f"/* END {vid:04x}:{pid:04x} */\n"
     return code
 
+def write_device_header(controller, mapping, path):
+    """
+    Replace this pad's plan in the generated header, keeping the others,
+    then record the pad in the device database and regenerate its tables
+    """
+    blocks = {}
+    if path.exists():
+        for key, body in re.findall(r'/\* BEGIN ([0-9a-f]{4}:[0-9a-f]{4}) \*/\n(.*?)/\* END \1 \*/\n',
+                                    path.read_text(), re.S):
+            blocks[key] = f"/* BEGIN {key} */\n{body}/* END {key} */\n"
+
+    vid, pid = controller['vendor_id'], controller['product_id']
+    key = f"{vid:04x}:{pid:04x}"
+    code = generate_c_code(controller, mapping)
+    if code:
+        blocks[key] = code
+    else:
+        blocks.pop(key, None)
+
+    text = """/*
+ * Decode plans of pads mapped with tools/snes-mapper.py
+ *
+ * Generated file: edit by re-running the mapper, not by hand. Each plan
+ * sits between its BEGIN and END markers, which the mapper uses to
+ * replace that pad and keep the others. The pads' known_devices entries
+ * come from tools/devices.txt.
+ *
+ * License: GPLv3+
+ */
+
+#ifndef GRUB_SNES_DEVICES_HEADER
+#define GRUB_SNES_DEVICES_HEADER 1
+
+"""
+    for k in sorted(blocks):
+        text += blocks[k] + "\n"
+    text += "#endif /* ! GRUB_SNES_DEVICES_HEADER */\n"
+    path.write_text(text)
+
+    quirks = [] if controller.get('boot_interface') else ['no-set-protocol']
+    device_db.update(vid, pid, name=controller['name'], quirks=quirks,
+                     layout='plan' if code else 'descriptor',
+                     report_len=mapping['report_size'] if code else 0)
+    device_db.generate()
+    return path
+
 def show_summary(controller, mapping, config_path, c_path):
     """Show final summary"""
     print_step(4, 4, "Summary")
@@ -392,9 +636,8 @@ def show_summary(controller, mapping, config_path, c_path):
     print()
 
     print(f"{Colors.CYAN}Next steps:{Colors.RESET}")
-    print(f"  1. Review the generated files")
-    print(f"  2. Add the controller to src/usb_snes_gamepad.c")
-    print(f"  3. Build and test: make build && make test")
+    print(f"  1. Review the new block in {c_path.name}")
+    print(f"  2. Build and test: make build && make test")
     print()
 
     print(f"{Colors.GREEN}{Colors.BOLD}Done!{Colors.RESET}")